@@ -0,0 +1,112 @@
+#!/usr/bin/env python3
+
+#
+# This script is the training workload of the profile-guided
+# optimization (PGO) of the plugin, and the benchmark used to measure
+# the gains of LTO and PGO. It must be run against an Orthanc server
+# that has loaded the plugin, and that indexes the folder given on
+# the command line:
+#
+#  1. It populates the indexed folder with a synthetic tree of copies
+#     of a sample DICOM file, each copy having a distinct SOP instance
+#     UID (this uses pydicom), and measures the time needed by the
+#     crawler to index all of them ("crawl path").
+#
+#  2. It reads back the indexed instances through the REST API, both
+#     whole and by ranges, and measures the throughput ("read path").
+#
+# Usage: ./PgoTraining.py <sample.dcm> <indexed folder> [options]
+#
+
+import argparse
+import base64
+import json
+import os
+import shutil
+import sys
+import time
+import urllib.request
+
+import pydicom
+import pydicom.uid
+
+
+parser = argparse.ArgumentParser(description = 'Training workload and benchmark of the indexer plugin.')
+parser.add_argument('sample', help = 'Sample DICOM file to be copied')
+parser.add_argument('folder', help = 'Folder that is indexed by the plugin (its "synthetic" subfolder will be overwritten)')
+parser.add_argument('--url', default = 'http://localhost:8042', help = 'Base URL of Orthanc')
+parser.add_argument('--username', default = None, help = 'Username for the REST API of Orthanc')
+parser.add_argument('--password', default = None, help = 'Password for the REST API of Orthanc')
+parser.add_argument('--directories', type = int, default = 100, help = 'Number of synthetic directories')
+parser.add_argument('--files', type = int, default = 100, help = 'Number of files per synthetic directory')
+parser.add_argument('--reads', type = int, default = 10000, help = 'Number of reads through the REST API')
+parser.add_argument('--timeout', type = int, default = 3600, help = 'Maximum time to wait for the crawler (in seconds)')
+args = parser.parse_args()
+
+
+def DoGet(uri, headers = {}):
+    request = urllib.request.Request(args.url + uri, headers = headers)
+    if args.username != None:
+        token = base64.b64encode(('%s:%s' % (args.username, args.password)).encode('utf-8'))
+        request.add_header('Authorization', 'Basic %s' % token.decode('ascii'))
+    with urllib.request.urlopen(request) as response:
+        return response.read()
+
+
+def CountInstances():
+    return json.loads(DoGet('/statistics'))['CountInstances']
+
+
+##
+## Crawl path
+##
+
+target = os.path.join(args.folder, 'synthetic')
+if os.path.exists(target):
+    shutil.rmtree(target)
+
+initialCount = CountInstances()
+dicom = pydicom.dcmread(args.sample)
+
+for i in range(args.directories):
+    directory = os.path.join(target, '%04d' % i)
+    os.makedirs(directory)
+    for j in range(args.files):
+        dicom.SOPInstanceUID = pydicom.uid.generate_uid()
+        dicom.file_meta.MediaStorageSOPInstanceUID = dicom.SOPInstanceUID
+        dicom.save_as(os.path.join(directory, '%06d.dcm' % j))
+
+expected = initialCount + args.directories * args.files
+start = time.time()
+
+while CountInstances() < expected:
+    if time.time() - start > args.timeout:
+        print('Timeout while waiting for the crawler')
+        sys.exit(-1)
+    time.sleep(0.1)
+
+elapsed = time.time() - start
+print('Crawl path: %d files indexed in %.2f seconds (%.1f files/second)' % (
+    args.directories * args.files, elapsed, args.directories * args.files / elapsed))
+
+
+##
+## Read path
+##
+
+instances = json.loads(DoGet('/instances'))
+
+start = time.time()
+size = 0
+
+for i in range(args.reads):
+    instance = instances[i % len(instances)]
+    if i % 2 == 0:
+        size += len(DoGet('/instances/%s/file' % instance))
+    else:
+        # The DICOM tags are read using "StorageReadRange()"
+        size += len(DoGet('/instances/%s/tags?simplify' % instance))
+
+elapsed = time.time() - start
+print('Read path: %d reads in %.2f seconds (%.1f reads/second, %.1f MB/second)' % (
+    args.reads, elapsed, args.reads / elapsed, size / elapsed / (1024.0 * 1024.0)))
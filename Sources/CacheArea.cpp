@@ -0,0 +1,148 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "CacheArea.h"
+
+#include <OrthancException.h>
+
+#include <cassert>
+
+
+void CacheArea::AddInMemory(const std::string& uuid,
+                            const std::string& instanceId,
+                            int32_t type,
+                            uint64_t size)
+{
+  Content::iterator found = content_.find(uuid);
+  if (found != content_.end())
+  {
+    size_ -= found->second.size_;
+    recency_.erase(found->second.recency_);
+    content_.erase(found);
+  }
+
+  recency_.push_front(uuid);
+
+  Entry& entry = content_[uuid];
+  entry.instanceId_ = instanceId;
+  entry.type_ = type;
+  entry.size_ = size;
+  entry.recency_ = recency_.begin();
+  size_ += size;
+}
+
+
+CacheArea::CacheArea(IndexerDatabase& database,
+                     uint64_t maximumSize) :
+  database_(database),
+  maximumSize_(maximumSize),
+  size_(0)
+{
+  if (maximumSize == 0)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+  }
+
+  std::list<IndexerDatabase::CacheAttachment> attachments;
+  database_.ListCacheAttachments(attachments);
+
+  // Without any access information, the oldest attachments are
+  // considered as the least recently used
+  for (std::list<IndexerDatabase::CacheAttachment>::const_iterator
+         it = attachments.begin(); it != attachments.end(); ++it)
+  {
+    AddInMemory(it->uuid_, it->instanceId_, it->type_, it->size_);
+  }
+}
+
+
+void CacheArea::Add(const std::string& uuid,
+                    const std::string& instanceId,
+                    int32_t type,
+                    uint64_t size)
+{
+  database_.AddCacheAttachment(uuid, instanceId, type, size);
+
+  boost::mutex::scoped_lock lock(mutex_);
+  AddInMemory(uuid, instanceId, type, size);
+}
+
+
+void CacheArea::Touch(const std::string& uuid)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  Content::iterator found = content_.find(uuid);
+  if (found != content_.end())
+  {
+    recency_.splice(recency_.begin(), recency_, found->second.recency_);
+  }
+}
+
+
+void CacheArea::Remove(const std::string& uuid)
+{
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Content::iterator found = content_.find(uuid);
+    if (found == content_.end())
+    {
+      return;
+    }
+
+    size_ -= found->second.size_;
+    recency_.erase(found->second.recency_);
+    content_.erase(found);
+  }
+
+  database_.RemoveCacheAttachment(uuid);
+}
+
+
+bool CacheArea::SelectVictim(IndexerDatabase::CacheAttachment& victim)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  if (size_ <= maximumSize_ ||
+      recency_.empty())
+  {
+    return false;
+  }
+  else
+  {
+    Content::const_iterator found = content_.find(recency_.back());
+    assert(found != content_.end());
+
+    victim.uuid_ = found->first;
+    victim.instanceId_ = found->second.instanceId_;
+    victim.type_ = found->second.type_;
+    victim.size_ = found->second.size_;
+    return true;
+  }
+}
+
+
+void CacheArea::GetStatistics(uint64_t& size,
+                              size_t& count)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  size = size_;
+  count = content_.size();
+}
@@ -0,0 +1,84 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include "IndexerDatabase.h"
+
+#include <map>
+
+
+/**
+ * Bookkeeping of the cache attachments of Orthanc (i.e. attachments
+ * that Orthanc can recompute from the DICOM file, such as
+ * "dicom-until-pixel-data"), whose total size is bounded. The
+ * attachments are evicted in LRU order. The list of attachments is
+ * persisted in the database of the plugin, whereas their recency is
+ * only tracked in memory, so as not to write to the database on each
+ * read.
+ **/
+class CacheArea : public boost::noncopyable
+{
+private:
+  typedef std::list<std::string>  Recency;  // Most recently used first
+
+  struct Entry
+  {
+    std::string        instanceId_;
+    int32_t            type_;
+    uint64_t           size_;
+    Recency::iterator  recency_;
+  };
+
+  typedef std::map<std::string, Entry>  Content;
+
+  IndexerDatabase&  database_;
+  uint64_t          maximumSize_;
+  boost::mutex      mutex_;
+  Recency           recency_;
+  Content           content_;
+  uint64_t          size_;
+
+  void AddInMemory(const std::string& uuid,
+                   const std::string& instanceId,
+                   int32_t type,
+                   uint64_t size);
+
+public:
+  // Reloads the attachments that were recorded by former executions
+  CacheArea(IndexerDatabase& database,
+            uint64_t maximumSize);
+
+  void Add(const std::string& uuid,
+           const std::string& instanceId,
+           int32_t type,
+           uint64_t size);
+
+  // Marks the attachment as recently used (no-op if not tracked)
+  void Touch(const std::string& uuid);
+
+  void Remove(const std::string& uuid);
+
+  // Returns "false" iff. the area is below its maximum size. The
+  // returned attachment is the least recently used one.
+  bool SelectVictim(IndexerDatabase::CacheAttachment& victim);
+
+  void GetStatistics(uint64_t& size,
+                     size_t& count);
+};
@@ -0,0 +1,189 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "ChunkWorkers.h"
+
+#include <Logging.h>
+#include <OrthancException.h>
+
+#include <memory>
+
+
+void ChunkWorkers::Worker(ChunkWorkers* that,
+                          size_t worker,
+                          ThreadPriority::Level priority)
+{
+  ThreadPriority::ApplyToCurrentThread(priority);
+
+  for (;;)
+  {
+    std::unique_ptr<Chunk> chunk;
+
+    {
+      boost::mutex::scoped_lock lock(that->mutex_);
+
+      while (!that->done_ &&
+             !that->aborted_ &&
+             that->pending_.empty())
+      {
+        that->pushed_.wait(lock);
+      }
+
+      if (that->aborted_ ||
+          that->pending_.empty())
+      {
+        return;
+      }
+
+      chunk.reset(that->pending_.front());
+      that->pending_.pop_front();
+    }
+
+    that->popped_.notify_one();
+
+    bool success;
+
+    try
+    {
+      success = that->handler_.Process(worker, *chunk);
+    }
+    catch (Orthanc::OrthancException& e)
+    {
+      LOG(ERROR) << "Error while processing a chunk of a directory: " << e.What();
+      success = true;
+    }
+
+    if (!success)
+    {
+      {
+        boost::mutex::scoped_lock lock(that->mutex_);
+        that->aborted_ = true;
+        that->ClearPending();
+      }
+
+      // Wake up the crawler, and the other workers
+      that->pushed_.notify_all();
+      that->popped_.notify_all();
+      return;
+    }
+  }
+}
+
+
+void ChunkWorkers::ClearPending()
+{
+  for (std::deque<Chunk*>::iterator it = pending_.begin(); it != pending_.end(); ++it)
+  {
+    delete *it;
+  }
+
+  pending_.clear();
+}
+
+
+ChunkWorkers::ChunkWorkers(IHandler& handler,
+                           size_t threadsCount,
+                           size_t maximumPending,
+                           ThreadPriority::Level priority) :
+  handler_(handler),
+  maximumPending_(maximumPending),
+  done_(false),
+  aborted_(false)
+{
+  if (threadsCount == 0 ||
+      maximumPending == 0)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+  }
+
+  for (size_t i = 0; i < threadsCount; i++)
+  {
+    workers_.push_back(new boost::thread(Worker, this, i, priority));
+  }
+}
+
+
+ChunkWorkers::~ChunkWorkers()
+{
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    aborted_ = true;  // No-op if "Join()" was called
+  }
+
+  Join();
+}
+
+
+bool ChunkWorkers::Push(Chunk& chunk)
+{
+  std::unique_ptr<Chunk> item(new Chunk);
+  item->swap(chunk);
+
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (done_)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+
+    while (!aborted_ &&
+           pending_.size() >= maximumPending_)
+    {
+      popped_.wait(lock);
+    }
+
+    if (aborted_)
+    {
+      return false;
+    }
+
+    pending_.push_back(item.release());
+  }
+
+  pushed_.notify_one();
+  return true;
+}
+
+
+bool ChunkWorkers::Join()
+{
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    done_ = true;
+  }
+
+  pushed_.notify_all();
+
+  for (size_t i = 0; i < workers_.size(); i++)
+  {
+    if (workers_[i]->joinable())
+    {
+      workers_[i]->join();
+    }
+
+    delete workers_[i];
+  }
+
+  workers_.clear();
+
+  boost::mutex::scoped_lock lock(mutex_);
+  ClearPending();  // Only non-empty if aborted
+  return !aborted_;
+}
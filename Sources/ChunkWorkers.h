@@ -0,0 +1,89 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include "ThreadPriority.h"
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/thread.hpp>
+#include <deque>
+#include <string>
+#include <vector>
+
+
+/**
+ * Pool of threads processing the chunks of entries of a huge
+ * directory, while its crawler goes on enumerating the directory.
+ * The queue of the pending chunks is bounded, so that the crawler is
+ * throttled by the workers, and so that the memory remains bounded
+ * whatever the size of the directory.
+ **/
+class ChunkWorkers : public boost::noncopyable
+{
+public:
+  typedef std::vector<std::string>  Chunk;
+
+  class IHandler : public boost::noncopyable
+  {
+  public:
+    virtual ~IHandler()
+    {
+    }
+
+    // Called concurrently by the workers, "worker" being the index of
+    // the calling worker. Returns "false" to abandon the directory.
+    virtual bool Process(size_t worker,
+                         const Chunk& chunk) = 0;
+  };
+
+private:
+  IHandler&                    handler_;
+  size_t                       maximumPending_;
+  boost::mutex                 mutex_;
+  boost::condition_variable    pushed_;
+  boost::condition_variable    popped_;
+  std::deque<Chunk*>           pending_;
+  bool                         done_;
+  bool                         aborted_;
+  std::vector<boost::thread*>  workers_;
+
+  static void Worker(ChunkWorkers* that,
+                     size_t worker,
+                     ThreadPriority::Level priority);
+
+  void ClearPending();
+
+public:
+  ChunkWorkers(IHandler& handler,
+               size_t threadsCount,
+               size_t maximumPending,
+               ThreadPriority::Level priority);
+
+  ~ChunkWorkers();
+
+  // Swaps the content of "chunk" into the queue, waiting while the
+  // queue is full. Returns "false" iff. the directory was abandoned.
+  bool Push(Chunk& chunk);
+
+  // Waits for all the pushed chunks to be processed, and stops the
+  // workers. Returns "false" iff. the directory was abandoned.
+  bool Join();
+};
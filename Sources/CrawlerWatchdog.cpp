@@ -0,0 +1,308 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "CrawlerWatchdog.h"
+
+#include <Logging.h>
+#include <OrthancException.h>
+
+
+CrawlerWatchdog::Operation::Operation(CrawlerWatchdog& watchdog,
+                                      size_t root,
+                                      const char* name,
+                                      const std::string& path) :
+  watchdog_(watchdog),
+  root_(root)
+{
+  boost::mutex::scoped_lock lock(watchdog_.mutex_);
+
+  PendingOperation operation;
+  operation.name_ = std::string(name) + " " + path;
+  operation.start_ = boost::posix_time::microsec_clock::universal_time();
+  operation.reported_ = false;
+
+  PendingOperations& operations = watchdog_.roots_[root_].operations_;
+  position_ = operations.insert(operations.end(), operation);
+}
+
+
+CrawlerWatchdog::Operation::~Operation()
+{
+  boost::mutex::scoped_lock lock(watchdog_.mutex_);
+  watchdog_.roots_[root_].operations_.erase(position_);
+}
+
+
+void CrawlerWatchdog::QuarantineInternal(Root& root,
+                                         const std::string& reason,
+                                         const boost::posix_time::ptime& now)
+{
+  if (root.healthy_)
+  {
+    LOG(ERROR) << "Indexer plugin is quarantining folder " << root.path_ << ": " << reason;
+  }
+  else
+  {
+    LOG(WARNING) << "Indexer plugin has failed again on quarantined folder " << root.path_ << ": " << reason;
+  }
+
+  // The operations that are pending at this point are responsible
+  // for this failure, and must not be reported once more
+  for (PendingOperations::iterator it = root.operations_.begin(); it != root.operations_.end(); ++it)
+  {
+    it->reported_ = true;
+  }
+
+  root.healthy_ = false;
+  root.failures_++;
+  root.lastFailure_ = reason;
+
+  // Exponential backoff, starting from the minimum backoff
+  unsigned int backoff = minimumBackoff_;
+  for (unsigned int i = 1; i < root.failures_ && backoff < maximumBackoff_; i++)
+  {
+    backoff *= 2;
+  }
+
+  if (backoff > maximumBackoff_)
+  {
+    backoff = maximumBackoff_;
+  }
+
+  root.retryTime_ = now + boost::posix_time::seconds(backoff);
+}
+
+
+CrawlerWatchdog::CrawlerWatchdog(const std::list<std::string>& roots,
+                                 unsigned int stallTimeout,
+                                 unsigned int minimumBackoff,
+                                 unsigned int maximumBackoff) :
+  stallTimeout_(stallTimeout),
+  minimumBackoff_(minimumBackoff),
+  maximumBackoff_(maximumBackoff)
+{
+  if (stallTimeout_ == 0 ||
+      minimumBackoff_ == 0 ||
+      maximumBackoff_ < minimumBackoff_)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+  }
+
+  roots_.resize(roots.size());
+
+  size_t i = 0;
+  for (std::list<std::string>::const_iterator it = roots.begin(); it != roots.end(); ++it, i++)
+  {
+    roots_[i].path_ = *it;
+    roots_[i].healthy_ = true;
+    roots_[i].failures_ = 0;
+  }
+}
+
+
+const std::string& CrawlerWatchdog::GetRootPath(size_t root) const
+{
+  if (root >= roots_.size())
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+  }
+  else
+  {
+    return roots_[root].path_;  // Constant after construction, no need for the mutex
+  }
+}
+
+
+void CrawlerWatchdog::CheckStalls(const boost::posix_time::ptime& now)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  for (size_t i = 0; i < roots_.size(); i++)
+  {
+    Root& root = roots_[i];
+
+    // The oldest pending operation that has not caused a quarantine
+    // yet is the first one to stall. This also escalates a quarantined
+    // root whose retry stalls again, while an operation that remains
+    // hung is only reported once.
+    for (PendingOperations::const_iterator it = root.operations_.begin(); it != root.operations_.end(); ++it)
+    {
+      if (!it->reported_)
+      {
+        if (now - it->start_ > boost::posix_time::seconds(stallTimeout_))
+        {
+          QuarantineInternal(root, "Stalled operation: " + it->name_, now);
+        }
+
+        break;
+      }
+    }
+  }
+}
+
+
+void CrawlerWatchdog::ReportFailure(size_t root,
+                                    const std::string& reason,
+                                    const boost::posix_time::ptime& now)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  if (root >= roots_.size())
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+  }
+  else
+  {
+    QuarantineInternal(roots_[root], reason, now);
+  }
+}
+
+
+void CrawlerWatchdog::ReportScanCompleted(size_t root)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  if (root >= roots_.size())
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+  }
+  else if (!roots_[root].healthy_)
+  {
+    LOG(WARNING) << "Indexer plugin has recovered folder " << roots_[root].path_;
+    roots_[root].healthy_ = true;
+    roots_[root].failures_ = 0;
+  }
+}
+
+
+bool CrawlerWatchdog::IsHealthy(size_t root) const
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  if (root >= roots_.size())
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+  }
+  else
+  {
+    return roots_[root].healthy_;
+  }
+}
+
+
+bool CrawlerWatchdog::IsBlocked(size_t root) const
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  if (root >= roots_.size())
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+  }
+  else
+  {
+    return (!roots_[root].healthy_ &&
+            !roots_[root].operations_.empty());
+  }
+}
+
+
+unsigned int CrawlerWatchdog::GetFailuresCount(size_t root) const
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  if (root >= roots_.size())
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+  }
+  else
+  {
+    return roots_[root].failures_;
+  }
+}
+
+
+bool CrawlerWatchdog::IsScanAllowed(size_t root,
+                                    const boost::posix_time::ptime& now) const
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  if (root >= roots_.size())
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+  }
+  else
+  {
+    return (roots_[root].healthy_ ||
+            now >= roots_[root].retryTime_);
+  }
+}
+
+
+unsigned int CrawlerWatchdog::GetUnhealthyCount() const
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  unsigned int count = 0;
+  for (size_t i = 0; i < roots_.size(); i++)
+  {
+    if (!roots_[i].healthy_)
+    {
+      count++;
+    }
+  }
+
+  return count;
+}
+
+
+void CrawlerWatchdog::Format(Json::Value& target) const
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  target = Json::arrayValue;
+
+  for (size_t i = 0; i < roots_.size(); i++)
+  {
+    const Root& root = roots_[i];
+
+    Json::Value item = Json::objectValue;
+    item["Path"] = root.path_;
+    item["Healthy"] = root.healthy_;
+    item["Failures"] = root.failures_;
+
+    if (!root.operations_.empty())
+    {
+      item["CurrentOperation"] = root.operations_.front().name_;
+      item["CurrentOperationStart"] = boost::posix_time::to_iso_string(root.operations_.front().start_);
+      item["CurrentOperationsCount"] = static_cast<unsigned int>(root.operations_.size());
+    }
+
+    if (!root.lastFailure_.empty())
+    {
+      item["LastFailure"] = root.lastFailure_;
+    }
+
+    if (!root.healthy_)
+    {
+      item["NextRetry"] = boost::posix_time::to_iso_string(root.retryTime_);
+    }
+
+    target.append(item);
+  }
+}
@@ -0,0 +1,134 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <json/value.h>
+#include <list>
+#include <string>
+#include <vector>
+
+
+/**
+ * Tracks the health of the roots that are crawled by the plugin, each
+ * of them being crawled by its own thread. A root is quarantined if
+ * a filesystem operation of its crawler has been running for longer
+ * than the stall timeout (which typically happens with a hung network
+ * mount), or if the root cannot be read. A quarantined root is
+ * retried with an exponential backoff, and becomes healthy again
+ * once it has been completely scanned. A retry that stalls again
+ * counts as a new failure, which lengthens the backoff.
+ **/
+class CrawlerWatchdog : public boost::noncopyable
+{
+private:
+  struct PendingOperation
+  {
+    std::string               name_;
+    boost::posix_time::ptime  start_;
+    bool                      reported_;  // Whether the root was quarantined while it was pending
+  };
+
+  // Several operations can run concurrently on the same root, if
+  // its huge directories are processed by several workers
+  typedef std::list<PendingOperation>  PendingOperations;
+
+public:
+  // Marks a filesystem operation of a crawler that could block
+  class Operation : public boost::noncopyable
+  {
+  private:
+    CrawlerWatchdog&             watchdog_;
+    size_t                       root_;
+    PendingOperations::iterator  position_;
+
+  public:
+    Operation(CrawlerWatchdog& watchdog,
+              size_t root,
+              const char* name,
+              const std::string& path);
+
+    ~Operation();
+  };
+
+private:
+  struct Root
+  {
+    std::string               path_;
+    bool                      healthy_;
+    PendingOperations         operations_;  // Sorted by start time
+    unsigned int              failures_;
+    std::string               lastFailure_;
+    boost::posix_time::ptime  retryTime_;
+  };
+
+  mutable boost::mutex  mutex_;
+  std::vector<Root>     roots_;
+  unsigned int          stallTimeout_;
+  unsigned int          minimumBackoff_;
+  unsigned int          maximumBackoff_;
+
+  void QuarantineInternal(Root& root,
+                          const std::string& reason,
+                          const boost::posix_time::ptime& now);
+
+public:
+  // All the durations are expressed in seconds
+  CrawlerWatchdog(const std::list<std::string>& roots,
+                  unsigned int stallTimeout,
+                  unsigned int minimumBackoff,
+                  unsigned int maximumBackoff);
+
+  size_t GetRootsCount() const
+  {
+    return roots_.size();
+  }
+
+  const std::string& GetRootPath(size_t root) const;
+
+  // To be called periodically by the watchdog thread
+  void CheckStalls(const boost::posix_time::ptime& now);
+
+  void ReportFailure(size_t root,
+                     const std::string& reason,
+                     const boost::posix_time::ptime& now);
+
+  // Called once a full scan of the root has completed
+  void ReportScanCompleted(size_t root);
+
+  bool IsHealthy(size_t root) const;
+
+  // Whether the crawler is stuck in a stalled operation
+  bool IsBlocked(size_t root) const;
+
+  // The crawler must abandon its scan if this number has changed
+  // since the beginning of the scan
+  unsigned int GetFailuresCount(size_t root) const;
+
+  // Returns "false" while a quarantined root is backing off
+  bool IsScanAllowed(size_t root,
+                     const boost::posix_time::ptime& now) const;
+
+  unsigned int GetUnhealthyCount() const;
+
+  void Format(Json::Value& target) const;
+};
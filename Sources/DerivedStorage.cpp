@@ -0,0 +1,305 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "DerivedStorage.h"
+
+#include "DicomMetaInformation.h"
+
+#include "../Resources/Orthanc/Plugins/OrthancPluginCppWrapper.h"
+
+#include <Logging.h>
+#include <OrthancException.h>
+#include <SystemToolbox.h>
+#include <Toolbox.h>
+
+#include <boost/filesystem.hpp>
+
+
+static const uintmax_t  MAXIMUM_META_INFORMATION_SIZE = 64 * 1024;
+static const unsigned int  IDLE_SECONDS = 10;  // Delay before looking for new files once all are processed
+
+
+static void RemoveQuietly(const std::string& path)
+{
+  boost::system::error_code error;
+  boost::filesystem::remove(path, error);
+}
+
+
+std::string DerivedStorage::GetDerivedPath(const std::string& path) const
+{
+  std::string hash;
+  Orthanc::Toolbox::ComputeSHA1(hash, path);
+
+  boost::filesystem::path result(root_);
+  result /= hash.substr(0, 2);
+  result /= hash.substr(2, 2);
+  result /= hash + ".dcm";
+  return result.string();
+}
+
+
+void DerivedStorage::Worker(DerivedStorage* that,
+                            ThreadPriority::Level priority)
+{
+  ThreadPriority::ApplyToCurrentThread(priority);
+
+  for (;;)
+  {
+    bool active;
+
+    try
+    {
+      active = that->Step();
+    }
+    catch (Orthanc::OrthancException& e)
+    {
+      LOG(ERROR) << "Error in the transcoding thread of the Indexer plugin: " << e.What();
+      active = false;
+    }
+
+    boost::mutex::scoped_lock lock(that->mutex_);
+
+    if (!active &&
+        !that->stop_)
+    {
+      that->condition_.timed_wait(lock, boost::posix_time::seconds(IDLE_SECONDS));
+    }
+
+    if (that->stop_)
+    {
+      return;
+    }
+  }
+}
+
+
+void DerivedStorage::Transcode(std::string& target,
+                               const std::string& source)
+{
+  std::unique_ptr<OrthancPlugins::DicomInstance> transcoded(
+    OrthancPlugins::DicomInstance::Transcode(source.empty() ? NULL : source.c_str(), source.size(), transferSyntax_));
+  transcoded->Serialize(target);
+}
+
+
+DerivedStorage::DerivedStorage(IndexerDatabase& database,
+                               const std::string& root,
+                               const std::string& transferSyntax,
+                               uint64_t maximumSize) :
+  database_(database),
+  root_(root),
+  transferSyntax_(transferSyntax),
+  maximumSize_(maximumSize),
+  stop_(false),
+  transcoded_(0),
+  failures_(0),
+  skipped_(0)
+{
+  if (IsJpeg2000(transferSyntax))
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange,
+                                    "Cannot transcode to another JPEG 2000 transfer syntax: " + transferSyntax);
+  }
+
+  if (!IsLossless(transferSyntax))
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange,
+                                    "Cannot transcode to a lossy or unknown transfer syntax: " + transferSyntax);
+  }
+}
+
+
+DerivedStorage::~DerivedStorage()
+{
+  Stop();
+}
+
+
+bool DerivedStorage::IsJpeg2000(const std::string& transferSyntax)
+{
+  return (transferSyntax == "1.2.840.10008.1.2.4.90" ||  // JPEG 2000 lossless
+          transferSyntax == "1.2.840.10008.1.2.4.91");   // JPEG 2000
+}
+
+
+bool DerivedStorage::IsLossless(const std::string& transferSyntax)
+{
+  return (transferSyntax == "1.2.840.10008.1.2" ||         // Implicit VR Little Endian
+          transferSyntax == "1.2.840.10008.1.2.1" ||       // Explicit VR Little Endian
+          transferSyntax == "1.2.840.10008.1.2.1.99" ||    // Deflated Explicit VR Little Endian
+          transferSyntax == "1.2.840.10008.1.2.2" ||       // Explicit VR Big Endian
+          transferSyntax == "1.2.840.10008.1.2.4.57" ||    // JPEG lossless
+          transferSyntax == "1.2.840.10008.1.2.4.70" ||    // JPEG lossless, first-order prediction
+          transferSyntax == "1.2.840.10008.1.2.4.80" ||    // JPEG-LS lossless
+          transferSyntax == "1.2.840.10008.1.2.4.90" ||    // JPEG 2000 lossless
+          transferSyntax == "1.2.840.10008.1.2.4.201" ||   // HTJ2K lossless
+          transferSyntax == "1.2.840.10008.1.2.4.202" ||   // HTJ2K lossless RPCL
+          transferSyntax == "1.2.840.10008.1.2.5");        // RLE lossless
+}
+
+
+void DerivedStorage::Start(ThreadPriority::Level priority)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  if (worker_.joinable())
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+  }
+
+  stop_ = false;
+  worker_ = boost::thread(Worker, this, priority);
+}
+
+
+void DerivedStorage::Stop()
+{
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    stop_ = true;
+  }
+
+  condition_.notify_all();
+
+  if (worker_.joinable())
+  {
+    worker_.join();
+  }
+}
+
+
+bool DerivedStorage::Step()
+{
+  std::string garbage;
+  if (database_.PopDerivedGarbage(garbage))
+  {
+    RemoveQuietly(garbage);
+    return true;
+  }
+
+  std::string path;
+  std::time_t time;
+  uintmax_t size;
+  if (!database_.LookupTranscodingCandidate(path, time, size, cursor_))
+  {
+    if (cursor_.empty())
+    {
+      return false;
+    }
+    else
+    {
+      // Start again from the beginning of the index
+      cursor_.clear();
+      return true;
+    }
+  }
+
+  cursor_ = path;
+
+  const std::string derivedPath = GetDerivedPath(path);
+
+  try
+  {
+    std::string header, transferSyntax;
+    Orthanc::SystemToolbox::ReadFileRange(header, path, 0, std::min(size, MAXIMUM_META_INFORMATION_SIZE), false);
+
+    if (!DicomMetaInformation::LookupString(transferSyntax, header.c_str(), header.size(),
+                                            DicomMetaInformation::TRANSFER_SYNTAX_UID) ||
+        !IsJpeg2000(transferSyntax))
+    {
+      RemoveQuietly(derivedPath);  // Copy of a former version of the file
+      database_.StoreDerivedFile(path, time, size, "");
+      return true;
+    }
+
+    if (maximumSize_ != 0 &&
+        size > maximumSize_)
+    {
+      LOG(INFO) << "Indexer plugin is not transcoding file " << path << ", which is too large: " << size << " bytes";
+
+      // Not retried until the file is modified
+      RemoveQuietly(derivedPath);
+      database_.StoreDerivedFile(path, time, size, "");
+
+      boost::mutex::scoped_lock lock(mutex_);
+      skipped_++;
+      return true;
+    }
+
+    std::string source, target;
+    Orthanc::SystemToolbox::ReadFile(source, path);
+    Transcode(target, source);
+
+    Orthanc::SystemToolbox::MakeDirectory(boost::filesystem::path(derivedPath).parent_path().string());
+    Orthanc::SystemToolbox::WriteFile(target, derivedPath);
+    database_.StoreDerivedFile(path, time, size, derivedPath);
+
+    LOG(INFO) << "Indexer plugin has transcoded file " << path << " into " << derivedPath;
+
+    boost::mutex::scoped_lock lock(mutex_);
+    transcoded_++;
+  }
+  catch (Orthanc::OrthancException& e)
+  {
+    LOG(INFO) << "Indexer plugin cannot transcode file " << path << ": " << e.What();
+
+    // Not retried until the file is modified
+    RemoveQuietly(derivedPath);
+    database_.StoreDerivedFile(path, time, size, "");
+
+    boost::mutex::scoped_lock lock(mutex_);
+    failures_++;
+  }
+
+  return true;
+}
+
+
+bool DerivedStorage::LookupCopy(std::string& derivedPath,
+                                const std::string& path)
+{
+  boost::system::error_code error;
+
+  const std::time_t time = boost::filesystem::last_write_time(path, error);
+  if (error)
+  {
+    return false;
+  }
+
+  const uintmax_t size = boost::filesystem::file_size(path, error);
+  if (error)
+  {
+    return false;
+  }
+
+  return (database_.LookupDerivedFile(derivedPath, path, time, size) &&
+          boost::filesystem::is_regular_file(derivedPath, error));
+}
+
+
+void DerivedStorage::GetStatistics(uint64_t& transcoded,
+                                   uint64_t& failures,
+                                   uint64_t& skipped)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  transcoded = transcoded_;
+  failures = failures_;
+  skipped = skipped_;
+}
@@ -0,0 +1,94 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include "IndexerDatabase.h"
+#include "ThreadPriority.h"
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/thread.hpp>
+
+
+/**
+ * Background transcoding of the JPEG 2000 DICOM files that are stored
+ * by Orthanc, into copies with a faster-decoding transfer syntax that
+ * are written to a separate directory and tracked in the index. The
+ * original file stays authoritative: A copy is only used as long as
+ * its original keeps the same time and size. Only the lossless target
+ * syntaxes are accepted. As a file and its copy are both held in
+ * memory during the transcoding, the files above a maximum size are
+ * skipped.
+ **/
+class DerivedStorage : public boost::noncopyable
+{
+private:
+  IndexerDatabase&           database_;
+  std::string                root_;
+  std::string                transferSyntax_;
+  uint64_t                   maximumSize_;
+  std::string                cursor_;  // Only accessed by "Step()"
+  boost::mutex               mutex_;
+  boost::condition_variable  condition_;
+  bool                       stop_;
+  boost::thread              worker_;
+  uint64_t                   transcoded_;
+  uint64_t                   failures_;
+  uint64_t                   skipped_;
+
+  std::string GetDerivedPath(const std::string& path) const;
+
+  static void Worker(DerivedStorage* that,
+                     ThreadPriority::Level priority);
+
+protected:
+  // Throws an exception if the file cannot be transcoded
+  virtual void Transcode(std::string& target,
+                         const std::string& source);
+
+public:
+  // "maximumSize" is the size in bytes of the largest file to be
+  // transcoded, 0 means no limit
+  DerivedStorage(IndexerDatabase& database,
+                 const std::string& root,
+                 const std::string& transferSyntax,
+                 uint64_t maximumSize);
+
+  virtual ~DerivedStorage();
+
+  static bool IsJpeg2000(const std::string& transferSyntax);
+
+  static bool IsLossless(const std::string& transferSyntax);
+
+  void Start(ThreadPriority::Level priority);
+
+  void Stop();
+
+  // Deletes one obsolete copy, or transcodes one file. Returns "false"
+  // iff. there was nothing to do.
+  bool Step();
+
+  // Returns "false" iff. there is no up-to-date copy of this file
+  bool LookupCopy(std::string& derivedPath,
+                  const std::string& path);
+
+  void GetStatistics(uint64_t& transcoded,
+                     uint64_t& failures,
+                     uint64_t& skipped);
+};
@@ -0,0 +1,325 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "DeviceQueues.h"
+
+#include <Logging.h>
+#include <OrthancException.h>
+
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+#include <fstream>
+#include <memory>
+#include <sys/stat.h>
+
+#if defined(__linux__)
+#  include <sys/sysmacros.h>
+#endif
+
+
+static const unsigned int  STAT_LIMIT_FACTOR = 4;
+
+
+static bool ReadSysfsValue(unsigned int& target,
+                           const boost::filesystem::path& path)
+{
+  std::ifstream f(path.string().c_str());
+
+  unsigned int value;
+  if (f >> value)
+  {
+    target = value;
+    return true;
+  }
+  else
+  {
+    return false;
+  }
+}
+
+
+DeviceQueues::Slot::Slot(DeviceQueues& queues,
+                         size_t device,
+                         Operation operation) :
+  queues_(queues),
+  device_(device),
+  operation_(operation)
+{
+  boost::mutex::scoped_lock lock(queues_.mutex_);
+
+  Device& target = queues_.GetDevice(device_);
+
+  const boost::system_time timeout = (boost::get_system_time() +
+                                      boost::posix_time::seconds(queues_.waitTimeout_));
+
+  while (!queues_.stopped_ &&
+         target.active_[operation_] >= target.limits_[operation_])
+  {
+    if (!target.released_.timed_wait(lock, timeout) &&
+        target.active_[operation_] >= target.limits_[operation_])
+    {
+      LOG(WARNING) << "Indexer plugin is going beyond the limit of device " << target.info_.name_
+                   << ", whose slots are held by stalled operations";
+      queues_.overcommits_++;
+      break;
+    }
+  }
+
+  target.active_[operation_]++;
+}
+
+
+DeviceQueues::Slot::~Slot()
+{
+  boost::mutex::scoped_lock lock(queues_.mutex_);
+
+  Device& target = queues_.GetDevice(device_);
+  target.active_[operation_]--;
+  target.released_.notify_all();
+}
+
+
+DeviceQueues::Device& DeviceQueues::GetDevice(size_t device)
+{
+  if (device >= devices_.size())
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+  }
+  else
+  {
+    return *devices_[device];
+  }
+}
+
+
+DeviceQueues::DeviceQueues(unsigned int rotationalLimit,
+                           unsigned int solidStateLimit,
+                           unsigned int unknownLimit,
+                           unsigned int waitTimeout,
+                           const std::string& sysfs) :
+  rotationalLimit_(rotationalLimit),
+  solidStateLimit_(solidStateLimit),
+  unknownLimit_(unknownLimit),
+  waitTimeout_(waitTimeout),
+  stopped_(false),
+  overcommits_(0),
+  sysfs_(sysfs)
+{
+  if (rotationalLimit == 0 ||
+      solidStateLimit == 0 ||
+      unknownLimit == 0 ||
+      waitTimeout == 0)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+  }
+}
+
+
+DeviceQueues::~DeviceQueues()
+{
+  for (size_t i = 0; i < devices_.size(); i++)
+  {
+    delete devices_[i];
+  }
+}
+
+
+const char* DeviceQueues::Format(DeviceType type)
+{
+  switch (type)
+  {
+    case DeviceType_Unknown:
+      return "Unknown";
+
+    case DeviceType_Rotational:
+      return "Rotational";
+
+    case DeviceType_SolidState:
+      return "SolidState";
+
+    default:
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+  }
+}
+
+
+bool DeviceQueues::ProbeDevice(DeviceInfo& info,
+                               unsigned int major,
+                               unsigned int minor,
+                               const std::string& sysfs)
+{
+  // "/sys/dev/block/major:minor" links to the device, whose request
+  // queue is found in its parent if the device is a partition
+  const boost::filesystem::path device = (boost::filesystem::path(sysfs) / "dev" / "block" /
+                                          (boost::lexical_cast<std::string>(major) + ":" +
+                                           boost::lexical_cast<std::string>(minor)));
+
+  boost::system::error_code error;
+  boost::filesystem::path queue = device / "queue";
+  if (!boost::filesystem::is_directory(queue, error))
+  {
+    queue = device / ".." / "queue";
+    if (!boost::filesystem::is_directory(queue, error))
+    {
+      return false;
+    }
+  }
+
+  unsigned int rotational;
+  if (!ReadSysfsValue(rotational, queue / "rotational"))
+  {
+    return false;
+  }
+
+  info.type_ = (rotational ? DeviceType_Rotational : DeviceType_SolidState);
+
+  if (!ReadSysfsValue(info.queueDepth_, queue / "nr_requests"))
+  {
+    info.queueDepth_ = 0;
+  }
+
+  const boost::filesystem::path canonical = boost::filesystem::canonical(device, error);
+  info.name_ = (error ? device.filename().string() : canonical.filename().string());
+
+  return true;
+}
+
+
+size_t DeviceQueues::Register(const std::string& path)
+{
+  struct stat info;
+  const bool found = (stat(path.c_str(), &info) == 0);
+
+  boost::mutex::scoped_lock lock(mutex_);
+
+  if (found)
+  {
+    for (size_t i = 0; i < devices_.size(); i++)
+    {
+      if (devices_[i]->shared_ &&
+          devices_[i]->id_ == static_cast<uint64_t>(info.st_dev))
+      {
+        return i;
+      }
+    }
+  }
+
+  std::unique_ptr<Device> device(new Device);
+  device->id_ = (found ? static_cast<uint64_t>(info.st_dev) : 0);
+  device->shared_ = found;
+  device->info_.type_ = DeviceType_Unknown;
+  device->info_.queueDepth_ = 0;
+  device->active_[Operation_Stat] = 0;
+  device->active_[Operation_Read] = 0;
+
+#if defined(__linux__)
+  if (!found ||
+      !ProbeDevice(device->info_, major(info.st_dev), minor(info.st_dev), sysfs_))
+  {
+    device->info_.type_ = DeviceType_Unknown;
+    device->info_.queueDepth_ = 0;
+    device->info_.name_ = (found ?
+                           boost::lexical_cast<std::string>(major(info.st_dev)) + ":" +
+                           boost::lexical_cast<std::string>(minor(info.st_dev)) : path);
+  }
+#else
+  device->info_.name_ = path;
+#endif
+
+  unsigned int limit;
+  switch (device->info_.type_)
+  {
+    case DeviceType_Rotational:
+      limit = rotationalLimit_;
+      break;
+
+    case DeviceType_SolidState:
+      limit = solidStateLimit_;
+      if (device->info_.queueDepth_ != 0 &&
+          device->info_.queueDepth_ < limit)
+      {
+        limit = device->info_.queueDepth_;
+      }
+      break;
+
+    default:
+      limit = unknownLimit_;
+      break;
+  }
+
+  device->limits_[Operation_Read] = limit;
+  device->limits_[Operation_Stat] = limit * STAT_LIMIT_FACTOR;
+
+  LOG(WARNING) << "Indexer plugin has found folder " << path << " on device " << device->info_.name_
+               << " (" << Format(device->info_.type_) << "), with at most " << limit << " concurrent reads";
+
+  devices_.push_back(device.release());
+  return devices_.size() - 1;
+}
+
+
+unsigned int DeviceQueues::GetLimit(size_t device,
+                                    Operation operation)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  return GetDevice(device).limits_[operation];
+}
+
+
+void DeviceQueues::Stop()
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  stopped_ = true;
+
+  for (size_t i = 0; i < devices_.size(); i++)
+  {
+    devices_[i]->released_.notify_all();
+  }
+}
+
+
+uint64_t DeviceQueues::GetOvercommitsCount()
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  return overcommits_;
+}
+
+
+void DeviceQueues::Format(Json::Value& target)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  target = Json::arrayValue;
+
+  for (size_t i = 0; i < devices_.size(); i++)
+  {
+    const Device& device = *devices_[i];
+
+    Json::Value item;
+    item["Name"] = device.info_.name_;
+    item["Type"] = Format(device.info_.type_);
+    item["QueueDepth"] = device.info_.queueDepth_;
+    item["StatLimit"] = device.limits_[Operation_Stat];
+    item["ReadLimit"] = device.limits_[Operation_Read];
+    item["ActiveStats"] = device.active_[Operation_Stat];
+    item["ActiveReads"] = device.active_[Operation_Read];
+    target.append(item);
+  }
+}
@@ -0,0 +1,143 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <json/value.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+
+/**
+ * Bounds the number of concurrent filesystem operations of the
+ * crawlers on each block device, whatever the number of roots that it
+ * backs. The limits depend on the kind of the device, as found in the
+ * sysfs of Linux: Rotational disks are kept at a low queue depth,
+ * whereas solid-state disks are driven up to their queue depth. The
+ * "stat()" calls and the reads of the identification have separate
+ * limits, as the former are mostly served from the inode cache.
+ *
+ * A slot that is held for longer than the wait timeout belongs to a
+ * stalled operation (e.g. hung network mount): Once this timeout has
+ * elapsed, the waiting crawler goes on beyond the limit, so that a
+ * hung root doesn't block the other roots of its device.
+ **/
+class DeviceQueues : public boost::noncopyable
+{
+public:
+  enum DeviceType
+  {
+    DeviceType_Unknown,  // E.g. network filesystems
+    DeviceType_Rotational,
+    DeviceType_SolidState
+  };
+
+  enum Operation
+  {
+    Operation_Stat,
+    Operation_Read
+  };
+
+  struct DeviceInfo
+  {
+    std::string   name_;
+    DeviceType    type_;
+    unsigned int  queueDepth_;  // 0 if unknown
+  };
+
+  // Held during one filesystem operation on the device of a root
+  class Slot : public boost::noncopyable
+  {
+  private:
+    DeviceQueues&  queues_;
+    size_t         device_;
+    Operation      operation_;
+
+  public:
+    Slot(DeviceQueues& queues,
+         size_t device,
+         Operation operation);
+
+    ~Slot();
+  };
+
+private:
+  struct Device
+  {
+    uint64_t                   id_;   // "st_dev"
+    bool                       shared_;
+    DeviceInfo                 info_;
+    unsigned int               limits_[2];
+    unsigned int               active_[2];
+    boost::condition_variable  released_;
+  };
+
+  boost::mutex          mutex_;
+  std::vector<Device*>  devices_;
+  unsigned int          rotationalLimit_;
+  unsigned int          solidStateLimit_;
+  unsigned int          unknownLimit_;
+  unsigned int          waitTimeout_;
+  bool                  stopped_;
+  uint64_t              overcommits_;
+  std::string           sysfs_;
+
+  Device& GetDevice(size_t device);
+
+public:
+  // The limits are the number of concurrent reads, and the wait
+  // timeout is expressed in seconds. "sysfs" is only changed by the
+  // unit tests.
+  DeviceQueues(unsigned int rotationalLimit,
+               unsigned int solidStateLimit,
+               unsigned int unknownLimit,
+               unsigned int waitTimeout,
+               const std::string& sysfs = "/sys");
+
+  ~DeviceQueues();
+
+  static const char* Format(DeviceType type);
+
+  // Returns "false" iff. the device is not a block device known to sysfs
+  static bool ProbeDevice(DeviceInfo& info,
+                          unsigned int major,
+                          unsigned int minor,
+                          const std::string& sysfs);
+
+  // Returns the index of the device backing "path". The roots on the
+  // same device share their queues. A root that cannot be accessed
+  // gets its own queue, as an unknown device.
+  size_t Register(const std::string& path);
+
+  unsigned int GetLimit(size_t device,
+                        Operation operation);
+
+  // Wakes up the waiting crawlers, and stops enforcing the limits, so
+  // that the crawlers can notice that the plugin is stopping
+  void Stop();
+
+  // Number of slots that were taken beyond the limit of their device
+  uint64_t GetOvercommitsCount();
+
+  void Format(Json::Value& target);
+};
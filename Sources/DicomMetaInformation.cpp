@@ -0,0 +1,125 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "DicomMetaInformation.h"
+
+#include <string.h>
+
+
+static uint16_t ReadUInt16(const uint8_t* p)
+{
+  return static_cast<uint16_t>(p[0] | (p[1] << 8));
+}
+
+
+static uint32_t ReadUInt32(const uint8_t* p)
+{
+  return (static_cast<uint32_t>(p[0]) |
+          (static_cast<uint32_t>(p[1]) << 8) |
+          (static_cast<uint32_t>(p[2]) << 16) |
+          (static_cast<uint32_t>(p[3]) << 24));
+}
+
+
+// Value representations with a 32-bit length in explicit VR
+static bool HasLongLength(const uint8_t* vr)
+{
+  static const char* const LONG_VRS[] = { "OB", "OD", "OF", "OL", "OV", "OW", "SQ", "SV", "UC", "UN", "UR", "UT", "UV" };
+
+  for (size_t i = 0; i < sizeof(LONG_VRS) / sizeof(LONG_VRS[0]); i++)
+  {
+    if (vr[0] == LONG_VRS[i][0] &&
+        vr[1] == LONG_VRS[i][1])
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+bool DicomMetaInformation::LookupString(std::string& value,
+                                        const void* dicom,
+                                        size_t size,
+                                        uint16_t element)
+{
+  static const size_t PREAMBLE = 128;
+
+  const uint8_t* p = reinterpret_cast<const uint8_t*>(dicom);
+  if (size < PREAMBLE + 4 ||
+      memcmp(p + PREAMBLE, "DICM", 4) != 0)
+  {
+    return false;
+  }
+
+  // The file meta information is always encoded in explicit VR little endian
+  size_t pos = PREAMBLE + 4;
+  while (pos + 8 <= size)
+  {
+    const uint16_t group = ReadUInt16(p + pos);
+    const uint16_t current = ReadUInt16(p + pos + 2);
+
+    if (group != 0x0002)
+    {
+      return false;
+    }
+
+    size_t length;
+    if (HasLongLength(p + pos + 4))
+    {
+      if (pos + 12 > size)
+      {
+        return false;
+      }
+
+      length = ReadUInt32(p + pos + 8);
+      pos += 12;
+    }
+    else
+    {
+      length = ReadUInt16(p + pos + 6);
+      pos += 8;
+    }
+
+    if (length > size - pos)
+    {
+      return false;
+    }
+
+    if (current == element)
+    {
+      // String values are padded to an even length, with a null
+      // character for UIDs and with a space otherwise
+      while (length > 0 &&
+             (p[pos + length - 1] == '\0' ||
+              p[pos + length - 1] == ' '))
+      {
+        length--;
+      }
+
+      value.assign(reinterpret_cast<const char*>(p + pos), length);
+      return true;
+    }
+
+    pos += length;
+  }
+
+  return false;
+}
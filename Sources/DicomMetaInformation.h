@@ -0,0 +1,43 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <stdint.h>
+#include <string>
+
+
+/**
+ * Minimal reader of the file meta information (group 0002) of a DICOM
+ * file, which is always encoded in explicit VR little endian, so that
+ * it can be inspected without parsing the dataset.
+ **/
+class DicomMetaInformation : public boost::noncopyable
+{
+public:
+  static const uint16_t  MEDIA_STORAGE_SOP_INSTANCE_UID = 0x0003;
+  static const uint16_t  TRANSFER_SYNTAX_UID = 0x0010;
+
+  // Reads the string value of element (0002,element), without its padding
+  static bool LookupString(std::string& value,
+                           const void* dicom,
+                           size_t size,
+                           uint16_t element);
+};
@@ -0,0 +1,149 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "DirectoryReader.h"
+
+#include <OrthancException.h>
+
+#if defined(__linux__)
+#  include <errno.h>
+#  include <fcntl.h>
+#  include <stdint.h>
+#  include <string.h>
+#  include <sys/syscall.h>
+#  include <unistd.h>
+
+// Layout of the records returned by "getdents64()", which has no
+// wrapper in older versions of the glibc
+struct LinuxDirent64
+{
+  uint64_t        d_ino;
+  int64_t         d_off;
+  unsigned short  d_reclen;
+  unsigned char   d_type;
+  char            d_name[1];
+};
+#endif
+
+
+DirectoryReader::DirectoryReader(const std::string& path,
+                                 size_t bufferSize)
+{
+  if (bufferSize < 1024)
+  {
+    // Must be able to hold at least one record with a maximum-length name
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+  }
+
+#if defined(__linux__)
+  fd_ = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd_ < 0)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_DirectoryExpected,
+                                    "Cannot read directory: " + path);
+  }
+
+  buffer_.resize(bufferSize);
+#else
+  try
+  {
+    current_ = boost::filesystem::directory_iterator(path);
+  }
+  catch (boost::filesystem::filesystem_error&)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_DirectoryExpected,
+                                    "Cannot read directory: " + path);
+  }
+
+  batchSize_ = bufferSize / 32;  // Rough size of the records of "getdents64()"
+#endif
+}
+
+
+DirectoryReader::~DirectoryReader()
+{
+#if defined(__linux__)
+  close(fd_);
+#endif
+}
+
+
+bool DirectoryReader::ReadBatch(std::vector<std::string>& names)
+{
+  names.clear();
+
+#if defined(__linux__)
+  long count;
+
+  do
+  {
+    count = syscall(SYS_getdents64, fd_, &buffer_[0], buffer_.size());
+  }
+  while (count < 0 && errno == EINTR);
+
+  if (count < 0)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_DirectoryExpected,
+                                    "Cannot read directory: " + std::string(strerror(errno)));
+  }
+  else if (count == 0)
+  {
+    return false;
+  }
+
+  long offset = 0;
+  while (offset < count)
+  {
+    const LinuxDirent64* entry = reinterpret_cast<const LinuxDirent64*>(&buffer_[offset]);
+    offset += entry->d_reclen;
+
+    if (strcmp(entry->d_name, ".") != 0 &&
+        strcmp(entry->d_name, "..") != 0)
+    {
+      names.push_back(entry->d_name);
+    }
+  }
+
+  return true;
+#else
+  const boost::filesystem::directory_iterator end;
+
+  if (current_ == end)
+  {
+    return false;
+  }
+
+  try
+  {
+    while (current_ != end &&
+           names.size() < batchSize_)
+    {
+      names.push_back(current_->path().filename().string());
+      ++current_;
+    }
+  }
+  catch (boost::filesystem::filesystem_error& e)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_DirectoryExpected,
+                                    "Cannot read directory: " + std::string(e.what()));
+  }
+
+  return true;
+#endif
+}
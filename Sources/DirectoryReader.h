@@ -0,0 +1,59 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <string>
+#include <vector>
+
+#if !defined(__linux__)
+#  include <boost/filesystem.hpp>
+#endif
+
+
+/**
+ * Streams the names of the entries of a directory by batches, so that
+ * the memory remains bounded even for directories with millions of
+ * entries. On Linux, each batch corresponds to one "getdents64()"
+ * system call filling a buffer of the given size.
+ **/
+class DirectoryReader : public boost::noncopyable
+{
+private:
+#if defined(__linux__)
+  int                fd_;
+  std::vector<char>  buffer_;
+#else
+  boost::filesystem::directory_iterator  current_;
+  size_t                                 batchSize_;
+#endif
+
+public:
+  // Throws if the directory cannot be opened
+  DirectoryReader(const std::string& path,
+                  size_t bufferSize);
+
+  ~DirectoryReader();
+
+  // Replaces the content of "names" by the next batch of entries
+  // (without "." and ".."). Returns "false" once the directory has
+  // been fully read. The batches can be empty.
+  bool ReadBatch(std::vector<std::string>& names);
+};
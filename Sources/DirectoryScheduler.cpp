@@ -0,0 +1,76 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "DirectoryScheduler.h"
+
+#include <OrthancException.h>
+
+#include <boost/random/uniform_real_distribution.hpp>
+
+
+DirectoryScheduler::DirectoryScheduler(unsigned int minimumInterval,
+                                       unsigned int maximumInterval,
+                                       float jitter) :
+  minimumInterval_(minimumInterval),
+  maximumInterval_(maximumInterval),
+  jitter_(jitter),
+  generator_(static_cast<uint32_t>(std::time(NULL)))
+{
+  if (minimumInterval_ == 0 ||
+      maximumInterval_ < minimumInterval_ ||
+      jitter_ < 0.0f ||
+      jitter_ >= 1.0f)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+  }
+}
+
+
+unsigned int DirectoryScheduler::ComputeInterval(unsigned int previousInterval,
+                                                 bool changed) const
+{
+  if (changed ||
+      previousInterval < minimumInterval_)
+  {
+    return minimumInterval_;
+  }
+  else if (previousInterval >= maximumInterval_ / 2)
+  {
+    return maximumInterval_;
+  }
+  else
+  {
+    return 2 * previousInterval;
+  }
+}
+
+
+std::time_t DirectoryScheduler::ComputeNextVisit(const std::time_t now,
+                                                 unsigned int interval)
+{
+  float factor;
+
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    boost::random::uniform_real_distribution<float> distribution(1.0f - jitter_, 1.0f + jitter_);
+    factor = distribution(generator_);
+  }
+
+  return now + static_cast<std::time_t>(static_cast<float>(interval) * factor);
+}
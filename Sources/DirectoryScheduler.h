@@ -0,0 +1,66 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/thread/mutex.hpp>
+#include <ctime>
+
+
+/**
+ * Computes the per-directory revisit intervals of the crawler. A
+ * directory whose content has changed during its last visit is
+ * revisited after the minimum interval, whereas the interval of an
+ * unchanged directory is doubled at each visit, up to the maximum
+ * interval. The actual revisit time is randomly jittered, so that
+ * the revisits of directories crawled together don't line up.
+ **/
+class DirectoryScheduler : public boost::noncopyable
+{
+private:
+  unsigned int            minimumInterval_;
+  unsigned int            maximumInterval_;
+  float                   jitter_;
+  boost::mutex            mutex_;
+  boost::random::mt19937  generator_;
+
+public:
+  DirectoryScheduler(unsigned int minimumInterval,
+                     unsigned int maximumInterval,
+                     float jitter);
+
+  unsigned int GetMinimumInterval() const
+  {
+    return minimumInterval_;
+  }
+
+  unsigned int GetMaximumInterval() const
+  {
+    return maximumInterval_;
+  }
+
+  // "previousInterval" is zero if the directory was never visited
+  unsigned int ComputeInterval(unsigned int previousInterval,
+                               bool changed) const;
+
+  std::time_t ComputeNextVisit(const std::time_t now,
+                               unsigned int interval);
+};
@@ -0,0 +1,183 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "DirectorySnapshot.h"
+
+#include <OrthancException.h>
+
+#include <algorithm>
+#include <cassert>
+
+
+static bool IsNameBefore(const IndexerDatabase::KnownFile& file,
+                         const std::string& name)
+{
+  return file.name_ < name;
+}
+
+
+void DirectorySnapshot::Accounting::Add(uint64_t size)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  usage_ += size;
+}
+
+
+void DirectorySnapshot::Accounting::Remove(uint64_t size)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  assert(usage_ >= size);
+  usage_ -= size;
+}
+
+
+uint64_t DirectorySnapshot::Accounting::GetMemoryUsage()
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  return usage_;
+}
+
+
+DirectorySnapshot::DirectorySnapshot(IndexerDatabase& database,
+                                     const std::string& directory,
+                                     Accounting* accounting) :
+  accounting_(accounting),
+  memoryUsage_(0)
+{
+  database.ListDirectoryContent(files_, subdirectories_, directory);
+  seen_.resize(files_.size(), 0);
+
+  // Approximation that ignores the overhead of the allocator
+  memoryUsage_ = (files_.capacity() * sizeof(IndexerDatabase::KnownFile) +
+                  subdirectories_.capacity() * sizeof(std::string) +
+                  seen_.capacity());
+
+  for (size_t i = 0; i < files_.size(); i++)
+  {
+    memoryUsage_ += files_[i].name_.capacity() + files_[i].instanceId_.capacity();
+  }
+
+  for (size_t i = 0; i < subdirectories_.size(); i++)
+  {
+    memoryUsage_ += subdirectories_[i].capacity();
+  }
+
+  if (accounting_ != NULL)
+  {
+    accounting_->Add(memoryUsage_);
+  }
+}
+
+
+DirectorySnapshot::~DirectorySnapshot()
+{
+  if (accounting_ != NULL)
+  {
+    accounting_->Remove(memoryUsage_);
+  }
+}
+
+
+const IndexerDatabase::KnownFile& DirectorySnapshot::GetFile(size_t index) const
+{
+  if (index >= files_.size())
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+  }
+  else
+  {
+    return files_[index];
+  }
+}
+
+
+void DirectorySnapshot::Merge(std::vector<size_t>& matches,
+                              const std::vector<std::string>& names) const
+{
+  matches.resize(names.size());
+
+  size_t position = 0;
+
+  for (size_t i = 0; i < names.size(); i++)
+  {
+    if (i > 0 &&
+        names[i] < names[i - 1])
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls, "The names must be sorted");
+    }
+
+    // The batches of "getdents64()" are spread over the whole snapshot,
+    // so the known files are searched by bisection instead of being
+    // scanned. As the names are sorted, the search is never rewound.
+    position = std::lower_bound(files_.begin() + position, files_.end(),
+                                names[i], IsNameBefore) - files_.begin();
+
+    if (position < files_.size() &&
+        files_[position].name_ == names[i])
+    {
+      matches[i] = position;
+    }
+    else
+    {
+      matches[i] = files_.size();
+    }
+  }
+}
+
+
+void DirectorySnapshot::MarkSeen(size_t index)
+{
+  if (index >= seen_.size())
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+  }
+  else
+  {
+    seen_[index] = 1;
+  }
+}
+
+
+void DirectorySnapshot::ListVanishedFiles(std::vector<size_t>& target) const
+{
+  target.clear();
+
+  for (size_t i = 0; i < seen_.size(); i++)
+  {
+    if (!seen_[i])
+    {
+      target.push_back(i);
+    }
+  }
+}
+
+
+void DirectorySnapshot::ListVanishedSubdirectories(std::vector<std::string>& target,
+                                                   const std::set<std::string>& found) const
+{
+  target.clear();
+
+  for (size_t i = 0; i < subdirectories_.size(); i++)
+  {
+    if (found.find(subdirectories_[i]) == found.end())
+    {
+      target.push_back(subdirectories_[i]);
+    }
+  }
+}
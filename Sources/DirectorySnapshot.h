@@ -0,0 +1,113 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include "IndexerDatabase.h"
+#include "MemoryBudget.h"
+
+#include <boost/thread/mutex.hpp>
+#include <set>
+
+
+/**
+ * Indexed content of one directory, read by a single range query
+ * before the directory is enumerated. The sorted chunks of entries
+ * are merge-joined against the sorted known files, so that the
+ * unchanged files are recognized without any further transaction.
+ * The known files and subdirectories that are not found again while
+ * enumerating the directory have vanished from the filesystem.
+ *
+ * The snapshot holds one entry per indexed file of the directory. It
+ * cannot be paged, as the batches of "getdents64()" come in the hash
+ * order of the filesystem, and are thus spread over the whole
+ * snapshot. Its memory is reported to the memory budget instead.
+ **/
+class DirectorySnapshot : public boost::noncopyable
+{
+public:
+  // Memory of the snapshots that are alive. The snapshots cannot be
+  // shrunk while their directory is enumerated, so a pressure on this
+  // component is only relieved once the huge directories are done.
+  class Accounting : public MemoryBudget::IConsumer
+  {
+  private:
+    boost::mutex  mutex_;
+    uint64_t      usage_;
+
+  public:
+    Accounting() :
+      usage_(0)
+    {
+    }
+
+    void Add(uint64_t size);
+
+    void Remove(uint64_t size);
+
+    virtual uint64_t GetMemoryUsage() ORTHANC_OVERRIDE;
+
+    virtual void ShrinkMemory(uint64_t target) ORTHANC_OVERRIDE
+    {
+    }
+  };
+
+private:
+  std::vector<IndexerDatabase::KnownFile>  files_;
+  std::vector<std::string>                 subdirectories_;
+  std::vector<uint8_t>                     seen_;  // One byte per file, written by at most one worker
+  Accounting*                              accounting_;
+  uint64_t                                 memoryUsage_;
+
+public:
+  // "accounting" can be NULL
+  DirectorySnapshot(IndexerDatabase& database,
+                    const std::string& directory,
+                    Accounting* accounting);
+
+  ~DirectorySnapshot();
+
+  uint64_t GetMemoryUsage() const
+  {
+    return memoryUsage_;
+  }
+
+  size_t GetFilesCount() const
+  {
+    return files_.size();
+  }
+
+  const IndexerDatabase::KnownFile& GetFile(size_t index) const;
+
+  // "names" must be sorted, but successive calls can be in any
+  // order. On exit, "matches[i]" is the index of the
+  // known file named "names[i]", or "GetFilesCount()" if it is new.
+  void Merge(std::vector<size_t>& matches,
+             const std::vector<std::string>& names) const;
+
+  // To be called if the matching entry is still a regular file
+  void MarkSeen(size_t index);
+
+  // The known files that have not been seen
+  void ListVanishedFiles(std::vector<size_t>& target) const;
+
+  // The known subdirectories whose name is absent from "found"
+  void ListVanishedSubdirectories(std::vector<std::string>& target,
+                                  const std::set<std::string>& found) const;
+};
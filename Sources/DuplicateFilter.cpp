@@ -0,0 +1,93 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "DuplicateFilter.h"
+
+#include "DicomMetaInformation.h"
+
+#include <OrthancException.h>
+
+
+DuplicateFilter::DuplicateFilter(IndexerDatabase& database,
+                                 Policy policy) :
+  database_(database),
+  policy_(policy),
+  duplicates_(0)
+{
+}
+
+
+DuplicateFilter::Policy DuplicateFilter::ParsePolicy(const std::string& value)
+{
+  if (value == "Store")
+  {
+    return Policy_Store;
+  }
+  else if (value == "Acknowledge")
+  {
+    return Policy_Acknowledge;
+  }
+  else if (value == "Reject")
+  {
+    return Policy_Reject;
+  }
+  else
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange,
+                                    "Unknown policy for the duplicate instances: " + value);
+  }
+}
+
+
+bool DuplicateFilter::ReadSopInstanceUid(std::string& sopInstanceUid,
+                                         const void* dicom,
+                                         size_t size)
+{
+  return (DicomMetaInformation::LookupString(sopInstanceUid, dicom, size,
+                                             DicomMetaInformation::MEDIA_STORAGE_SOP_INSTANCE_UID) &&
+          !sopInstanceUid.empty());
+}
+
+
+DuplicateFilter::Decision DuplicateFilter::Apply(const void* dicom,
+                                                 size_t size)
+{
+  std::string sopInstanceUid;
+
+  if (policy_ == Policy_Store ||
+      !ReadSopInstanceUid(sopInstanceUid, dicom, size) ||
+      !database_.IsSopInstanceStored(sopInstanceUid))
+  {
+    return Decision_Store;
+  }
+
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    duplicates_++;
+  }
+
+  return (policy_ == Policy_Reject ? Decision_Reject : Decision_Discard);
+}
+
+
+uint64_t DuplicateFilter::GetDuplicatesCount()
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  return duplicates_;
+}
@@ -0,0 +1,71 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include "IndexerDatabase.h"
+
+
+/**
+ * Early detection of the DICOM instances received through C-STORE
+ * that are already stored by Orthanc (e.g. studies resent by a
+ * gateway), before Orthanc writes them to the storage area. The SOP
+ * Instance UID is read from the file meta information, and looked up
+ * in the index in one query.
+ **/
+class DuplicateFilter : public boost::noncopyable
+{
+public:
+  enum Policy
+  {
+    Policy_Store,        // Duplicates are handled by Orthanc as usual
+    Policy_Acknowledge,  // Duplicates are discarded, the sender gets a success
+    Policy_Reject        // Duplicates are discarded, the sender gets a failure
+  };
+
+  enum Decision
+  {
+    Decision_Store,
+    Decision_Discard,
+    Decision_Reject
+  };
+
+private:
+  IndexerDatabase&  database_;
+  Policy            policy_;
+  boost::mutex      mutex_;
+  uint64_t          duplicates_;
+
+public:
+  DuplicateFilter(IndexerDatabase& database,
+                  Policy policy);
+
+  static Policy ParsePolicy(const std::string& value);
+
+  // Reads "MediaStorageSOPInstanceUID" (0002,0003) from the file meta
+  // information, without parsing the dataset
+  static bool ReadSopInstanceUid(std::string& sopInstanceUid,
+                                 const void* dicom,
+                                 size_t size);
+
+  Decision Apply(const void* dicom,
+                 size_t size);
+
+  uint64_t GetDuplicatesCount();
+};
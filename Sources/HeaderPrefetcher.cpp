@@ -0,0 +1,236 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "HeaderPrefetcher.h"
+
+#include <OrthancException.h>
+
+#include <algorithm>
+
+#if defined(__linux__)
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#endif
+
+
+// One prefetched file out of this number has its residency probed
+static const unsigned int RESIDENCY_SAMPLING = 4;
+
+// Number of consecutive resident probes before the lookahead decreases,
+// i.e. about 16 prefetched files
+static const unsigned int RESIDENT_STREAK = 4;
+
+
+#if defined(__linux__)
+// Opens a regular file, and gives the size of its header region
+static int OpenHeader(size_t& length,
+                      const std::string& path,
+                      size_t headerSize)
+{
+  // O_NONBLOCK, as the crawled folders might contain FIFOs
+  int fd = open(path.c_str(), O_RDONLY | O_NONBLOCK);
+  if (fd == -1)
+  {
+    return -1;
+  }
+
+  struct stat info;
+  if (fstat(fd, &info) != 0 ||
+      !S_ISREG(info.st_mode) ||
+      info.st_size == 0)
+  {
+    close(fd);
+    return -1;
+  }
+
+  length = std::min(headerSize, static_cast<size_t>(info.st_size));
+  return fd;
+}
+#endif
+
+
+HeaderPrefetcher::Window::Window(HeaderPrefetcher& that,
+                                 const std::vector<std::string>& paths) :
+  that_(that),
+  paths_(paths),
+  next_(0),
+  entered_(0)
+{
+}
+
+
+void HeaderPrefetcher::Window::Enter(size_t index)
+{
+  if (index >= paths_.size())
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+  }
+
+  if (index < next_)
+  {
+    // The header of this file was prefetched. The first one is always
+    // probed, so that a slow device is noticed in the small chunks.
+    bool isResident;
+    if (entered_ % RESIDENCY_SAMPLING == 0 &&
+        IsResident(isResident, paths_[index], that_.headerSize_))
+    {
+      that_.Adapt(isResident);
+    }
+
+    entered_++;
+  }
+  else
+  {
+    // The current file is about to be read anyway
+    next_ = index + 1;
+  }
+
+  const size_t end = std::min(paths_.size(), index + 1 + that_.GetLookahead());
+
+  while (next_ < end)
+  {
+    that_.Prefetch(paths_[next_]);
+    next_++;
+  }
+}
+
+
+void HeaderPrefetcher::Prefetch(const std::string& path)
+{
+#if defined(__linux__)
+  size_t length;
+  int fd = OpenHeader(length, path, headerSize_);
+  if (fd != -1)
+  {
+    posix_fadvise(fd, 0, length, POSIX_FADV_WILLNEED);
+    close(fd);
+
+    boost::mutex::scoped_lock lock(mutex_);
+    prefetched_++;
+  }
+#endif
+}
+
+
+void HeaderPrefetcher::Adapt(bool isResident)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  if (isResident)
+  {
+    residentStreak_++;
+    if (residentStreak_ >= RESIDENT_STREAK)
+    {
+      residentStreak_ = 0;
+      if (lookahead_ > 1)
+      {
+        lookahead_--;
+      }
+    }
+  }
+  else
+  {
+    misses_++;
+    residentStreak_ = 0;
+    lookahead_ = std::min(maximumLookahead_, 2 * lookahead_);
+  }
+}
+
+
+HeaderPrefetcher::HeaderPrefetcher(size_t headerSize,
+                                   unsigned int maximumLookahead) :
+  headerSize_(headerSize),
+  maximumLookahead_(maximumLookahead),
+  lookahead_(std::min(4u, maximumLookahead)),
+  residentStreak_(0),
+  prefetched_(0),
+  misses_(0)
+{
+  if (headerSize == 0 ||
+      maximumLookahead == 0)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+  }
+}
+
+
+bool HeaderPrefetcher::IsResident(bool& isResident,
+                                  const std::string& path,
+                                  size_t headerSize)
+{
+#if defined(__linux__)
+  size_t length;
+  int fd = OpenHeader(length, path, headerSize);
+  if (fd == -1)
+  {
+    return false;
+  }
+
+  // Mapping the file does not read it, contrarily to touching its pages
+  void* mapping = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if (mapping == MAP_FAILED)
+  {
+    return false;
+  }
+
+  const long pageSize = sysconf(_SC_PAGESIZE);
+  std::vector<unsigned char> pages((length + pageSize - 1) / pageSize);
+
+  bool success = (mincore(mapping, length, &pages[0]) == 0);
+  munmap(mapping, length);
+
+  if (success)
+  {
+    isResident = true;
+    for (size_t i = 0; i < pages.size(); i++)
+    {
+      if ((pages[i] & 1) == 0)
+      {
+        isResident = false;
+      }
+    }
+  }
+
+  return success;
+#else
+  return false;
+#endif
+}
+
+
+unsigned int HeaderPrefetcher::GetLookahead()
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  return lookahead_;
+}
+
+
+void HeaderPrefetcher::GetStatistics(unsigned int& lookahead,
+                                     uint64_t& prefetched,
+                                     uint64_t& misses)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  lookahead = lookahead_;
+  prefetched = prefetched_;
+  misses = misses_;
+}
@@ -0,0 +1,89 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+
+/**
+ * Readahead of the header of the next files to be identified by a
+ * crawler, through "posix_fadvise(POSIX_FADV_WILLNEED)", so that the
+ * reads of the device overlap with the parsing of the current file.
+ * The lookahead adapts to the latency of the device: It doubles each
+ * time the header of a file is not resident yet when its turn comes
+ * (the reads take longer than the parsing of the files in between),
+ * and it slowly decreases while the headers are found resident. As
+ * probing the residency opens the file once more, which is a round
+ * trip on network filesystems, only one prefetched file out of a few
+ * is probed.
+ **/
+class HeaderPrefetcher : public boost::noncopyable
+{
+public:
+  // Prefetching of the files of one chunk of a directory, in order
+  class Window : public boost::noncopyable
+  {
+  private:
+    HeaderPrefetcher&                that_;
+    const std::vector<std::string>&  paths_;
+    size_t                           next_;  // Index of the next file to be prefetched
+    unsigned int                     entered_;  // Number of prefetched files entered so far
+
+  public:
+    // The paths must outlive the window
+    Window(HeaderPrefetcher& that,
+           const std::vector<std::string>& paths);
+
+    // To be called before identifying "paths[index]", with increasing indices
+    void Enter(size_t index);
+  };
+
+private:
+  boost::mutex  mutex_;
+  size_t        headerSize_;
+  unsigned int  maximumLookahead_;
+  unsigned int  lookahead_;
+  unsigned int  residentStreak_;
+  uint64_t      prefetched_;
+  uint64_t      misses_;
+
+  void Prefetch(const std::string& path);
+
+  void Adapt(bool isResident);
+
+public:
+  HeaderPrefetcher(size_t headerSize,
+                   unsigned int maximumLookahead);
+
+  // Returns "false" if the residency is unknown (e.g. not a regular file)
+  static bool IsResident(bool& isResident,
+                         const std::string& path,
+                         size_t headerSize);
+
+  unsigned int GetLookahead();
+
+  void GetStatistics(unsigned int& lookahead,
+                     uint64_t& prefetched,
+                     uint64_t& misses);
+};
@@ -19,9 +19,186 @@
 
 #include "IndexerDatabase.h"
 
+#include "SlowLog.h"
+
 #include <EmbeddedResources.h>
 #include <SQLite/Transaction.h>
 
+#include <Logging.h>
+
+#include <boost/filesystem/path.hpp>
+#include <algorithm>
+#include <map>
+
+
+namespace
+{
+  // Lock of the database, whose wait and whose use are accounted to
+  // different stages of the slow operations
+  class DatabaseLock : public boost::noncopyable
+  {
+  private:
+    SlowLog::Stage             stage_;
+    boost::mutex::scoped_lock  lock_;
+
+  public:
+    explicit DatabaseLock(boost::mutex& mutex) :
+      stage_("db-lock"),
+      lock_(mutex)
+    {
+      stage_.Rename("sqlite");
+    }
+  };
+}
+
+
+// Computes the range [lower, upper) of the paths below some directory
+static void GetDirectoryRange(std::string& lower,
+                              std::string& upper,
+                              const std::string& directory)
+{
+  lower = directory;
+
+  if (lower.empty() ||
+      (lower[lower.size() - 1] != '/' &&
+       lower[lower.size() - 1] != '\\'))
+  {
+    lower.push_back(static_cast<char>(boost::filesystem::path::preferred_separator));
+  }
+
+  upper = lower;
+  upper[upper.size() - 1] = upper[upper.size() - 1] + 1;
+}
+
+
+// Removes the trailing separators, except for the root of the filesystem
+static std::string NormalizeDirectory(const std::string& directory)
+{
+  std::string s = directory;
+
+  while (s.size() > 1 &&
+         (s[s.size() - 1] == '/' ||
+          s[s.size() - 1] == '\\'))
+  {
+    s.resize(s.size() - 1);
+  }
+
+  return s;
+}
+
+
+void IndexerDatabase::UpdateStatistics(const std::string& path,
+                                       int64_t files,
+                                       int64_t dicomFiles,
+                                       int64_t size,
+                                       const std::time_t time)
+{
+  // Must be invoked inside a transaction. All the parent directories
+  // of the file are updated, up to the root of the filesystem. The
+  // last change only grows, as removing a file would require a scan
+  // of the whole subtree to find the newest remaining file.
+  for (boost::filesystem::path directory = boost::filesystem::path(path).parent_path();
+       !directory.empty(); directory = directory.parent_path())
+  {
+    const std::string s = directory.string();
+
+    {
+      Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                           "INSERT OR IGNORE INTO DirectoryStatistics VALUES(?, 0, 0, 0, 0)");
+      statement.BindString(0, s);
+      statement.Run();
+    }
+
+    {
+      Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                           "UPDATE DirectoryStatistics SET files=files+?, dicomFiles=dicomFiles+?, "
+                                           "size=size+?, lastChange=MAX(lastChange, ?) WHERE path=?");
+      statement.BindInt64(0, files);
+      statement.BindInt64(1, dicomFiles);
+      statement.BindInt64(2, size);
+      statement.BindInt64(3, time);
+      statement.BindString(4, s);
+      statement.Run();
+    }
+
+    {
+      Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                           "DELETE FROM DirectoryStatistics WHERE path=? AND files<=0");
+      statement.BindString(0, s);
+      statement.Run();
+    }
+
+    if (directory == directory.parent_path())
+    {
+      break;  // Safety against paths whose parent is themselves
+    }
+  }
+}
+
+
+void IndexerDatabase::BackfillStatistics()
+{
+  int64_t files, statistics;
+
+  {
+    Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                         "SELECT (SELECT COUNT(*) FROM Files), (SELECT COUNT(*) FROM DirectoryStatistics)");
+    statement.Step();
+    files = statement.ColumnInt64(0);
+    statistics = statement.ColumnInt64(1);
+  }
+
+  if (files == 0 ||
+      statistics != 0)
+  {
+    return;  // Up-to-date
+  }
+
+  LOG(WARNING) << "Indexer plugin is computing the statistics of the " << files << " indexed files";
+
+  std::map<std::string, Statistics> directories;
+
+  {
+    Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                         "SELECT path, time, size, isDicom FROM Files");
+
+    while (statement.Step())
+    {
+      for (boost::filesystem::path directory = boost::filesystem::path(statement.ColumnString(0)).parent_path();
+           !directory.empty(); directory = directory.parent_path())
+      {
+        Statistics& target = directories[directory.string()];
+        target.files_++;
+        target.dicomFiles_ += (statement.ColumnBool(3) ? 1 : 0);
+        target.size_ += statement.ColumnInt64(2);
+        target.lastChange_ = std::max(target.lastChange_, static_cast<std::time_t>(statement.ColumnInt64(1)));
+
+        if (directory == directory.parent_path())
+        {
+          break;
+        }
+      }
+    }
+  }
+
+  Orthanc::SQLite::Transaction transaction(db_);
+  transaction.Begin();
+
+  for (std::map<std::string, Statistics>::const_iterator it = directories.begin(); it != directories.end(); ++it)
+  {
+    Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                         "INSERT INTO DirectoryStatistics VALUES(?, ?, ?, ?, ?)");
+    statement.BindString(0, it->first);
+    statement.BindInt64(1, it->second.files_);
+    statement.BindInt64(2, it->second.dicomFiles_);
+    statement.BindInt64(3, it->second.size_);
+    statement.BindInt64(4, it->second.lastChange_);
+    statement.Run();
+  }
+
+  transaction.Commit();
+}
+
 
 void IndexerDatabase::AddFileInternal(const std::string& path,
                                       const std::time_t time,
@@ -32,14 +209,18 @@ void IndexerDatabase::AddFileInternal(const std::string& path,
   Orthanc::SQLite::Transaction transaction(db_);
   transaction.Begin();
 
-  Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
-                                       "INSERT INTO Files VALUES(?, ?, ?, ?, ?)");
-  statement.BindString(0, path);
-  statement.BindInt64(1, time);
-  statement.BindInt64(2, size);
-  statement.BindInt64(3, isDicom);
-  statement.BindString(4, instanceId);
-  statement.Run();
+  {
+    Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                         "INSERT INTO Files VALUES(?, ?, ?, ?, ?)");
+    statement.BindString(0, path);
+    statement.BindInt64(1, time);
+    statement.BindInt64(2, size);
+    statement.BindInt64(3, isDicom);
+    statement.BindString(4, instanceId);
+    statement.Run();
+  }
+
+  UpdateStatistics(path, 1, isDicom ? 1 : 0, size, time);
 
   transaction.Commit();
 }
@@ -51,15 +232,16 @@ void IndexerDatabase::Initialize()
     Orthanc::SQLite::Transaction transaction(db_);
     transaction.Begin();
 
-    if (!db_.DoesTableExist("Attachments"))
-    {
-      std::string sql;
-      Orthanc::EmbeddedResources::GetFileResource(sql, Orthanc::EmbeddedResources::PREPARE_DATABASE);
-      db_.Execute(sql);
-    }
+    // The script only uses "IF NOT EXISTS" statements, so that it
+    // also upgrades databases created by older versions of the plugin
+    std::string sql;
+    Orthanc::EmbeddedResources::GetFileResource(sql, Orthanc::EmbeddedResources::PREPARE_DATABASE);
+    db_.Execute(sql);
 
     transaction.Commit();
   }
+
+  BackfillStatistics();
     
   // Performance tuning of SQLite with PRAGMAs
   // http://www.sqlite.org/pragma.html
@@ -72,7 +254,7 @@ void IndexerDatabase::Initialize()
 
 void IndexerDatabase::Open(const std::string& path)
 {
-  boost::mutex::scoped_lock lock(mutex_);
+  DatabaseLock lock(mutex_);
   db_.Open(path);
   Initialize();
 }
@@ -80,7 +262,7 @@ void IndexerDatabase::Open(const std::string& path)
 
 void IndexerDatabase::OpenInMemory()
 {
-  boost::mutex::scoped_lock lock(mutex_);
+  DatabaseLock lock(mutex_);
   db_.OpenInMemory();
   Initialize();
 }
@@ -91,7 +273,7 @@ IndexerDatabase::FileStatus IndexerDatabase::LookupFile(std::string& oldInstance
                                                         const std::time_t time,
                                                         const uintmax_t size)
 {
-  boost::mutex::scoped_lock lock(mutex_);
+  DatabaseLock lock(mutex_);
     
   FileStatus result;
   
@@ -137,21 +319,25 @@ IndexerDatabase::FileStatus IndexerDatabase::LookupFile(std::string& oldInstance
 
 bool IndexerDatabase::RemoveFile(const std::string& path)
 {
-  boost::mutex::scoped_lock lock(mutex_);
+  DatabaseLock lock(mutex_);
     
   Orthanc::SQLite::Transaction transaction(db_);
   transaction.Begin();
 
   std::string instanceId;
+  bool isDicom;
+  int64_t size;
 
   {
     Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
-                                         "SELECT instanceId FROM Files WHERE path=?");
+                                         "SELECT instanceId, isDicom, size FROM Files WHERE path=?");
     statement.BindString(0, path);
       
     if (statement.Step())
     {
       instanceId = statement.ColumnString(0);
+      isDicom = statement.ColumnBool(1);
+      size = statement.ColumnInt64(2);
     }
     else
     {
@@ -190,6 +376,38 @@ bool IndexerDatabase::RemoveFile(const std::string& path)
     statement.BindString(0, path);
     statement.Run();
   }
+
+  UpdateStatistics(path, -1, isDicom ? -1 : 0, -size, 0 /* keep the last change */);
+
+  {
+    Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                         "DELETE FROM ReceivedFiles WHERE path=?");
+    statement.BindString(0, path);
+    statement.Run();
+  }
+
+  {
+    Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                         "INSERT OR IGNORE INTO DerivedGarbage SELECT derivedPath "
+                                         "FROM DerivedFiles WHERE path=? AND derivedPath<>''");
+    statement.BindString(0, path);
+    statement.Run();
+  }
+
+  {
+    Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                         "DELETE FROM DerivedFiles WHERE path=?");
+    statement.BindString(0, path);
+    statement.Run();
+  }
+
+  if (isLastInstance)
+  {
+    Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                         "DELETE FROM Instances WHERE instanceId=?");
+    statement.BindString(0, instanceId);
+    statement.Run();
+  }
     
   transaction.Commit();
   return isLastInstance;
@@ -201,7 +419,7 @@ void IndexerDatabase::AddDicomInstance(const std::string& path,
                                        const uintmax_t size,
                                        const std::string& instanceId)
 {
-  boost::mutex::scoped_lock lock(mutex_);
+  DatabaseLock lock(mutex_);
   AddFileInternal(path, time, size, true, instanceId);
 }               
 
@@ -210,14 +428,14 @@ void IndexerDatabase::AddNonDicomFile(const std::string& path,
                                       const std::time_t time,
                                       const uintmax_t size)
 {
-  boost::mutex::scoped_lock lock(mutex_);
+  DatabaseLock lock(mutex_);
   AddFileInternal(path, time, size, false, "");
 }
 
 
 void IndexerDatabase::Apply(IFileVisitor& visitor)
 {
-  boost::mutex::scoped_lock lock(mutex_);
+  DatabaseLock lock(mutex_);
     
   Orthanc::SQLite::Transaction transaction(db_);
   transaction.Begin();
@@ -234,10 +452,44 @@ void IndexerDatabase::Apply(IFileVisitor& visitor)
 }
 
 
+size_t IndexerDatabase::Apply(IFileVisitor& visitor,
+                              const std::string& directory,
+                              const std::string& after,
+                              size_t limit)
+{
+  std::string lower, upper;
+  GetDirectoryRange(lower, upper, directory);
+
+  if (after > lower)
+  {
+    lower = after;
+  }
+
+  DatabaseLock lock(mutex_);
+
+  Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                       "SELECT path, isDicom, instanceId FROM Files "
+                                       "WHERE path>=? AND path<? AND path!=? ORDER BY path LIMIT ?");
+  statement.BindString(0, lower);
+  statement.BindString(1, upper);
+  statement.BindString(2, after);
+  statement.BindInt64(3, limit);
+
+  size_t count = 0;
+  while (statement.Step())
+  {
+    visitor.VisitInstance(statement.ColumnString(0), statement.ColumnBool(1), statement.ColumnString(2));
+    count++;
+  }
+
+  return count;
+}
+
+
 bool IndexerDatabase::CountTimesAttached(int64_t &t,
                                         const std::string& instanceId)
 {
-  boost::mutex::scoped_lock lock(mutex_);
+  DatabaseLock lock(mutex_);
     
   Orthanc::SQLite::Transaction transaction(db_);
   transaction.Begin();
@@ -262,7 +514,7 @@ bool IndexerDatabase::CountTimesAttached(int64_t &t,
 bool IndexerDatabase::AddAttachment(const std::string& uuid,
                                     const std::string& instanceId)
 {
-  boost::mutex::scoped_lock lock(mutex_);
+  DatabaseLock lock(mutex_);
     
   Orthanc::SQLite::Transaction transaction(db_);
   transaction.Begin();
@@ -295,7 +547,7 @@ bool IndexerDatabase::AddAttachment(const std::string& uuid,
 bool IndexerDatabase::LookupAttachment(std::string& path,
                                        const std::string& uuid)
 {
-  boost::mutex::scoped_lock lock(mutex_);
+  DatabaseLock lock(mutex_);
     
   Orthanc::SQLite::Transaction transaction(db_);
   transaction.Begin();
@@ -341,7 +593,7 @@ bool IndexerDatabase::LookupAttachment(std::string& path,
 
 void IndexerDatabase::RemoveAttachment(const std::string& uuid)
 {
-  boost::mutex::scoped_lock lock(mutex_);
+  DatabaseLock lock(mutex_);
     
   Orthanc::SQLite::Transaction transaction(db_);
   transaction.Begin();
@@ -357,6 +609,737 @@ void IndexerDatabase::RemoveAttachment(const std::string& uuid)
 }
 
 
+bool IndexerDatabase::LookupDirectory(std::time_t& lastVisit,
+                                      unsigned int& revisitInterval,
+                                      std::time_t& nextVisit,
+                                      const std::string& path)
+{
+  DatabaseLock lock(mutex_);
+
+  Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                       "SELECT lastVisit, revisitInterval, nextVisit FROM Directories WHERE path=?");
+  statement.BindString(0, path);
+
+  if (statement.Step())
+  {
+    lastVisit = static_cast<std::time_t>(statement.ColumnInt64(0));
+    revisitInterval = static_cast<unsigned int>(statement.ColumnInt64(1));
+    nextVisit = static_cast<std::time_t>(statement.ColumnInt64(2));
+    return true;
+  }
+  else
+  {
+    return false;
+  }
+}
+
+
+void IndexerDatabase::StoreDirectoryVisit(const std::string& path,
+                                          const std::string& parent,
+                                          const std::time_t visit,
+                                          bool changed,
+                                          unsigned int revisitInterval,
+                                          const std::time_t nextVisit)
+{
+  DatabaseLock lock(mutex_);
+    
+  Orthanc::SQLite::Transaction transaction(db_);
+  transaction.Begin();
+
+  {
+    Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                         "INSERT OR IGNORE INTO Directories VALUES(?, ?, 0, 0, 0, 0, 0, 0)");
+    statement.BindString(0, path);
+    statement.BindString(1, parent);
+    statement.Run();
+  }
+
+  {
+    Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                         "UPDATE Directories SET lastVisit=?, visits=visits+1, "
+                                         "revisitInterval=?, nextVisit=? WHERE path=?");
+    statement.BindInt64(0, visit);
+    statement.BindInt64(1, revisitInterval);
+    statement.BindInt64(2, nextVisit);
+    statement.BindString(3, path);
+    statement.Run();
+  }
+
+  if (changed)
+  {
+    Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                         "UPDATE Directories SET lastChange=?, changes=changes+1 WHERE path=?");
+    statement.BindInt64(0, visit);
+    statement.BindString(1, path);
+    statement.Run();
+  }
+    
+  transaction.Commit();
+}
+
+
+void IndexerDatabase::ListChildDirectories(std::list<std::string>& target,
+                                           const std::string& parent)
+{
+  DatabaseLock lock(mutex_);
+
+  target.clear();
+
+  Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                       "SELECT path FROM Directories WHERE parent=?");
+  statement.BindString(0, parent);
+
+  while (statement.Step())
+  {
+    target.push_back(statement.ColumnString(0));
+  }
+}
+
+
+void IndexerDatabase::ForgetDirectory(const std::string& path)
+{
+  DatabaseLock lock(mutex_);
+    
+  Orthanc::SQLite::Transaction transaction(db_);
+  transaction.Begin();
+
+  std::list<std::string> pending;
+  pending.push_back(path);
+
+  while (!pending.empty())
+  {
+    const std::string current = pending.front();
+    pending.pop_front();
+
+    {
+      Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                           "SELECT path FROM Directories WHERE parent=?");
+      statement.BindString(0, current);
+
+      while (statement.Step())
+      {
+        pending.push_back(statement.ColumnString(0));
+      }
+    }
+
+    {
+      Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                           "DELETE FROM Directories WHERE path=?");
+      statement.BindString(0, current);
+      statement.Run();
+    }
+  }
+    
+  transaction.Commit();
+}
+
+
+void IndexerDatabase::ScheduleDirectoryVisit(const std::string& path)
+{
+  DatabaseLock lock(mutex_);
+
+  Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                       "UPDATE Directories SET nextVisit=0 WHERE path=?");
+  statement.BindString(0, path);
+  statement.Run();
+}
+
+
+bool IndexerDatabase::LookupInode(bool& isDicom,
+                                  std::string& instanceId,
+                                  uint64_t device,
+                                  uint64_t inode,
+                                  const std::time_t time,
+                                  const uintmax_t size)
+{
+  DatabaseLock lock(mutex_);
+
+  // The inode numbers are stored as signed integers by SQLite
+  Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                       "SELECT isDicom, instanceId FROM Inodes WHERE device=? AND inode=? AND time=? AND size=? "
+                                       "AND (isDicom=0 OR EXISTS (SELECT 1 FROM Files WHERE Files.instanceId=Inodes.instanceId))");
+  statement.BindInt64(0, static_cast<int64_t>(device));
+  statement.BindInt64(1, static_cast<int64_t>(inode));
+  statement.BindInt64(2, time);
+  statement.BindInt64(3, size);
+
+  if (statement.Step())
+  {
+    isDicom = statement.ColumnBool(0);
+    instanceId = statement.ColumnString(1);
+    return true;
+  }
+  else
+  {
+    return false;
+  }
+}
+
+
+void IndexerDatabase::StoreInode(uint64_t device,
+                                 uint64_t inode,
+                                 const std::time_t time,
+                                 const uintmax_t size,
+                                 bool isDicom,
+                                 const std::string& instanceId)
+{
+  DatabaseLock lock(mutex_);
+
+  Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                       "INSERT OR REPLACE INTO Inodes VALUES(?, ?, ?, ?, ?, ?)");
+  statement.BindInt64(0, static_cast<int64_t>(device));
+  statement.BindInt64(1, static_cast<int64_t>(inode));
+  statement.BindInt64(2, time);
+  statement.BindInt64(3, size);
+  statement.BindInt64(4, isDicom);
+  statement.BindString(5, instanceId);
+  statement.Run();
+}
+
+
+void IndexerDatabase::ListDirectory(std::list<DirectoryChild>& target,
+                                    const std::string& path)
+{
+  const std::string directory = NormalizeDirectory(path);
+
+  std::string lower, upper;
+  GetDirectoryRange(lower, upper, directory);
+
+  const char separator = lower[lower.size() - 1];
+
+  std::map<std::string, DirectoryChild> children;
+
+  DatabaseLock lock(mutex_);
+
+  {
+    // Files that are directly in the directory. Like in
+    // "ListDirectoryContent()", the range scan seeks past the content
+    // of each subdirectory, so that its cost is proportional to the
+    // number of children, not to the size of the subtree.
+    Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                         "SELECT Files.path, Files.size, Files.time, Files.isDicom, "
+                                         "IFNULL(Instances.seriesInstanceUid, '') FROM Files LEFT JOIN Instances "
+                                         "ON Files.isDicom=1 AND Files.instanceId=Instances.instanceId "
+                                         "WHERE Files.path>=? AND Files.path<? ORDER BY Files.path");
+
+    std::string from = lower;
+    bool done = false;
+
+    while (!done)
+    {
+      statement.Reset();
+      statement.BindString(0, from);
+      statement.BindString(1, upper);
+
+      done = true;
+
+      while (statement.Step())
+      {
+        const std::string name = statement.ColumnString(0).substr(lower.size());
+        const size_t pos = name.find(separator);
+
+        if (pos == std::string::npos)
+        {
+          DirectoryChild& child = children[name];
+          child.isDirectory_ = false;
+          child.size_ = statement.ColumnInt64(1);
+          child.time_ = statement.ColumnInt64(2);
+          child.dicomFiles_ = (statement.ColumnBool(3) ? 1 : 0);
+          child.otherFiles_ = (statement.ColumnBool(3) ? 0 : 1);
+          child.seriesInstanceUid_ = statement.ColumnString(4);
+        }
+        else
+        {
+          from = lower + name.substr(0, pos) + static_cast<char>(separator + 1);
+          done = false;
+          break;
+        }
+      }
+    }
+  }
+
+  {
+    // Subdirectories, using the statistics of their subtree. The
+    // statistics of the deeper directories are skipped the same way.
+    Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                         "SELECT path, files, dicomFiles, size, lastChange "
+                                         "FROM DirectoryStatistics WHERE path>=? AND path<? ORDER BY path");
+
+    std::string from = lower;
+    bool done = false;
+
+    while (!done)
+    {
+      statement.Reset();
+      statement.BindString(0, from);
+      statement.BindString(1, upper);
+
+      done = true;
+
+      while (statement.Step())
+      {
+        const std::string name = statement.ColumnString(0).substr(lower.size());
+        const size_t pos = name.find(separator);
+
+        if (name.empty())
+        {
+          continue;
+        }
+        else if (pos == std::string::npos)
+        {
+          DirectoryChild& child = children[name];
+          child.isDirectory_ = true;
+          child.dicomFiles_ = static_cast<unsigned int>(statement.ColumnInt64(2));
+          child.otherFiles_ = static_cast<unsigned int>(statement.ColumnInt64(1) - statement.ColumnInt64(2));
+          child.size_ = statement.ColumnInt64(3);
+          child.time_ = statement.ColumnInt64(4);
+        }
+        else
+        {
+          from = lower + name.substr(0, pos) + static_cast<char>(separator + 1);
+          done = false;
+          break;
+        }
+      }
+    }
+  }
+
+  {
+    // Subdirectories without any file, known from the crawler
+    Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                         "SELECT substr(path, length(?) + 1) FROM Directories WHERE parent=?");
+    statement.BindString(0, lower);
+    statement.BindString(1, directory);
+
+    while (statement.Step())
+    {
+      const std::string name = statement.ColumnString(0);
+      if (children.find(name) == children.end())
+      {
+        DirectoryChild& child = children[name];
+        child.isDirectory_ = true;
+        child.dicomFiles_ = 0;
+        child.otherFiles_ = 0;
+        child.size_ = 0;
+        child.time_ = 0;
+      }
+    }
+  }
+
+  target.clear();
+
+  for (std::map<std::string, DirectoryChild>::iterator it = children.begin(); it != children.end(); ++it)
+  {
+    it->second.name_ = it->first;
+    target.push_back(it->second);
+  }
+}
+
+
+void IndexerDatabase::ListDirectoryContent(std::vector<KnownFile>& files,
+                                           std::vector<std::string>& subdirectories,
+                                           const std::string& directory)
+{
+  std::string lower, upper;
+  GetDirectoryRange(lower, upper, directory);
+
+  const char separator = lower[lower.size() - 1];
+
+  files.clear();
+  subdirectories.clear();
+
+  DatabaseLock lock(mutex_);
+
+  Orthanc::SQLite::Transaction transaction(db_);
+  transaction.Begin();
+
+  {
+    Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                         "SELECT path, time, size, isDicom, instanceId FROM Files "
+                                         "WHERE path>=? AND path<? ORDER BY path");
+
+    std::string from = lower;
+    bool done = false;
+
+    while (!done)
+    {
+      statement.Reset();
+      statement.BindString(0, from);
+      statement.BindString(1, upper);
+
+      done = true;
+
+      while (statement.Step())
+      {
+        const std::string name = statement.ColumnString(0).substr(lower.size());
+        const size_t pos = name.find(separator);
+
+        if (pos == std::string::npos)
+        {
+          KnownFile file;
+          file.name_ = name;
+          file.time_ = static_cast<std::time_t>(statement.ColumnInt64(1));
+          file.size_ = static_cast<uintmax_t>(statement.ColumnInt64(2));
+          file.isDicom_ = statement.ColumnBool(3);
+          file.instanceId_ = statement.ColumnString(4);
+          files.push_back(file);
+        }
+        else
+        {
+          // Seek past the content of this subdirectory, whose paths
+          // are all below "subdirectory + (separator + 1)"
+          const std::string subdirectory = name.substr(0, pos);
+          subdirectories.push_back(subdirectory);
+          from = lower + subdirectory + static_cast<char>(separator + 1);
+          done = false;
+          break;
+        }
+      }
+    }
+  }
+
+  transaction.Commit();
+}
+
+
+void IndexerDatabase::StoreInstance(const std::string& instanceId,
+                                    const std::string& seriesInstanceUid,
+                                    const std::string& sopInstanceUid)
+{
+  DatabaseLock lock(mutex_);
+
+  Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                       "INSERT OR REPLACE INTO Instances VALUES(?, ?, ?)");
+  statement.BindString(0, instanceId);
+  statement.BindString(1, seriesInstanceUid);
+  statement.BindString(2, sopInstanceUid);
+  statement.Run();
+}
+
+
+void IndexerDatabase::ListInstancesWithoutSeries(std::map<std::string, std::string>& target,
+                                                 const std::string& after,
+                                                 size_t limit)
+{
+  DatabaseLock lock(mutex_);
+
+  target.clear();
+
+  Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                       "SELECT instanceId, MIN(path) FROM Files WHERE isDicom=1 AND instanceId>? AND NOT EXISTS "
+                                       "(SELECT 1 FROM Instances WHERE Instances.instanceId=Files.instanceId) "
+                                       "GROUP BY instanceId ORDER BY instanceId LIMIT ?");
+  statement.BindString(0, after);
+  statement.BindInt64(1, limit);
+
+  while (statement.Step())
+  {
+    target[statement.ColumnString(0)] = statement.ColumnString(1);
+  }
+}
+
+
+bool IndexerDatabase::LookupSeries(std::string& seriesInstanceUid,
+                                   const std::string& path)
+{
+  DatabaseLock lock(mutex_);
+
+  Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                       "SELECT Instances.seriesInstanceUid FROM Files INNER JOIN Instances "
+                                       "ON Files.instanceId=Instances.instanceId WHERE Files.path=?");
+  statement.BindString(0, path);
+
+  if (statement.Step())
+  {
+    seriesInstanceUid = statement.ColumnString(0);
+    return true;
+  }
+  else
+  {
+    return false;
+  }
+}
+
+
+void IndexerDatabase::ListSeriesFiles(std::list<std::string>& target,
+                                      const std::string& seriesInstanceUid,
+                                      size_t limit)
+{
+  DatabaseLock lock(mutex_);
+
+  target.clear();
+
+  // Only one copy of each instance, in alphabetical order to follow
+  // the layout of the series on the disk
+  Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                       "SELECT MIN(Files.path) FROM Instances INNER JOIN Files "
+                                       "ON Files.instanceId=Instances.instanceId WHERE Instances.seriesInstanceUid=? "
+                                       "GROUP BY Files.instanceId ORDER BY 1 LIMIT ?");
+  statement.BindString(0, seriesInstanceUid);
+  statement.BindInt64(1, limit);
+
+  while (statement.Step())
+  {
+    target.push_back(statement.ColumnString(0));
+  }
+}
+
+
+void IndexerDatabase::LookupSopInstances(std::map<std::string, std::list<std::string> >& target,
+                                         const std::set<std::string>& sopInstanceUids)
+{
+  DatabaseLock lock(mutex_);
+
+  target.clear();
+
+  Orthanc::SQLite::Transaction transaction(db_);
+  transaction.Begin();
+
+  {
+    // An instance is stored by Orthanc iff. it has an attachment
+    Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                         "SELECT Files.path FROM Instances INNER JOIN Files "
+                                         "ON Files.instanceId=Instances.instanceId AND Files.isDicom=1 "
+                                         "WHERE Instances.sopInstanceUid=? AND EXISTS "
+                                         "(SELECT 1 FROM Attachments WHERE Attachments.instanceId=Instances.instanceId)");
+
+    for (std::set<std::string>::const_iterator it = sopInstanceUids.begin(); it != sopInstanceUids.end(); ++it)
+    {
+      statement.Reset();
+      statement.BindString(0, *it);
+
+      while (statement.Step())
+      {
+        target[*it].push_back(statement.ColumnString(0));
+      }
+    }
+  }
+
+  transaction.Commit();
+}
+
+
+bool IndexerDatabase::IsSopInstanceStored(const std::string& sopInstanceUid)
+{
+  DatabaseLock lock(mutex_);
+
+  Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                       "SELECT 1 FROM Instances WHERE sopInstanceUid=? AND EXISTS "
+                                       "(SELECT 1 FROM Attachments WHERE Attachments.instanceId=Instances.instanceId) LIMIT 1");
+  statement.BindString(0, sopInstanceUid);
+  return statement.Step();
+}
+
+
+void IndexerDatabase::StoreReceivedFile(const std::string& path,
+                                        const std::string& root)
+{
+  DatabaseLock lock(mutex_);
+
+  Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                       "INSERT OR REPLACE INTO ReceivedFiles VALUES(?, ?)");
+  statement.BindString(0, path);
+  statement.BindString(1, root);
+  statement.Run();
+}
+
+
+bool IndexerDatabase::LookupReceivedFile(std::string& root,
+                                         const std::string& path)
+{
+  DatabaseLock lock(mutex_);
+
+  Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                       "SELECT root FROM ReceivedFiles WHERE path=?");
+  statement.BindString(0, path);
+
+  if (statement.Step())
+  {
+    root = statement.ColumnString(0);
+    return true;
+  }
+  else
+  {
+    return false;
+  }
+}
+
+
+bool IndexerDatabase::LookupStatistics(Statistics& target,
+                                       const std::string& directory)
+{
+  DatabaseLock lock(mutex_);
+
+  Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                       "SELECT files, dicomFiles, size, lastChange FROM DirectoryStatistics WHERE path=?");
+  statement.BindString(0, NormalizeDirectory(directory));
+
+  if (statement.Step())
+  {
+    target.files_ = statement.ColumnInt64(0);
+    target.dicomFiles_ = statement.ColumnInt64(1);
+    target.size_ = statement.ColumnInt64(2);
+    target.lastChange_ = statement.ColumnInt64(3);
+    return true;
+  }
+  else
+  {
+    return false;
+  }
+}
+
+
+bool IndexerDatabase::LookupTranscodingCandidate(std::string& path,
+                                                 std::time_t& time,
+                                                 uintmax_t& size,
+                                                 const std::string& after)
+{
+  DatabaseLock lock(mutex_);
+
+  Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                       "SELECT Files.path, Files.time, Files.size FROM Files LEFT JOIN DerivedFiles "
+                                       "ON DerivedFiles.path=Files.path WHERE Files.path>? AND Files.isDicom=1 AND "
+                                       "(DerivedFiles.path IS NULL OR DerivedFiles.time<>Files.time OR DerivedFiles.size<>Files.size) AND "
+                                       "EXISTS (SELECT 1 FROM Attachments WHERE Attachments.instanceId=Files.instanceId) "
+                                       "ORDER BY Files.path LIMIT 1");
+  statement.BindString(0, after);
+
+  if (statement.Step())
+  {
+    path = statement.ColumnString(0);
+    time = statement.ColumnInt64(1);
+    size = statement.ColumnInt64(2);
+    return true;
+  }
+  else
+  {
+    return false;
+  }
+}
+
+
+void IndexerDatabase::StoreDerivedFile(const std::string& path,
+                                       const std::time_t time,
+                                       const uintmax_t size,
+                                       const std::string& derivedPath)
+{
+  DatabaseLock lock(mutex_);
+
+  Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                       "INSERT OR REPLACE INTO DerivedFiles VALUES(?, ?, ?, ?)");
+  statement.BindString(0, path);
+  statement.BindInt64(1, time);
+  statement.BindInt64(2, size);
+  statement.BindString(3, derivedPath);
+  statement.Run();
+}
+
+
+bool IndexerDatabase::LookupDerivedFile(std::string& derivedPath,
+                                        const std::string& path,
+                                        const std::time_t time,
+                                        const uintmax_t size)
+{
+  DatabaseLock lock(mutex_);
+
+  Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                       "SELECT derivedPath FROM DerivedFiles WHERE path=? AND time=? AND size=? AND derivedPath<>''");
+  statement.BindString(0, path);
+  statement.BindInt64(1, time);
+  statement.BindInt64(2, size);
+
+  if (statement.Step())
+  {
+    derivedPath = statement.ColumnString(0);
+    return true;
+  }
+  else
+  {
+    return false;
+  }
+}
+
+
+bool IndexerDatabase::PopDerivedGarbage(std::string& derivedPath)
+{
+  DatabaseLock lock(mutex_);
+
+  Orthanc::SQLite::Transaction transaction(db_);
+  transaction.Begin();
+
+  {
+    Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                         "SELECT derivedPath FROM DerivedGarbage LIMIT 1");
+    if (!statement.Step())
+    {
+      transaction.Commit();
+      return false;
+    }
+
+    derivedPath = statement.ColumnString(0);
+  }
+
+  {
+    Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                         "DELETE FROM DerivedGarbage WHERE derivedPath=?");
+    statement.BindString(0, derivedPath);
+    statement.Run();
+  }
+
+  transaction.Commit();
+  return true;
+}
+
+
+void IndexerDatabase::AddCacheAttachment(const std::string& uuid,
+                                         const std::string& instanceId,
+                                         int32_t type,
+                                         uint64_t size)
+{
+  DatabaseLock lock(mutex_);
+
+  Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                       "INSERT OR REPLACE INTO CacheAttachments VALUES(?, ?, ?, ?)");
+  statement.BindString(0, uuid);
+  statement.BindString(1, instanceId);
+  statement.BindInt(2, type);
+  statement.BindInt64(3, size);
+  statement.Run();
+}
+
+
+void IndexerDatabase::RemoveCacheAttachment(const std::string& uuid)
+{
+  DatabaseLock lock(mutex_);
+
+  Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                       "DELETE FROM CacheAttachments WHERE uuid=?");
+  statement.BindString(0, uuid);
+  statement.Run();
+}
+
+
+void IndexerDatabase::ListCacheAttachments(std::list<CacheAttachment>& target)
+{
+  DatabaseLock lock(mutex_);
+
+  target.clear();
+
+  Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                       "SELECT uuid, instanceId, type, size FROM CacheAttachments ORDER BY rowid");
+
+  while (statement.Step())
+  {
+    CacheAttachment attachment;
+    attachment.uuid_ = statement.ColumnString(0);
+    attachment.instanceId_ = statement.ColumnString(1);
+    attachment.type_ = statement.ColumnInt(2);
+    attachment.size_ = statement.ColumnInt64(3);
+    target.push_back(attachment);
+  }
+}
+
+
 unsigned int IndexerDatabase::GetFilesCount()
 {
   Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
@@ -373,3 +1356,12 @@ unsigned int IndexerDatabase::GetAttachmentsCount()
   statement.Step();
   return static_cast<unsigned int>(statement.ColumnInt64(0));
 }
+
+
+unsigned int IndexerDatabase::GetDirectoriesCount()
+{
+  Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                       "SELECT COUNT(*) FROM Directories");
+  statement.Step();
+  return static_cast<unsigned int>(statement.ColumnInt64(0));
+}
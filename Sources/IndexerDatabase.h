@@ -24,6 +24,10 @@
 
 #include <boost/noncopyable.hpp>
 #include <boost/thread/mutex.hpp>
+#include <list>
+#include <map>
+#include <set>
+#include <vector>
 
 
 class IndexerDatabase : public boost::noncopyable
@@ -37,6 +41,55 @@ public:
     FileStatus_NotDicom
   };
 
+  // Counters of the files below a directory (in its whole subtree)
+  struct Statistics
+  {
+    uint64_t     files_;
+    uint64_t     dicomFiles_;
+    uint64_t     size_;
+    std::time_t  lastChange_;  // Modification time of the newest file indexed in the subtree
+
+    Statistics() :
+      files_(0),
+      dicomFiles_(0),
+      size_(0),
+      lastChange_(0)
+    {
+    }
+  };
+
+  // Child of a directory, as known from the index. The counters of a
+  // file are 0 or 1, those of a directory cover its whole subtree.
+  struct DirectoryChild
+  {
+    std::string   name_;
+    bool          isDirectory_;
+    unsigned int  dicomFiles_;
+    unsigned int  otherFiles_;
+    uint64_t      size_;
+    std::time_t   time_;               // Most recent modification (last change of the index for directories)
+    std::string   seriesInstanceUid_;  // Only for DICOM files, empty if unknown
+  };
+
+  // File directly inside a directory, as known from the index
+  struct KnownFile
+  {
+    std::string  name_;
+    std::time_t  time_;
+    uintmax_t    size_;
+    bool         isDicom_;
+    std::string  instanceId_;
+  };
+
+  // Cache attachment of Orthanc that can be evicted
+  struct CacheAttachment
+  {
+    std::string  uuid_;
+    std::string  instanceId_;
+    int32_t      type_;
+    uint64_t     size_;
+  };
+
   class IFileVisitor : public boost::noncopyable
   {
   public:
@@ -56,6 +109,14 @@ private:
   
   void Initialize();
 
+  void UpdateStatistics(const std::string& path,
+                        int64_t files,
+                        int64_t dicomFiles,
+                        int64_t size,
+                        const std::time_t time);
+
+  void BackfillStatistics();
+
   void AddFileInternal(const std::string& path,
                        const std::time_t time,
                        const uintmax_t size,
@@ -91,6 +152,14 @@ public:
   // shouldn't do lengthy operations
   void Apply(IFileVisitor& visitor);
 
+  // Visits, in alphabetical order, at most "limit" files below
+  // "directory" whose path comes strictly after "after" (which can
+  // be empty). Returns the number of visited files.
+  size_t Apply(IFileVisitor& visitor,
+               const std::string& directory,
+               const std::string& after,
+               size_t limit);
+
   // Returns "false" iff. this instance has not been previously
   // registerded using "AddDicomInstance()", which indicates the
   // import of an external DICOM file
@@ -102,7 +171,136 @@ public:
 
   void RemoveAttachment(const std::string& uuid);
 
+  // Returns "false" iff. the directory has never been visited
+  bool LookupDirectory(std::time_t& lastVisit,
+                       unsigned int& revisitInterval,
+                       std::time_t& nextVisit,
+                       const std::string& path);
+
+  void StoreDirectoryVisit(const std::string& path,
+                           const std::string& parent,
+                           const std::time_t visit,
+                           bool changed,
+                           unsigned int revisitInterval,
+                           const std::time_t nextVisit);
+
+  void ListChildDirectories(std::list<std::string>& target,
+                            const std::string& parent);
+
+  // Also forgets about all the known subdirectories
+  void ForgetDirectory(const std::string& path);
+
+  // Makes a visited directory due at the next scan of its root
+  void ScheduleDirectoryVisit(const std::string& path);
+
+  // Only returns the DICOM instances that are still indexed
+  bool LookupInode(bool& isDicom,
+                   std::string& instanceId,
+                   uint64_t device,
+                   uint64_t inode,
+                   const std::time_t time,
+                   const uintmax_t size);
+
+  void StoreInode(uint64_t device,
+                  uint64_t inode,
+                  const std::time_t time,
+                  const uintmax_t size,
+                  bool isDicom,
+                  const std::string& instanceId);
+
+  // Sorted by name, without accessing the filesystem
+  void ListDirectory(std::list<DirectoryChild>& target,
+                     const std::string& directory);
+
+  // Lists the indexed files that are directly inside "directory", and
+  // the subdirectories having indexed files below them, both sorted
+  // by name. Only one range scan of the Files table is done, which
+  // skips over the content of each subdirectory.
+  void ListDirectoryContent(std::vector<KnownFile>& files,
+                            std::vector<std::string>& subdirectories,
+                            const std::string& directory);
+
+  // Returns "false" iff. no file was ever indexed below this directory
+  bool LookupStatistics(Statistics& target,
+                        const std::string& directory);
+
+  // Records the DICOM identifiers of an instance, which are
+  // forgotten once its last copy is removed
+  void StoreInstance(const std::string& instanceId,
+                     const std::string& seriesInstanceUid,
+                     const std::string& sopInstanceUid);
+
+  // Lists the DICOM instances that are indexed without their DICOM
+  // identifiers (by older versions of the plugin), with one of their
+  // paths, in the order of their identifiers after "after"
+  void ListInstancesWithoutSeries(std::map<std::string, std::string>& target,
+                                  const std::string& after,
+                                  size_t limit);
+
+  // Returns "false" iff. the series of this file is unknown
+  bool LookupSeries(std::string& seriesInstanceUid,
+                    const std::string& path);
+
+  // Lists one path for each instance of the series, sorted by path
+  void ListSeriesFiles(std::list<std::string>& target,
+                       const std::string& seriesInstanceUid,
+                       size_t limit);
+
+  // Lists, in one transaction, the indexed files of the given SOP
+  // instances that are stored by Orthanc. The SOP instances that are
+  // unknown to the index are absent from "target".
+  void LookupSopInstances(std::map<std::string, std::list<std::string> >& target,
+                          const std::set<std::string>& sopInstanceUids);
+
+  // Returns "true" iff. some instance with this SOP Instance UID is
+  // indexed and stored by Orthanc
+  bool IsSopInstanceStored(const std::string& sopInstanceUid);
+
+  // Records the storage directory of a file received by Orthanc,
+  // which is forgotten once the file is removed
+  void StoreReceivedFile(const std::string& path,
+                         const std::string& root);
+
+  // Returns "false" iff. the file was not received by Orthanc
+  bool LookupReceivedFile(std::string& root,
+                          const std::string& path);
+
+  // Looks for the first DICOM file stored by Orthanc, whose path comes
+  // strictly after "after" (which can be empty), and that has no
+  // up-to-date entry in DerivedFiles
+  bool LookupTranscodingCandidate(std::string& path,
+                                  std::time_t& time,
+                                  uintmax_t& size,
+                                  const std::string& after);
+
+  // An empty "derivedPath" records that the file is not transcoded
+  void StoreDerivedFile(const std::string& path,
+                        const std::time_t time,
+                        const uintmax_t size,
+                        const std::string& derivedPath);
+
+  // Returns "false" iff. there is no copy of this version of the file
+  bool LookupDerivedFile(std::string& derivedPath,
+                         const std::string& path,
+                         const std::time_t time,
+                         const uintmax_t size);
+
+  // Dequeues a copy whose original was removed from the index
+  bool PopDerivedGarbage(std::string& derivedPath);
+
+  void AddCacheAttachment(const std::string& uuid,
+                          const std::string& instanceId,
+                          int32_t type,
+                          uint64_t size);
+
+  void RemoveCacheAttachment(const std::string& uuid);
+
+  // Sorted from the oldest to the most recently added attachment
+  void ListCacheAttachments(std::list<CacheAttachment>& target);
+
   unsigned int GetFilesCount();  // For unit testing
 
   unsigned int GetAttachmentsCount();  // For unit testing
+
+  unsigned int GetDirectoriesCount();  // For unit testing
 };
@@ -0,0 +1,128 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "InodeCache.h"
+
+#if !defined(_WIN32)
+#  include <sys/stat.h>
+#endif
+
+
+InodeCache::InodeCache(IndexerDatabase& database,
+                       bool persistent,
+                       size_t maximumSize) :
+  database_(database),
+  persistent_(persistent),
+  maximumSize_(maximumSize)
+{
+}
+
+
+bool InodeCache::GetIdentity(uint64_t& device,
+                             uint64_t& inode,
+                             const std::string& path)
+{
+#if defined(_WIN32)
+  return false;
+#else
+  struct stat info;
+  if (stat(path.c_str(), &info) == 0)
+  {
+    device = static_cast<uint64_t>(info.st_dev);
+    inode = static_cast<uint64_t>(info.st_ino);
+    return true;
+  }
+  else
+  {
+    return false;
+  }
+#endif
+}
+
+
+bool InodeCache::Lookup(bool& isDicom,
+                        std::string& instanceId,
+                        uint64_t device,
+                        uint64_t inode,
+                        const std::time_t time,
+                        const uintmax_t size)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  Content::const_iterator found = content_.find(std::make_pair(device, inode));
+
+  if (found != content_.end() &&
+      found->second.time_ == time &&
+      found->second.size_ == size)
+  {
+    isDicom = found->second.isDicom_;
+    instanceId = found->second.instanceId_;
+    return true;
+  }
+  else if (persistent_ &&
+           database_.LookupInode(isDicom, instanceId, device, inode, time, size))
+  {
+    // Promote the persistent entry to the in-memory cache
+    StoreInMemory(device, inode, time, size, isDicom, instanceId);
+    return true;
+  }
+  else
+  {
+    return false;
+  }
+}
+
+
+void InodeCache::StoreInMemory(uint64_t device,
+                               uint64_t inode,
+                               const std::time_t time,
+                               const uintmax_t size,
+                               bool isDicom,
+                               const std::string& instanceId)
+{
+  if (content_.size() >= maximumSize_)
+  {
+    content_.clear();
+  }
+
+  Identification& identification = content_[std::make_pair(device, inode)];
+  identification.time_ = time;
+  identification.size_ = size;
+  identification.isDicom_ = isDicom;
+  identification.instanceId_ = instanceId;
+}
+
+
+void InodeCache::Store(uint64_t device,
+                       uint64_t inode,
+                       const std::time_t time,
+                       const uintmax_t size,
+                       bool isDicom,
+                       const std::string& instanceId)
+{
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    StoreInMemory(device, inode, time, size, isDicom, instanceId);
+  }
+
+  if (persistent_)
+  {
+    database_.StoreInode(device, inode, time, size, isDicom, instanceId);
+  }
+}
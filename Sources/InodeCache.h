@@ -0,0 +1,99 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include "IndexerDatabase.h"
+
+#include <boost/thread/mutex.hpp>
+#include <map>
+
+
+/**
+ * Cache of the identification results of the crawled files, indexed
+ * by the identity of their inode. This avoids reading and parsing
+ * again the hard links (or reflinked copies sharing the inode) of a
+ * file that was already identified. The in-memory cache is meant to
+ * be cleared at each scan, whereas the optional persistent cache is
+ * stored in the database of the plugin. The cache is shared by the
+ * workers processing the huge directories of the same root.
+ **/
+class InodeCache : public boost::noncopyable
+{
+private:
+  struct Identification
+  {
+    std::time_t  time_;
+    uintmax_t    size_;
+    bool         isDicom_;
+    std::string  instanceId_;
+  };
+
+  typedef std::pair<uint64_t, uint64_t>            Identity;  // (device, inode)
+  typedef std::map<Identity, Identification>  Content;
+
+  mutable boost::mutex  mutex_;
+  IndexerDatabase&      database_;
+  bool                  persistent_;
+  size_t                maximumSize_;
+  Content               content_;
+
+  void StoreInMemory(uint64_t device,
+                     uint64_t inode,
+                     const std::time_t time,
+                     const uintmax_t size,
+                     bool isDicom,
+                     const std::string& instanceId);
+
+public:
+  InodeCache(IndexerDatabase& database,
+             bool persistent,
+             size_t maximumSize);
+
+  // Returns "false" if the filesystem doesn't provide inode numbers
+  static bool GetIdentity(uint64_t& device,
+                          uint64_t& inode,
+                          const std::string& path);
+
+  bool Lookup(bool& isDicom,
+              std::string& instanceId,
+              uint64_t device,
+              uint64_t inode,
+              const std::time_t time,
+              const uintmax_t size);
+
+  void Store(uint64_t device,
+             uint64_t inode,
+             const std::time_t time,
+             const uintmax_t size,
+             bool isDicom,
+             const std::string& instanceId);
+
+  void Clear()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    content_.clear();
+  }
+
+  size_t GetSize() const
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return content_.size();
+  }
+};
@@ -0,0 +1,320 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "MemoryBudget.h"
+
+#include <OrthancException.h>
+#include <SystemToolbox.h>
+
+#include <boost/algorithm/string/classification.hpp>
+#include <boost/algorithm/string/split.hpp>
+#include <boost/algorithm/string/trim.hpp>
+#include <boost/lexical_cast.hpp>
+#include <algorithm>
+#include <cassert>
+
+
+// Returns "false" if the files are absent or unreadable, or if there is no limit
+static bool ReadCgroupFiles(uint64_t& usage,
+                            uint64_t& limit,
+                            const std::string& usagePath,
+                            const std::string& limitPath)
+{
+  if (!Orthanc::SystemToolbox::IsRegularFile(usagePath) ||
+      !Orthanc::SystemToolbox::IsRegularFile(limitPath))
+  {
+    return false;
+  }
+
+  try
+  {
+    std::string a, b;
+    Orthanc::SystemToolbox::ReadFile(a, usagePath);
+    Orthanc::SystemToolbox::ReadFile(b, limitPath);
+    boost::algorithm::trim(a);
+    boost::algorithm::trim(b);
+
+    if (b == "max")
+    {
+      return false;  // No limit (cgroup v2)
+    }
+
+    usage = boost::lexical_cast<uint64_t>(a);
+    limit = boost::lexical_cast<uint64_t>(b);
+
+    // cgroup v1 reports a huge value if there is no limit
+    return (limit < (static_cast<uint64_t>(1) << 60));
+  }
+  catch (Orthanc::OrthancException&)
+  {
+    return false;
+  }
+  catch (boost::bad_lexical_cast&)
+  {
+    return false;
+  }
+}
+
+
+uint64_t MemoryBudget::GetShareInternal(const Component& component,
+                                        uint64_t ceiling) const
+{
+  uint64_t totalWeight = 0;
+  for (size_t i = 0; i < components_.size(); i++)
+  {
+    totalWeight += components_[i].weight_;
+  }
+
+  assert(totalWeight != 0);
+  return ceiling / totalWeight * component.weight_;
+}
+
+
+MemoryBudget::MemoryBudget(uint64_t ceiling,
+                           float pressureThreshold) :
+  ceiling_(ceiling),
+  pressureThreshold_(pressureThreshold),
+  underPressure_(false)
+{
+  if (ceiling == 0 ||
+      pressureThreshold <= 0.0f ||
+      pressureThreshold > 1.0f)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+  }
+}
+
+
+void MemoryBudget::Register(const std::string& name,
+                            IConsumer& consumer,
+                            unsigned int weight)
+{
+  if (weight == 0)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+  }
+
+  boost::mutex::scoped_lock lock(mutex_);
+
+  for (size_t i = 0; i < components_.size(); i++)
+  {
+    if (components_[i].consumer_ == &consumer ||
+        components_[i].name_ == name)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls,
+                                      "Component registered twice with the memory budget: " + name);
+    }
+  }
+
+  Component component;
+  component.name_ = name;
+  component.consumer_ = &consumer;
+  component.weight_ = weight;
+  component.usage_ = 0;
+  component.shrinks_ = 0;
+  components_.push_back(component);
+}
+
+
+void MemoryBudget::Unregister(IConsumer& consumer)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  for (std::vector<Component>::iterator it = components_.begin(); it != components_.end(); ++it)
+  {
+    if (it->consumer_ == &consumer)
+    {
+      components_.erase(it);
+      return;
+    }
+  }
+}
+
+
+void MemoryBudget::ParseCgroups(std::string& unified,
+                                std::string& memory,
+                                const std::string& content)
+{
+  unified.clear();
+  memory.clear();
+
+  std::vector<std::string> lines;
+  boost::algorithm::split(lines, content, boost::is_any_of("\n"));
+
+  for (size_t i = 0; i < lines.size(); i++)
+  {
+    // Format: "hierarchy-ID:controller-list:cgroup-path"
+    const size_t first = lines[i].find(':');
+    const size_t second = (first == std::string::npos ? std::string::npos : lines[i].find(':', first + 1));
+
+    if (second != std::string::npos)
+    {
+      const std::string hierarchy = lines[i].substr(0, first);
+      const std::string path = lines[i].substr(second + 1);
+
+      std::vector<std::string> controllers;
+      const std::string list = lines[i].substr(first + 1, second - first - 1);
+      boost::algorithm::split(controllers, list, boost::is_any_of(","));
+
+      if (hierarchy == "0" &&
+          list.empty())
+      {
+        unified = path;
+      }
+      else if (std::find(controllers.begin(), controllers.end(), "memory") != controllers.end())
+      {
+        memory = path;
+      }
+    }
+  }
+}
+
+
+bool MemoryBudget::ReadCgroupMemory(uint64_t& usage,
+                                    uint64_t& limit)
+{
+  std::string unified, memory;
+
+  try
+  {
+    std::string content;
+    Orthanc::SystemToolbox::ReadFile(content, "/proc/self/cgroup");
+    ParseCgroups(unified, memory, content);
+  }
+  catch (Orthanc::OrthancException&)
+  {
+  }
+
+  // First try cgroup v2, then cgroup v1. In each hierarchy, first try
+  // the cgroup of the process, then the root of the hierarchy, which
+  // is the cgroup of a container that has its own cgroup namespace.
+  std::vector<std::string> directories;
+
+  if (!unified.empty())
+  {
+    directories.push_back("/sys/fs/cgroup" + unified);
+  }
+
+  directories.push_back("/sys/fs/cgroup");
+
+  for (size_t i = 0; i < directories.size(); i++)
+  {
+    if (ReadCgroupFiles(usage, limit, directories[i] + "/memory.current", directories[i] + "/memory.max"))
+    {
+      return true;
+    }
+  }
+
+  directories.clear();
+
+  if (!memory.empty())
+  {
+    directories.push_back("/sys/fs/cgroup/memory" + memory);
+  }
+
+  directories.push_back("/sys/fs/cgroup/memory");
+
+  for (size_t i = 0; i < directories.size(); i++)
+  {
+    if (ReadCgroupFiles(usage, limit, directories[i] + "/memory.usage_in_bytes", directories[i] + "/memory.limit_in_bytes"))
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+bool MemoryBudget::IsUnderPressure(uint64_t usage,
+                                   uint64_t limit) const
+{
+  return (limit != 0 &&
+          static_cast<double>(usage) >= static_cast<double>(limit) * pressureThreshold_);
+}
+
+
+uint64_t MemoryBudget::Enforce(bool underPressure)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  underPressure_ = underPressure;
+
+  uint64_t total = 0;
+  for (size_t i = 0; i < components_.size(); i++)
+  {
+    components_[i].usage_ = components_[i].consumer_->GetMemoryUsage();
+    total += components_[i].usage_;
+  }
+
+  const uint64_t ceiling = (underPressure ? ceiling_ / 2 : ceiling_);
+
+  if (total > ceiling)
+  {
+    for (size_t i = 0; i < components_.size(); i++)
+    {
+      Component& component = components_[i];
+      const uint64_t share = GetShareInternal(component, ceiling);
+
+      if (component.usage_ > share)
+      {
+        component.consumer_->ShrinkMemory(share);
+        component.shrinks_++;
+
+        const uint64_t usage = component.consumer_->GetMemoryUsage();
+        total = total - component.usage_ + usage;
+        component.usage_ = usage;
+      }
+    }
+  }
+
+  return total;
+}
+
+
+void MemoryBudget::Format(Json::Value& target)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  const uint64_t ceiling = (underPressure_ ? ceiling_ / 2 : ceiling_);
+
+  target = Json::objectValue;
+  target["Ceiling"] = static_cast<Json::UInt64>(ceiling_);
+  target["UnderPressure"] = underPressure_;
+  target["Components"] = Json::arrayValue;
+
+  uint64_t total = 0;
+
+  for (size_t i = 0; i < components_.size(); i++)
+  {
+    const Component& component = components_[i];
+
+    Json::Value item = Json::objectValue;
+    item["Name"] = component.name_;
+    item["Weight"] = component.weight_;
+    item["Share"] = static_cast<Json::UInt64>(GetShareInternal(component, ceiling));  // Halved under pressure
+    item["Usage"] = static_cast<Json::UInt64>(component.usage_);
+    item["Shrinks"] = component.shrinks_;
+    target["Components"].append(item);
+
+    total += component.usage_;
+  }
+
+  target["Usage"] = static_cast<Json::UInt64>(total);
+}
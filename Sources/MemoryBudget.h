@@ -0,0 +1,113 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include <OrthancFramework.h>  // For ORTHANC_OVERRIDE
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <json/value.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+
+/**
+ * Single memory ceiling shared by the caches and queues of the plugin.
+ * Each component registers with a weight, which defines its share of
+ * the ceiling. A component may exceed its share as long as the total
+ * stays below the ceiling. Once the total exceeds the ceiling, the
+ * components above their share are asked to shrink down to it. If the
+ * cgroup of the process (i.e. the container) is close to its memory
+ * limit, the ceiling is temporarily halved.
+ **/
+class MemoryBudget : public boost::noncopyable
+{
+public:
+  class IConsumer : public boost::noncopyable
+  {
+  public:
+    virtual ~IConsumer()
+    {
+    }
+
+    // Approximate number of bytes that are used
+    virtual uint64_t GetMemoryUsage() = 0;
+
+    // Pressure callback: Must release memory down to "target" bytes
+    virtual void ShrinkMemory(uint64_t target) = 0;
+  };
+
+private:
+  struct Component
+  {
+    std::string   name_;
+    IConsumer*    consumer_;
+    unsigned int  weight_;
+    uint64_t      usage_;    // At the last enforcement
+    unsigned int  shrinks_;
+  };
+
+  boost::mutex            mutex_;
+  uint64_t                ceiling_;
+  float                   pressureThreshold_;
+  std::vector<Component>  components_;
+  bool                    underPressure_;
+
+  uint64_t GetShareInternal(const Component& component,
+                            uint64_t ceiling) const;
+
+public:
+  // "pressureThreshold" is the fraction of the cgroup memory limit
+  // above which the plugin is considered under memory pressure
+  MemoryBudget(uint64_t ceiling,
+               float pressureThreshold);
+
+  uint64_t GetCeiling() const
+  {
+    return ceiling_;
+  }
+
+  void Register(const std::string& name,
+                IConsumer& consumer,
+                unsigned int weight);
+
+  void Unregister(IConsumer& consumer);
+
+  // Parses "/proc/self/cgroup" to find the cgroup of the process,
+  // relative to the root of the cgroup v2 hierarchy, and to the root
+  // of the memory controller of cgroup v1. Empty if unknown.
+  static void ParseCgroups(std::string& unified,
+                           std::string& memory,
+                           const std::string& content);
+
+  // Returns "false" if no cgroup memory limit is available
+  static bool ReadCgroupMemory(uint64_t& usage,
+                               uint64_t& limit);
+
+  // To be called periodically. "underPressure" is typically computed
+  // from "ReadCgroupMemory()". Returns the total usage.
+  uint64_t Enforce(bool underPressure);
+
+  bool IsUnderPressure(uint64_t usage,
+                       uint64_t limit) const;
+
+  void Format(Json::Value& target);
+};
@@ -17,8 +17,28 @@
  **/
 
 
+#include "CacheArea.h"
+#include "ChunkWorkers.h"
+#include "CrawlerWatchdog.h"
+#include "DerivedStorage.h"
+#include "DeviceQueues.h"
+#include "DirectoryReader.h"
+#include "DirectoryScheduler.h"
+#include "DirectorySnapshot.h"
+#include "DuplicateFilter.h"
+#include "HeaderPrefetcher.h"
 #include "IndexerDatabase.h"
+#include "InodeCache.h"
+#include "MemoryBudget.h"
+#include "RangeCoalescer.h"
+#include "ReadCache.h"
+#include "SeriesPrefetcher.h"
+#include "SlowLog.h"
 #include "StorageArea.h"
+#include "StorageCommitmentScp.h"
+#include "StoragePlacement.h"
+#include "ThreadPriority.h"
+#include "UploadBatch.h"
 #include "FileMemoryMap.h"
 
 #include "../Resources/Orthanc/Plugins/OrthancPluginCppWrapper.h"
@@ -30,25 +50,73 @@
 #include <SystemToolbox.h>
 
 #include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
 #include <boost/thread.hpp>
+#include <algorithm>
+#include <set>
 #include <stack>
 
 #include "camic_interact.h"
-
-static std::list<std::string>        folders_;
-static IndexerDatabase               database_;
-static std::unique_ptr<StorageArea>  storageArea_;
-static unsigned int                  intervalSeconds_;
-static boost::filesystem::path       realStoragePath;
+#include "camic_md5.h"
+
+static std::list<std::string>               folders_;
+static boost::shared_ptr<IndexerDatabase>   database_(new IndexerDatabase);  // Shared pointers are leaked by "AbandonCrawlers()"
+static std::unique_ptr<StorageArea>         storageArea_;
+static boost::shared_ptr<DirectoryScheduler>  scheduler_;  // NULL iff. adaptive intervals are disabled
+static boost::shared_ptr<CrawlerWatchdog>   watchdog_;
+static std::unique_ptr<ReadCache>           readCache_;  // NULL iff. the read cache is disabled
+static std::unique_ptr<SeriesPrefetcher>    prefetcher_;  // NULL iff. series prefetching is disabled
+static boost::shared_ptr<StoragePlacement>  placement_;  // Also owned by the thread measuring the free space
+static std::unique_ptr<MemoryBudget>        memoryBudget_;  // NULL iff. there is no global memory ceiling
+static std::unique_ptr<CacheArea>           cacheArea_;  // NULL iff. the cache attachments are not bounded
+static std::unique_ptr<DuplicateFilter>     duplicateFilter_;  // NULL iff. duplicates are handled by Orthanc
+static std::unique_ptr<DerivedStorage>      derivedStorage_;  // NULL iff. transcoding is disabled
+static boost::shared_ptr<DeviceQueues>      deviceQueues_;
+static std::vector<size_t>                  rootDevices_;  // Index in "deviceQueues_" of the device of each root
+static std::vector<boost::shared_ptr<HeaderPrefetcher> >  headerPrefetchers_;  // One per root, empty iff. disabled
+static std::unique_ptr<RangeCoalescer>      rangeCoalescer_;  // NULL iff. the range reads are not coalesced
+static boost::shared_ptr<SlowLog>           slowLog_;  // NULL iff. the slow operations are not logged
+static DirectorySnapshot::Accounting        snapshotsMemory_;  // Memory of the directories being merged
+static unsigned int                         intervalSeconds_;
+static unsigned int                         prefetchThreads_;
+static ThreadPriority::Level                backgroundPriority_ = ThreadPriority::Level_Normal;
+static size_t                               uploadBatchSize_;  // 0 iff. the uploads are not batched
+static size_t                               uploadBatchMaximumFileSize_;
+static unsigned int                         hugeDirectoryThreads_;
+static bool                                 persistentInodeCache_;
+static bool                                 overwriteInstances_;  // Value of the "OverwriteInstances" option of Orthanc
+static boost::filesystem::path              realStoragePath;
+
+static const float   INTERVAL_JITTER = 0.2f;  // Revisits are spread over +/- 20% of their interval
+static const size_t  INODE_CACHE_SIZE = 100000;  // Maximum number of inodes remembered during one scan
+static const size_t  DIRECTORY_BATCH_SIZE = 64 * 1024;  // Buffer of "getdents64()", about 1,500 entries
+static const size_t  VANISHED_BATCH_SIZE = 1000;  // Files checked for deletion per lock of the database
+static const size_t  BACKFILL_BATCH_SIZE = 100;  // Instances whose series is recorded per lock of the database
+static const unsigned int  READ_CACHE_SHARDS = 16;
+static const unsigned int  HUNG_CRAWLERS_GRACE = 5;  // Seconds granted at shutdown to the crawlers to stop
+static const float   MEMORY_PRESSURE_THRESHOLD = 0.9f;  // Fraction of the cgroup memory limit
+static const unsigned int  READ_CACHE_MEMORY_WEIGHT = 4;
+static const unsigned int  PREFETCH_MEMORY_WEIGHT = 1;
+static const unsigned int  SNAPSHOTS_MEMORY_WEIGHT = 1;
+static const unsigned int  TRANSCODING_MEMORY_FACTOR = 4;  // Memory used by a transcoding, relative to the size of the file
+static const char* const   CACHE_ATTACHMENT_NAME = "dicom-until-pixel-data";  // Name of "OrthancPluginContentType_DicomUntilPixelData" in the REST API
+
+// "OrthancPluginContentType_DicomUntilPixelData" is only defined by
+// the SDK of Orthanc >= 1.9.2, whereas the bundled SDK is 1.9.0
+static const OrthancPluginContentType  CONTENT_TYPE_DICOM_UNTIL_PIXEL_DATA = static_cast<OrthancPluginContentType>(3);
 
 
 static bool ComputeInstanceId(std::string& instanceId,
+                              std::string& seriesInstanceUid,
+                              std::string& sopInstanceUid,
                               const void* dicom,
                               size_t size)
 {
   if (size > 0 &&
       Orthanc::DicomMap::IsDicomFile(dicom, size))
   {
+    SlowLog::Stage stage("parse");
+
     try
     {
       OrthancPlugins::OrthancString s;
@@ -64,11 +132,13 @@ static bool ComputeInstanceId(std::string& instanceId,
       static const char* const SERIES_INSTANCE_UID = "0020,000e";
       static const char* const SOP_INSTANCE_UID = "0008,0018";
     
+      seriesInstanceUid = Orthanc::SerializationToolbox::ReadString(json, SERIES_INSTANCE_UID);
+      sopInstanceUid = Orthanc::SerializationToolbox::ReadString(json, SOP_INSTANCE_UID);
+
       Orthanc::DicomInstanceHasher hasher(
         json.isMember(PATIENT_ID) ? Orthanc::SerializationToolbox::ReadString(json, PATIENT_ID) : "",
         Orthanc::SerializationToolbox::ReadString(json, STUDY_INSTANCE_UID),
-        Orthanc::SerializationToolbox::ReadString(json, SERIES_INSTANCE_UID),
-        Orthanc::SerializationToolbox::ReadString(json, SOP_INSTANCE_UID));
+        seriesInstanceUid, sopInstanceUid);
 
       instanceId = hasher.HashInstance();
       return true;
@@ -78,206 +148,1754 @@ static bool ComputeInstanceId(std::string& instanceId,
       return false;
     }
   }
-  else
+  else
+  {
+    return false;
+  }
+}
+
+
+
+static bool UploadInstance(const void* dicom,
+                           size_t size)
+{
+  SlowLog::Stage stage("rest");
+
+  try
+  {
+    Json::Value upload;
+    return OrthancPlugins::RestApiPost(upload, "/instances", dicom, size, false);
+  }
+  catch (Orthanc::OrthancException&)
+  {
+    return false;
+  }
+}
+
+
+// Tells whether Orthanc already stores exactly this content for the
+// instance, according to the MD5 of its DICOM attachment. Returns
+// "false" if the MD5 is unknown (e.g. "StoreMD5ForAttachments" is false).
+static bool IsStoredContent(const std::string& instanceId,
+                            const void* dicom,
+                            size_t size)
+{
+  std::string stored;
+
+  {
+    SlowLog::Stage stage("rest");
+    if (!OrthancPlugins::RestApiGetString(stored, "/instances/" + instanceId + "/attachments/dicom/md5", false))
+    {
+      return false;
+    }
+  }
+
+  SlowLog::Stage stage("md5");
+
+  boost::uuids::detail::md5 hasher;
+  hasher.process_bytes(dicom, size);
+
+  boost::uuids::detail::md5::digest_type digest;
+  hasher.get_digest(digest);
+
+  static const char HEX[] = "0123456789abcdef";
+  const unsigned char* bytes = reinterpret_cast<const unsigned char*>(digest);
+
+  std::string md5;
+  md5.reserve(32);
+  for (size_t i = 0; i < 16; i++)
+  {
+    md5.push_back(HEX[bytes[i] >> 4]);
+    md5.push_back(HEX[bytes[i] & 15]);
+  }
+
+  return (md5 == stored);
+}
+
+
+static void FlushUploadBatch(UploadBatch& batch)
+{
+  if (batch.IsEmpty())
+  {
+    return;
+  }
+
+  SlowLog::Stage stage("rest");
+
+  bool success;
+  std::set<std::string> stored;
+
+  try
+  {
+    std::string archive;
+    batch.FormatArchive(archive);
+
+    Json::Value answer;
+    success = OrthancPlugins::RestApiPost(answer, "/instances", archive.c_str(), archive.size(), false);
+
+    if (success)
+    {
+      // Orthanc answers with one object for each stored instance of the archive
+      if (answer.type() == Json::objectValue)
+      {
+        Json::Value item = answer;
+        answer = Json::arrayValue;
+        answer.append(item);
+      }
+
+      for (Json::Value::ArrayIndex i = 0; answer.type() == Json::arrayValue && i < answer.size(); i++)
+      {
+        if (answer[i].type() == Json::objectValue &&
+            answer[i].isMember("ID") &&
+            answer[i]["ID"].type() == Json::stringValue)
+        {
+          stored.insert(answer[i]["ID"].asString());
+        }
+      }
+    }
+  }
+  catch (Orthanc::OrthancException&)
+  {
+    success = false;
+  }
+
+  if (!success)
+  {
+    LOG(WARNING) << "Indexer plugin cannot upload a batch of " << batch.GetCount()
+                 << " instances, uploading them one by one";
+  }
+
+  for (size_t i = 0; i < batch.GetCount(); i++)
+  {
+    const UploadBatch::Entry& entry = batch.GetEntry(i);
+
+    if (success ?
+        stored.find(entry.instanceId_) == stored.end() :
+        !UploadInstance(batch.GetContent(i), entry.size_))
+    {
+      // Forget about the file, so that it is uploaded again by the
+      // next visit of its directory. If the directory is not visited
+      // yet, it will be recorded as changed, hence soon visited again.
+      LOG(WARNING) << "Indexer plugin could not upload, will retry later: " << entry.path_;
+
+      try
+      {
+        database_->RemoveFile(entry.path_);
+        database_->ScheduleDirectoryVisit(boost::filesystem::path(entry.path_).parent_path().string());
+      }
+      catch (Orthanc::OrthancException&)
+      {
+        // The file was removed from the index in the meantime
+      }
+    }
+  }
+
+  batch.Clear();
+}
+
+
+// Returns "true" iff. the file is new or was modified since its last
+// visit. The small DICOM files are added to "uploadBatch" if not NULL,
+// which must have been flushed by the caller if it has no room left.
+// "known" is the entry of the file in the snapshot of its directory,
+// or NULL if the file was not indexed when the snapshot was taken.
+static bool ProcessFile(InodeCache& inodeCache,
+                        UploadBatch* uploadBatch,
+                        const std::string& path,
+                        const std::time_t time,
+                        const uintmax_t size,
+                        const IndexerDatabase::KnownFile* known)
+{
+  if (known != NULL &&
+      known->time_ == time &&
+      known->size_ == size)
+  {
+    return false;  // Unchanged since the last visit, no need for a transaction
+  }
+
+  SlowLog::Operation operation(slowLog_.get(), "ProcessFile", path.c_str());
+
+  // The index is looked up again, as the file might have been indexed
+  // since the snapshot was taken (e.g. if it was received by Orthanc)
+  std::string oldInstanceId;
+  IndexerDatabase::FileStatus status = database_->LookupFile(oldInstanceId, path, time, size);
+
+  if (status != IndexerDatabase::FileStatus_New &&
+      status != IndexerDatabase::FileStatus_Modified)
+  {
+    return false;
+  }
+  else
+  {
+    if (status == IndexerDatabase::FileStatus_Modified)
+    {
+      database_->RemoveFile(path);
+    }
+
+    bool isDicom;
+    std::string instanceId, seriesInstanceUid, sopInstanceUid;
+    std::unique_ptr<FileMemoryMap> reader;
+
+    uint64_t device, inode;
+    const bool hasIdentity = InodeCache::GetIdentity(device, inode, path);
+
+    if (hasIdentity &&
+        inodeCache.Lookup(isDicom, instanceId, device, inode, time, size))
+    {
+      // Another link to the same inode was already identified, and
+      // uploaded to Orthanc if it is a DICOM file
+      LOG(INFO) << "Reusing the identification of another link to the same file: " << path;
+    }
+    else
+    {
+      {
+        // The mapped file is faulted in by the parsing, without any
+        // lock on the index
+        ThreadPriority::FilesystemSection section(backgroundPriority_);
+
+        {
+          SlowLog::Stage stage("mmap");
+          reader.reset(new FileMemoryMap(path));
+        }
+
+        isDicom = ((reader->length() != 0) &&
+                   ComputeInstanceId(instanceId, seriesInstanceUid, sopInstanceUid,
+                                     reader->data(), reader->length()));
+      }
+
+      if (hasIdentity)
+      {
+        inodeCache.Store(device, inode, time, size, isDicom, isDicom ? instanceId : "");
+      }
+    }
+
+    if (isDicom)
+    {
+      LOG(INFO) << "New DICOM file detected by the indexer plugin: " << path;
+
+      const bool sameInstance = (status == IndexerDatabase::FileStatus_Modified &&
+                                 instanceId == oldInstanceId);
+
+      bool removeOld = (status == IndexerDatabase::FileStatus_Modified);
+      bool upload = (reader.get() != NULL);
+
+      if (sameInstance)
+      {
+        // The modification keeps the DICOM identifiers (e.g. a tag
+        // corrected in place): Avoid deleting the instance from Orthanc
+        if (reader.get() == NULL)
+        {
+          removeOld = false;  // Another link to the same content was uploaded
+        }
+        else if (IsStoredContent(instanceId, reader->data(), reader->length()))
+        {
+          LOG(INFO) << "The content of a modified DICOM file is unchanged: " << path;
+          removeOld = false;
+          upload = false;
+        }
+        else if (overwriteInstances_)
+        {
+          removeOld = false;  // The upload replaces the instance
+        }
+        else
+        {
+          // Orthanc would ignore the upload of an instance it already stores
+        }
+      }
+
+      if (removeOld &&
+          sameInstance)
+      {
+        // The instance must be deleted *before* the file is indexed
+        // again: As "RemoveFile()" has dropped its row, the attachment
+        // doesn't resolve to this path, and "StorageRemove()" leaves
+        // the modified file on the disk
+        SlowLog::Stage stage("rest");
+        OrthancPlugins::RestApiDelete("/instances/" + oldInstanceId, false);
+      }
+
+      // The following line must be *before* the "RestApiDelete()" of
+      // another instance to deal with the case of having two copies of
+      // the same DICOM file in the indexed folders, but with different
+      // timestamps
+      database_->AddDicomInstance(path, time, size, instanceId);
+
+      if (reader.get() != NULL)
+      {
+        database_->StoreInstance(instanceId, seriesInstanceUid, sopInstanceUid);
+      }
+
+      if (removeOld &&
+          !sameInstance)
+      {
+        SlowLog::Stage stage("rest");
+        OrthancPlugins::RestApiDelete("/instances/" + oldInstanceId, false);
+      }
+
+      if (!upload)
+      {
+        // Nothing to upload
+      }
+      else if (uploadBatch != NULL &&
+               uploadBatch->IsBatchable(reader->length()))
+      {
+        if (!uploadBatch->Add(path, instanceId, reader->data(), reader->length()))
+        {
+          // The file has grown since it was checked by the caller
+          UploadInstance(reader->data(), reader->length());
+        }
+      }
+      else
+      {
+        UploadInstance(reader->data(), reader->length());
+      }
+    }
+    else
+    {
+      LOG(INFO) << "Skipping indexing of non-DICOM file: " << path;
+      database_->AddNonDicomFile(path, time, size);
+
+      if (status == IndexerDatabase::FileStatus_Modified)
+      {
+        SlowLog::Stage stage("rest");
+        OrthancPlugins::RestApiDelete("/instances/" + oldInstanceId, false);
+      }
+    }
+
+    return true;
+  }
+}
+
+
+static bool IsDirectoryDue(unsigned int& previousInterval,
+                           size_t root,
+                           const boost::filesystem::path& directory,
+                           const std::time_t now)
+{
+  std::time_t lastVisit, nextVisit;
+  if (!database_->LookupDirectory(lastVisit, previousInterval, nextVisit, directory.string()))
+  {
+    previousInterval = 0;
+    return true;  // Never visited
+  }
+  else if (now >= nextVisit)
+  {
+    return true;
+  }
+  else
+  {
+    // Adding, removing or renaming an entry updates the modification
+    // time of the parent directory, which is much cheaper to check
+    // than the content of the directory. This is not the case of a
+    // file that is modified in place: Such a modification is only
+    // noticed at the next scheduled visit of its directory, which can
+    // be delayed by up to "MaximumInterval".
+    try
+    {
+      DeviceQueues::Slot slot(*deviceQueues_, rootDevices_[root], DeviceQueues::Operation_Stat);
+      CrawlerWatchdog::Operation operation(*watchdog_, root, "stat", directory.string());
+      ThreadPriority::FilesystemSection section(backgroundPriority_);
+      return boost::filesystem::last_write_time(directory) >= lastVisit;
+    }
+    catch (boost::filesystem::filesystem_error&)
+    {
+      return true;
+    }
+  }
+}
+
+
+static void StoreDirectoryVisit(const boost::filesystem::path& directory,
+                                unsigned int previousInterval,
+                                const std::time_t now,
+                                bool changed)
+{
+  const unsigned int interval = scheduler_->ComputeInterval(previousInterval, changed);
+  database_->StoreDirectoryVisit(directory.string(), directory.parent_path().string(), now, changed,
+                                 interval, scheduler_->ComputeNextVisit(now, interval));
+}
+
+
+// Returns "true" iff. the set of subdirectories has changed since the last visit
+static bool UpdateChildDirectories(const boost::filesystem::path& directory,
+                                   const std::set<std::string>& subdirectories)
+{
+  std::list<std::string> known;
+  database_->ListChildDirectories(known, directory.string());
+
+  bool changed = (known.size() != subdirectories.size());
+
+  for (std::list<std::string>::const_iterator it = known.begin(); it != known.end(); ++it)
+  {
+    if (subdirectories.find(*it) == subdirectories.end())
+    {
+      database_->ForgetDirectory(*it);
+      changed = true;
+    }
+  }
+
+  return changed;
+}
+
+
+// "match" is the index of the entry in the snapshot of its
+// directory, or "snapshot.GetFilesCount()" if the entry is unknown
+static void ProcessEntry(bool& changed,
+                         std::set<std::string>& subdirectories,
+                         size_t root,
+                         InodeCache& inodeCache,
+                         UploadBatch* uploadBatch,
+                         DirectorySnapshot& snapshot,
+                         size_t match,
+                         const boost::filesystem::path& path)
+{
+  try
+  {
+    boost::filesystem::file_status status;
+    std::time_t time = 0;
+    uintmax_t size = 0;
+
+    {
+      // The slot is acquired outside of the operation, as waiting
+      // for another crawler of the same device is not a stall
+      DeviceQueues::Slot slot(*deviceQueues_, rootDevices_[root], DeviceQueues::Operation_Stat);
+      CrawlerWatchdog::Operation operation(*watchdog_, root, "stat", path.string());
+      ThreadPriority::FilesystemSection section(backgroundPriority_);
+      status = boost::filesystem::status(path);
+
+      if (status.type() == boost::filesystem::regular_file ||
+          status.type() == boost::filesystem::reparse_file)
+      {
+        time = boost::filesystem::last_write_time(path);
+        size = boost::filesystem::file_size(path);
+      }
+    }
+
+    switch (status.type())
+    {
+      case boost::filesystem::regular_file:
+      case boost::filesystem::reparse_file:
+        try
+        {
+          const IndexerDatabase::KnownFile* known = NULL;
+          if (match < snapshot.GetFilesCount())
+          {
+            snapshot.MarkSeen(match);
+            known = &snapshot.GetFile(match);
+          }
+
+          if (uploadBatch != NULL &&
+              uploadBatch->IsBatchable(size) &&
+              !uploadBatch->HasRoom(size) &&
+              (known == NULL || known->time_ != time || known->size_ != size))
+          {
+            // The upload of the batch is not an operation on the
+            // folder, and must not be reported as a stall of this file
+            FlushUploadBatch(*uploadBatch);
+          }
+
+          DeviceQueues::Slot slot(*deviceQueues_, rootDevices_[root], DeviceQueues::Operation_Read);
+          CrawlerWatchdog::Operation operation(*watchdog_, root, "identify", path.string());
+
+          if (ProcessFile(inodeCache, uploadBatch, path.string(), time, size, known))
+          {
+            changed = true;
+          }
+        }
+        catch (Orthanc::OrthancException& e)
+        {
+          LOG(ERROR) << e.What();
+        }
+        break;
+
+      case boost::filesystem::directory_file:
+        subdirectories.insert(path.string());
+        break;
+
+      default:
+        break;
+    }
+  }
+  catch (boost::filesystem::filesystem_error&)
+  {
+  }
+}
+
+
+// Returns "false" iff. the scan was interrupted. The chunk must be sorted.
+static bool ProcessChunk(bool& changed,
+                         std::set<std::string>& subdirectories,
+                         bool* stop,
+                         size_t root,
+                         unsigned int failures,
+                         InodeCache& inodeCache,
+                         UploadBatch* uploadBatch,
+                         DirectorySnapshot& snapshot,
+                         const boost::filesystem::path& directory,
+                         const ChunkWorkers::Chunk& chunk)
+{
+  std::vector<size_t> matches;
+  snapshot.Merge(matches, chunk);
+
+  // The headers of the entries that are unknown to the index are
+  // prefetched, as they are about to be identified
+  std::vector<std::string> unknown;
+  if (!headerPrefetchers_.empty())
+  {
+    for (size_t i = 0; i < chunk.size(); i++)
+    {
+      if (matches[i] == snapshot.GetFilesCount())
+      {
+        unknown.push_back((directory / chunk[i]).string());
+      }
+    }
+  }
+
+  std::unique_ptr<HeaderPrefetcher::Window> window;
+  if (unknown.size() > 1)
+  {
+    window.reset(new HeaderPrefetcher::Window(*headerPrefetchers_[root], unknown));
+  }
+
+  size_t countUnknown = 0;
+
+  for (size_t i = 0; i < chunk.size(); i++)
+  {
+    if (*stop ||
+        watchdog_->GetFailuresCount(root) != failures)
+    {
+      return false;
+    }
+
+    if (window.get() != NULL &&
+        matches[i] == snapshot.GetFilesCount())
+    {
+      // The prefetching opens files, hence takes a slot of the device
+      DeviceQueues::Slot slot(*deviceQueues_, rootDevices_[root], DeviceQueues::Operation_Read);
+      CrawlerWatchdog::Operation operation(*watchdog_, root, "prefetch", unknown[countUnknown]);
+      ThreadPriority::FilesystemSection section(backgroundPriority_);
+      window->Enter(countUnknown);
+      countUnknown++;
+    }
+
+    ProcessEntry(changed, subdirectories, root, inodeCache, uploadBatch, snapshot, matches[i], directory / chunk[i]);
+  }
+
+  return true;
+}
+
+
+// Only removes the entries that are confirmed to be gone by a "stat()",
+// which protects against races with the creation of new files
+static bool IsVanished(size_t root,
+                       const boost::filesystem::path& path,
+                       bool isDirectory)
+{
+  boost::filesystem::file_status status;
+
+  {
+    DeviceQueues::Slot slot(*deviceQueues_, rootDevices_[root], DeviceQueues::Operation_Stat);
+    CrawlerWatchdog::Operation operation(*watchdog_, root, "stat", path.string());
+    ThreadPriority::FilesystemSection section(backgroundPriority_);
+
+    boost::system::error_code error;
+    status = boost::filesystem::status(path, error);
+  }
+
+  switch (status.type())
+  {
+    case boost::filesystem::status_error:
+      return false;  // E.g. permission denied, the entry might still exist
+
+    case boost::filesystem::directory_file:
+      return !isDirectory;
+
+    case boost::filesystem::regular_file:
+    case boost::filesystem::reparse_file:
+      return isDirectory;
+
+    default:
+      return true;
+  }
+}
+
+
+static void RemoveVanishedFile(const std::string& path,
+                               bool isDicom,
+                               const std::string& instanceId)
+{
+  if (database_->RemoveFile(path) &&
+      isDicom)
+  {
+    OrthancPlugins::RestApiDelete("/instances/" + instanceId, false);
+  }
+}
+
+
+// Collects the visited files, which are only removed once the
+// database is unlocked
+class KnownFilesVisitor : public IndexerDatabase::IFileVisitor
+{
+private:
+  std::list<IndexerDatabase::KnownFile>  files_;
+
+public:
+  virtual void VisitInstance(const std::string& path,
+                             bool isDicom,
+                             const std::string& instanceId) ORTHANC_OVERRIDE
+  {
+    IndexerDatabase::KnownFile file;
+    file.name_ = path;
+    file.isDicom_ = isDicom;
+    file.instanceId_ = instanceId;
+    files_.push_back(file);
+  }
+
+  const std::list<IndexerDatabase::KnownFile>& GetFiles() const
+  {
+    return files_;
+  }
+};
+
+
+// Returns "false" iff. the scan was interrupted
+static bool RemoveVanishedDirectory(bool* stop,
+                                    size_t root,
+                                    unsigned int failures,
+                                    const std::string& directory)
+{
+  LOG(INFO) << "Indexer plugin is forgetting the files of a vanished directory: " << directory;
+
+  std::string after;
+
+  for (;;)
+  {
+    if (*stop ||
+        watchdog_->GetFailuresCount(root) != failures)
+    {
+      return false;
+    }
+
+    KnownFilesVisitor visitor;
+    if (database_->Apply(visitor, directory, after, VANISHED_BATCH_SIZE) == 0)
+    {
+      return true;
+    }
+
+    for (std::list<IndexerDatabase::KnownFile>::const_iterator
+           it = visitor.GetFiles().begin(); it != visitor.GetFiles().end(); ++it)
+    {
+      try
+      {
+        RemoveVanishedFile(it->name_, it->isDicom_, it->instanceId_);
+      }
+      catch (Orthanc::OrthancException&)
+      {
+        // The file was removed from the index in the meantime
+      }
+    }
+
+    after = visitor.GetFiles().back().name_;
+  }
+}
+
+
+// Returns "false" iff. the scan was interrupted. Must only be called
+// once the directory has been fully enumerated.
+static bool RemoveVanishedEntries(bool* stop,
+                                  size_t root,
+                                  unsigned int failures,
+                                  const DirectorySnapshot& snapshot,
+                                  const boost::filesystem::path& directory,
+                                  const std::set<std::string>& subdirectories)
+{
+  std::vector<size_t> files;
+  snapshot.ListVanishedFiles(files);
+
+  for (size_t i = 0; i < files.size(); i++)
+  {
+    const IndexerDatabase::KnownFile& file = snapshot.GetFile(files[i]);
+    const boost::filesystem::path path = directory / file.name_;
+
+    if (IsVanished(root, path, false))
+    {
+      try
+      {
+        RemoveVanishedFile(path.string(), file.isDicom_, file.instanceId_);
+      }
+      catch (Orthanc::OrthancException&)
+      {
+        // The file was removed from the index in the meantime
+      }
+    }
+  }
+
+  std::set<std::string> names;
+  for (std::set<std::string>::const_iterator it = subdirectories.begin(); it != subdirectories.end(); ++it)
+  {
+    names.insert(boost::filesystem::path(*it).filename().string());
+  }
+
+  std::vector<std::string> vanished;
+  snapshot.ListVanishedSubdirectories(vanished, names);
+
+  for (size_t i = 0; i < vanished.size(); i++)
+  {
+    const boost::filesystem::path path = directory / vanished[i];
+
+    if (IsVanished(root, path, true) &&
+        !RemoveVanishedDirectory(stop, root, failures, path.string()))
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+
+// Processes the chunks of one huge directory. Each worker has its
+// own upload batch, which is flushed once the workers have stopped.
+class DirectoryChunkHandler : public ChunkWorkers::IHandler
+{
+private:
+  bool*                        stop_;
+  size_t                       root_;
+  unsigned int                 failures_;
+  InodeCache&                  inodeCache_;
+  DirectorySnapshot&           snapshot_;
+  boost::filesystem::path      directory_;
+  std::vector<UploadBatch*>    uploadBatches_;  // Empty iff. the uploads are not batched
+  boost::mutex                 mutex_;
+  bool                         changed_;
+  std::set<std::string>        subdirectories_;
+
+public:
+  DirectoryChunkHandler(bool* stop,
+                        size_t root,
+                        unsigned int failures,
+                        InodeCache& inodeCache,
+                        DirectorySnapshot& snapshot,
+                        const boost::filesystem::path& directory,
+                        size_t threadsCount) :
+    stop_(stop),
+    root_(root),
+    failures_(failures),
+    inodeCache_(inodeCache),
+    snapshot_(snapshot),
+    directory_(directory),
+    changed_(false)
+  {
+    if (uploadBatchSize_ != 0)
+    {
+      for (size_t i = 0; i < threadsCount; i++)
+      {
+        uploadBatches_.push_back(new UploadBatch(uploadBatchSize_, uploadBatchMaximumFileSize_));
+      }
+    }
+  }
+
+  virtual ~DirectoryChunkHandler()
+  {
+    // The files of the batches are already in the index, and must
+    // reach Orthanc even if the directory was abandoned
+    for (size_t i = 0; i < uploadBatches_.size(); i++)
+    {
+      FlushUploadBatch(*uploadBatches_[i]);
+      delete uploadBatches_[i];
+    }
+  }
+
+  virtual bool Process(size_t worker,
+                       const ChunkWorkers::Chunk& chunk) ORTHANC_OVERRIDE
+  {
+    bool changed = false;
+    std::set<std::string> subdirectories;
+
+    const bool success = ProcessChunk(changed, subdirectories, stop_, root_, failures_, inodeCache_,
+                                      uploadBatches_.empty() ? NULL : uploadBatches_[worker],
+                                      snapshot_, directory_, chunk);
+
+    boost::mutex::scoped_lock lock(mutex_);
+    changed_ = changed_ || changed;
+    subdirectories_.insert(subdirectories.begin(), subdirectories.end());
+
+    return success;
+  }
+
+  // To be called once the workers have stopped
+  void GetResults(bool& changed,
+                  std::set<std::string>& subdirectories)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    changed = changed || changed_;
+    subdirectories.insert(subdirectories_.begin(), subdirectories_.end());
+  }
+};
+
+
+// Returns "false" iff. the scan was interrupted. The entries are
+// enumerated by batches of "getdents64()". A directory spanning
+// several batches is processed by several workers, while the crawler
+// goes on enumerating it. Each batch is sorted, then merged against
+// the snapshot of the indexed content of the directory.
+static bool ProcessDirectory(bool& changed,
+                             std::set<std::string>& subdirectories,
+                             bool* stop,
+                             size_t root,
+                             unsigned int failures,
+                             InodeCache& inodeCache,
+                             UploadBatch* uploadBatch,
+                             const boost::filesystem::path& directory,
+                             DirectoryReader& reader)
+{
+  DirectorySnapshot snapshot(*database_, directory.string(), &snapshotsMemory_);
+
+  ChunkWorkers::Chunk first, next;
+  bool hasNext;
+
+  {
+    CrawlerWatchdog::Operation operation(*watchdog_, root, "readdir", directory.string());
+    ThreadPriority::FilesystemSection section(backgroundPriority_);
+    hasNext = (reader.ReadBatch(first) &&
+               reader.ReadBatch(next));
+  }
+
+  std::sort(first.begin(), first.end());
+  std::sort(next.begin(), next.end());
+
+  // The workers are bounded by the concurrent reads allowed on the device
+  const unsigned int threadsCount = std::min(hugeDirectoryThreads_,
+                                             deviceQueues_->GetLimit(rootDevices_[root], DeviceQueues::Operation_Read));
+
+  if (!hasNext ||
+      threadsCount <= 1)
+  {
+    if (!ProcessChunk(changed, subdirectories, stop, root, failures, inodeCache, uploadBatch, snapshot, directory, first))
+    {
+      return false;
+    }
+
+    while (hasNext)
+    {
+      if (!ProcessChunk(changed, subdirectories, stop, root, failures, inodeCache, uploadBatch, snapshot, directory, next))
+      {
+        return false;
+      }
+
+      {
+        CrawlerWatchdog::Operation operation(*watchdog_, root, "readdir", directory.string());
+        ThreadPriority::FilesystemSection section(backgroundPriority_);
+        hasNext = reader.ReadBatch(next);
+      }
+
+      std::sort(next.begin(), next.end());
+    }
+
+    return RemoveVanishedEntries(stop, root, failures, snapshot, directory, subdirectories);
+  }
+
+  LOG(INFO) << "Indexer plugin is processing a huge directory with " << threadsCount
+            << " workers: " << directory.string();
+
+  DirectoryChunkHandler handler(stop, root, failures, inodeCache, snapshot, directory, threadsCount);
+  bool success;
+
+  try
+  {
+    // At most two pending chunks per worker, to bound the memory
+    ChunkWorkers workers(handler, threadsCount, 2 * threadsCount, backgroundPriority_);
+
+    success = (workers.Push(first) &&
+               workers.Push(next));
+
+    while (success)
+    {
+      if (*stop ||
+          watchdog_->GetFailuresCount(root) != failures)
+      {
+        success = false;
+        break;
+      }
+
+      {
+        CrawlerWatchdog::Operation operation(*watchdog_, root, "readdir", directory.string());
+        ThreadPriority::FilesystemSection section(backgroundPriority_);
+        hasNext = reader.ReadBatch(next);
+      }
+
+      if (hasNext)
+      {
+        std::sort(next.begin(), next.end());
+        success = workers.Push(next);
+      }
+      else
+      {
+        success = workers.Join();
+        break;
+      }
+    }
+  }
+  catch (Orthanc::OrthancException&)
+  {
+    // The workers are stopped at this point
+    handler.GetResults(changed, subdirectories);
+    throw;
+  }
+
+  handler.GetResults(changed, subdirectories);
+
+  return (success &&
+          RemoveVanishedEntries(stop, root, failures, snapshot, directory, subdirectories));
+}
+
+
+// Returns "false" iff. the scan was interrupted, either because the
+// plugin is stopping, or because the root was quarantined
+static bool ScanRoot(bool* stop,
+                     size_t root,
+                     InodeCache& inodeCache,
+                     UploadBatch* uploadBatch)
+{
+  const unsigned int failures = watchdog_->GetFailuresCount(root);
+
+  std::stack<boost::filesystem::path> s;
+  s.push(watchdog_->GetRootPath(root));
+
+  while (!s.empty())
+  {
+    if (*stop ||
+        watchdog_->GetFailuresCount(root) != failures)
+    {
+      return false;
+    }
+      
+    boost::filesystem::path d = s.top();
+    s.pop();
+
+    const std::time_t now = std::time(NULL);
+    unsigned int previousInterval = 0;
+
+    if (scheduler_.get() != NULL &&
+        !IsDirectoryDue(previousInterval, root, d, now))
+    {
+      // Not due yet: Only descend into the subdirectories that were
+      // known at the last visit, without reading this directory
+      std::list<std::string> children;
+      database_->ListChildDirectories(children, d.string());
+
+      for (std::list<std::string>::const_iterator it = children.begin(); it != children.end(); ++it)
+      {
+        s.push(*it);
+      }
+
+      continue;
+    }
+
+    std::unique_ptr<DirectoryReader> reader;
+
+    try
+    {
+      CrawlerWatchdog::Operation operation(*watchdog_, root, "readdir", d.string());
+      ThreadPriority::FilesystemSection section(backgroundPriority_);
+      reader.reset(new DirectoryReader(d.string(), DIRECTORY_BATCH_SIZE));
+    }
+    catch (Orthanc::OrthancException&)
+    {
+      if (d.string() == watchdog_->GetRootPath(root))
+      {
+        // Never look for deleted files if the root itself is unreadable
+        watchdog_->ReportFailure(root, "Cannot read the folder", boost::posix_time::microsec_clock::universal_time());
+        return false;
+      }
+      else
+      {
+        LOG(WARNING) << "Indexer plugin cannot read directory: " << d.string();
+
+        // The unreadable directory is recorded nevertheless, as an
+        // unchanged one: Otherwise, it would be missing from the
+        // children of its parent at each visit, which would prevent
+        // the parent from backing off
+        if (scheduler_.get() != NULL)
+        {
+          try
+          {
+            StoreDirectoryVisit(d, previousInterval, now, false);
+          }
+          catch (Orthanc::OrthancException& e)
+          {
+            LOG(ERROR) << e.What();
+          }
+        }
+
+        continue;
+      }
+    }
+
+    bool changed = false;
+    bool complete = true;
+    std::set<std::string> subdirectories;
+
+    try
+    {
+      if (!ProcessDirectory(changed, subdirectories, stop, root, failures, inodeCache, uploadBatch, d, *reader))
+      {
+        return false;
+      }
+    }
+    catch (Orthanc::OrthancException& e)
+    {
+      LOG(WARNING) << "Indexer plugin cannot read directory: " << d.string() << " (" << e.What() << ")";
+      complete = false;
+    }
+
+    for (std::set<std::string>::const_iterator it = subdirectories.begin(); it != subdirectories.end(); ++it)
+    {
+      s.push(*it);
+    }
+
+    // The children of a partially read directory are not updated, as
+    // its list of subdirectories is incomplete. The directory is
+    // considered as changed, so that it is soon visited again.
+    if (scheduler_.get() != NULL)
+    {
+      try
+      {
+        if (!complete ||
+            UpdateChildDirectories(d, subdirectories))
+        {
+          changed = true;
+        }
+
+        StoreDirectoryVisit(d, previousInterval, now, changed);
+      }
+      catch (Orthanc::OrthancException& e)
+      {
+        LOG(ERROR) << e.What();
+      }
+    }
+  }
+
+  return true;
+}
+
+
+// Each root is crawled by its own thread, so that a hung root
+// doesn't prevent the other roots from being indexed
+static void MonitorRoot(bool* stop,
+                        size_t root,
+                        unsigned int intervalSeconds)
+{
+  ThreadPriority::ApplyToCurrentThread(backgroundPriority_);
+
+  {
+    CrawlerWatchdog::Operation operation(*watchdog_, root, "stat", watchdog_->GetRootPath(root));
+    ThreadPriority::FilesystemSection section(backgroundPriority_);
+    rootDevices_[root] = deviceQueues_->Register(watchdog_->GetRootPath(root));
+  }
+
+  InodeCache inodeCache(*database_, persistentInodeCache_, INODE_CACHE_SIZE);
+
+  std::unique_ptr<UploadBatch> uploadBatch;
+  if (uploadBatchSize_ != 0)
+  {
+    uploadBatch.reset(new UploadBatch(uploadBatchSize_, uploadBatchMaximumFileSize_));
+  }
+
+  for (;;)
+  {
+    if (watchdog_->IsScanAllowed(root, boost::posix_time::microsec_clock::universal_time()))
+    {
+      inodeCache.Clear();
+
+      if (ScanRoot(stop, root, inodeCache, uploadBatch.get()))
+      {
+        watchdog_->ReportScanCompleted(root);
+      }
+
+      if (uploadBatch.get() != NULL)
+      {
+        FlushUploadBatch(*uploadBatch);
+      }
+    }
+    
+    for (unsigned int i = 0; i < intervalSeconds * 10; i++)
+    {
+      if (*stop)
+      {
+        return;
+      }
+      
+      boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+    }
+  }
+}
+
+
+// The DICOM files received by Orthanc are written to the storage
+// directories, which are not crawled (unless they are also listed
+// in "Folders"). As in the original plugin, the deletion of these
+// files is detected by checking each of them once per interval.
+static void LookupDeletedFiles(bool* stop)
+{
+  for (size_t i = 0; i < placement_->GetRootsCount(); i++)
+  {
+    std::string after;
+
+    for (;;)
+    {
+      if (*stop)
+      {
+        return;
+      }
+
+      KnownFilesVisitor visitor;
+      if (database_->Apply(visitor, placement_->GetRoot(i), after, VANISHED_BATCH_SIZE) == 0)
+      {
+        break;
+      }
+
+      for (std::list<IndexerDatabase::KnownFile>::const_iterator
+             it = visitor.GetFiles().begin(); it != visitor.GetFiles().end(); ++it)
+      {
+        if (it->isDicom_ &&
+            !Orthanc::SystemToolbox::IsRegularFile(it->name_))
+        {
+          try
+          {
+            RemoveVanishedFile(it->name_, it->isDicom_, it->instanceId_);
+          }
+          catch (Orthanc::OrthancException&)
+          {
+            // The file was removed from the index in the meantime
+          }
+        }
+      }
+
+      after = visitor.GetFiles().back().name_;
+    }
+  }
+}
+
+
+static void MonitorStorageDirectories(bool* stop,
+                                      unsigned int intervalSeconds)
+{
+  ThreadPriority::ApplyToCurrentThread(backgroundPriority_);
+
+  for (;;)
+  {
+    try
+    {
+      LookupDeletedFiles(stop);
+    }
+    catch (Orthanc::OrthancException& e)
+    {
+      LOG(ERROR) << e.What();
+    }
+
+    for (unsigned int i = 0; i < intervalSeconds * 10; i++)
+    {
+      if (*stop)
+      {
+        return;
+      }
+      
+      boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+    }
+  }
+}
+
+
+// Measuring the free space hangs on a dead network mount: This thread
+// owns the placement, so that it can be abandoned at shutdown
+static void MonitorFreeSpace(bool* stop,
+                             boost::shared_ptr<StoragePlacement> placement)
+{
+  while (!*stop)
+  {
+    placement->RefreshFreeSpace();
+    boost::this_thread::sleep(boost::posix_time::seconds(1));
+  }
+}
+
+
+// The series of the instances indexed by older versions of the plugin
+// are unknown, and their files are not identified again unless they
+// are modified: Read them once, so that they can be prefetched
+static void BackfillInstances(bool* stop,
+                              boost::shared_ptr<IndexerDatabase> database)
+{
+  ThreadPriority::ApplyToCurrentThread(backgroundPriority_);
+
+  std::string after;
+  unsigned int count = 0;
+
+  for (;;)
+  {
+    std::map<std::string, std::string> instances;
+    database->ListInstancesWithoutSeries(instances, after, BACKFILL_BATCH_SIZE);
+
+    if (instances.empty())
+    {
+      break;
+    }
+    else if (after.empty())
+    {
+      LOG(WARNING) << "Indexer plugin is recording the series of the DICOM files indexed by an older version";
+    }
+
+    for (std::map<std::string, std::string>::const_iterator it = instances.begin(); it != instances.end(); ++it)
+    {
+      if (*stop)
+      {
+        return;
+      }
+
+      try
+      {
+        std::string instanceId, seriesInstanceUid, sopInstanceUid;
+        bool isDicom;
+
+        {
+          ThreadPriority::FilesystemSection section(backgroundPriority_);
+          FileMemoryMap reader(it->second);
+          isDicom = ComputeInstanceId(instanceId, seriesInstanceUid, sopInstanceUid, reader.data(), reader.length());
+        }
+
+        if (isDicom &&
+            instanceId == it->first)
+        {
+          database->StoreInstance(instanceId, seriesInstanceUid, sopInstanceUid);
+          count++;
+        }
+        else
+        {
+          // Modified in the meantime, the crawler will identify it again
+          LOG(INFO) << "Cannot record the series of an indexed file: " << it->second;
+        }
+      }
+      catch (Orthanc::OrthancException& e)
+      {
+        LOG(INFO) << "Cannot read an indexed file: " << it->second << " (" << e.What() << ")";
+      }
+    }
+
+    after = instances.rbegin()->first;
+  }
+
+  if (!after.empty())
   {
-    return false;
+    LOG(WARNING) << "Indexer plugin has recorded the series of " << count << " DICOM instances";
   }
 }
 
 
+static void WatchCrawlers(bool* stop)
+{
+  while (!*stop)
+  {
+    watchdog_->CheckStalls(boost::posix_time::microsec_clock::universal_time());
+    boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+  }
+}
+
 
-static void ProcessFile(const std::string& path,
-                        const std::time_t time,
-                        const uintmax_t size)
+static void MonitorMemory(bool* stop)
 {
-  std::string oldInstanceId;
-  IndexerDatabase::FileStatus status = database_.LookupFile(oldInstanceId, path, time, size);
+  bool wasUnderPressure = false;
 
-  if (status == IndexerDatabase::FileStatus_New ||
-      status == IndexerDatabase::FileStatus_Modified)
+  while (!*stop)
   {
-    if (status == IndexerDatabase::FileStatus_Modified)
+    uint64_t usage, limit;
+    const bool underPressure = (MemoryBudget::ReadCgroupMemory(usage, limit) &&
+                                memoryBudget_->IsUnderPressure(usage, limit));
+
+    if (underPressure != wasUnderPressure)
     {
-      database_.RemoveFile(path);
+      LOG(WARNING) << "Indexer plugin is " << (underPressure ? "entering" : "leaving")
+                   << " the cgroup memory pressure mode";
+      wasUnderPressure = underPressure;
     }
 
-    FileMemoryMap reader = FileMemoryMap(path);
+    memoryBudget_->Enforce(underPressure);
 
-    std::string instanceId;
-    if ((reader.length() != 0) &&
-        ComputeInstanceId(instanceId, reader.data(), reader.length()))
+    for (unsigned int i = 0; i < 10 && !*stop; i++)
     {
-      LOG(INFO) << "New DICOM file detected by the indexer plugin: " << path;
+      boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+    }
+  }
+}
 
-      // The following line must be *before* the "RestApiDelete()" to
-      // deal with the case of having two copies of the same DICOM
-      // file in the indexed folders, but with different timestamps
-      database_.AddDicomInstance(path, time, size, instanceId);
-        
-      if (status == IndexerDatabase::FileStatus_Modified)
-      {
-        OrthancPlugins::RestApiDelete("/instances/" + oldInstanceId, false);
-      }
-    
-      try
-      {
-        Json::Value upload;
-        OrthancPlugins::RestApiPost(upload, "/instances", reader.data(), reader.length(), false);
-      }
-      catch (Orthanc::OrthancException&)
+
+static void EvictCacheAttachments(bool* stop)
+{
+  while (!*stop)
+  {
+    IndexerDatabase::CacheAttachment victim;
+    while (!*stop &&
+           cacheArea_->SelectVictim(victim))
+    {
+      // Going through the REST API removes the attachment from the
+      // database of Orthanc, which will recompute it if needed, then
+      // Orthanc calls "StorageRemove()" that deletes the file
+      if (!OrthancPlugins::RestApiDelete("/instances/" + victim.instanceId_ + "/attachments/" +
+                                         CACHE_ATTACHMENT_NAME, false))
       {
+        LOG(WARNING) << "Indexer plugin cannot evict cache attachment " << victim.uuid_
+                     << ", which is kept but not tracked anymore";
       }
+
+      cacheArea_->Remove(victim.uuid_);
     }
-    else
-    {
-      LOG(INFO) << "Skipping indexing of non-DICOM file: " << path;
-      database_.AddNonDicomFile(path, time, size);
 
-      if (status == IndexerDatabase::FileStatus_Modified)
-      {
-        OrthancPlugins::RestApiDelete("/instances/" + oldInstanceId, false);
-      }
+    for (unsigned int i = 0; i < 10 && !*stop; i++)
+    {
+      boost::this_thread::sleep(boost::posix_time::milliseconds(100));
     }
   }
 }
 
 
-static void LookupDeletedFiles()
+static void RefreshMetrics()
 {
-  class Visitor : public IndexerDatabase::IFileVisitor
+  OrthancPluginContext* context = OrthancPlugins::GetGlobalContext();
+
+  OrthancPluginSetMetricsValue(context, "indexer_unhealthy_folders_count",
+                               static_cast<float>(watchdog_->GetUnhealthyCount()),
+                               OrthancPluginMetricsType_Default);
+
+  OrthancPluginSetMetricsValue(context, "indexer_device_overcommits",
+                               static_cast<float>(deviceQueues_->GetOvercommitsCount()),
+                               OrthancPluginMetricsType_Default);
+
+  for (size_t i = 0; i < watchdog_->GetRootsCount(); i++)
   {
-  private:
-    typedef std::pair<std::string, std::string>  DeletedDicom;
-    
-    std::list<DeletedDicom>  deletedDicom_;
-    
-  public:
-    virtual void VisitInstance(const std::string& path,
-                               bool isDicom,
-                               const std::string& instanceId) ORTHANC_OVERRIDE
+    const std::string prefix = "indexer_folder_" + boost::lexical_cast<std::string>(i);
+    OrthancPluginSetMetricsValue(context, (prefix + "_healthy").c_str(), watchdog_->IsHealthy(i) ? 1.0f : 0.0f,
+                                 OrthancPluginMetricsType_Default);
+
+    IndexerDatabase::Statistics statistics;
+    database_->LookupStatistics(statistics, watchdog_->GetRootPath(i));
+    OrthancPluginSetMetricsValue(context, (prefix + "_files").c_str(), static_cast<float>(statistics.files_),
+                                 OrthancPluginMetricsType_Default);
+    OrthancPluginSetMetricsValue(context, (prefix + "_size_mb").c_str(),
+                                 static_cast<float>(statistics.size_) / (1024.0f * 1024.0f),
+                                 OrthancPluginMetricsType_Default);
+  }
+
+  if (readCache_.get() != NULL)
+  {
+    uint64_t size, hits, misses;
+    size_t count;
+    readCache_->GetStatistics(size, count, hits, misses);
+
+    OrthancPluginSetMetricsValue(context, "indexer_read_cache_size_mb",
+                                 static_cast<float>(size) / (1024.0f * 1024.0f), OrthancPluginMetricsType_Default);
+    OrthancPluginSetMetricsValue(context, "indexer_read_cache_count",
+                                 static_cast<float>(count), OrthancPluginMetricsType_Default);
+    OrthancPluginSetMetricsValue(context, "indexer_read_cache_hits",
+                                 static_cast<float>(hits), OrthancPluginMetricsType_Default);
+    OrthancPluginSetMetricsValue(context, "indexer_read_cache_misses",
+                                 static_cast<float>(misses), OrthancPluginMetricsType_Default);
+  }
+
+  for (size_t i = 0; i < placement_->GetRootsCount(); i++)
+  {
+    uintmax_t available;
+    if (placement_->LookupFreeSpace(available, i))
     {
-      if (!Orthanc::SystemToolbox::IsRegularFile(path) &&
-          isDicom)
-      {
-        deletedDicom_.push_back(std::make_pair(path, instanceId));
-      }
+      const std::string name = "indexer_storage_directory_" + boost::lexical_cast<std::string>(i) + "_available_mb";
+      OrthancPluginSetMetricsValue(context, name.c_str(), static_cast<float>(available) / (1024.0f * 1024.0f),
+                                   OrthancPluginMetricsType_Default);
     }
+  }
 
-    void ExecuteDelete()
-    {
-      for (std::list<DeletedDicom>::const_iterator
-             it = deletedDicom_.begin(); it != deletedDicom_.end(); ++it)
-      {
-        const std::string& path = it->first;
-        const std::string& instanceId = it->second;
-        if (database_.RemoveFile(path))
-        {
+  if (memoryBudget_.get() != NULL)
+  {
+    Json::Value budget;
+    memoryBudget_->Format(budget);
 
-          OrthancPlugins::RestApiDelete("/instances/" + instanceId, false);      
-        }
-      }
+    for (Json::Value::ArrayIndex i = 0; i < budget["Components"].size(); i++)
+    {
+      const std::string name = "indexer_memory_" + budget["Components"][i]["Name"].asString() + "_mb";
+      OrthancPluginSetMetricsValue(context, name.c_str(),
+                                   static_cast<float>(budget["Components"][i]["Usage"].asUInt64()) / (1024.0f * 1024.0f),
+                                   OrthancPluginMetricsType_Default);
     }
-  };  
+  }
+
+  if (cacheArea_.get() != NULL)
+  {
+    uint64_t size;
+    size_t count;
+    cacheArea_->GetStatistics(size, count);
+
+    OrthancPluginSetMetricsValue(context, "indexer_cache_attachments_size_mb",
+                                 static_cast<float>(size) / (1024.0f * 1024.0f), OrthancPluginMetricsType_Default);
+    OrthancPluginSetMetricsValue(context, "indexer_cache_attachments_count",
+                                 static_cast<float>(count), OrthancPluginMetricsType_Default);
+  }
+
+  if (derivedStorage_.get() != NULL)
+  {
+    uint64_t transcoded, failures, skipped;
+    derivedStorage_->GetStatistics(transcoded, failures, skipped);
+
+    OrthancPluginSetMetricsValue(context, "indexer_transcoded_count",
+                                 static_cast<float>(transcoded), OrthancPluginMetricsType_Default);
+    OrthancPluginSetMetricsValue(context, "indexer_transcoding_failures",
+                                 static_cast<float>(failures), OrthancPluginMetricsType_Default);
+    OrthancPluginSetMetricsValue(context, "indexer_transcoding_skipped",
+                                 static_cast<float>(skipped), OrthancPluginMetricsType_Default);
+  }
+
+  for (size_t i = 0; i < headerPrefetchers_.size(); i++)
+  {
+    unsigned int lookahead;
+    uint64_t prefetched, misses;
+    headerPrefetchers_[i]->GetStatistics(lookahead, prefetched, misses);
+
+    const std::string prefix = "indexer_folder_" + boost::lexical_cast<std::string>(i);
+    OrthancPluginSetMetricsValue(context, (prefix + "_header_lookahead").c_str(),
+                                 static_cast<float>(lookahead), OrthancPluginMetricsType_Default);
+    OrthancPluginSetMetricsValue(context, (prefix + "_header_prefetches").c_str(),
+                                 static_cast<float>(prefetched), OrthancPluginMetricsType_Default);
+    OrthancPluginSetMetricsValue(context, (prefix + "_header_misses").c_str(),
+                                 static_cast<float>(misses), OrthancPluginMetricsType_Default);
+  }
+
+  if (rangeCoalescer_.get() != NULL)
+  {
+    uint64_t requests, reads, merged;
+    rangeCoalescer_->GetStatistics(requests, reads, merged);
+
+    OrthancPluginSetMetricsValue(context, "indexer_range_requests",
+                                 static_cast<float>(requests), OrthancPluginMetricsType_Default);
+    OrthancPluginSetMetricsValue(context, "indexer_range_reads",
+                                 static_cast<float>(reads), OrthancPluginMetricsType_Default);
+    OrthancPluginSetMetricsValue(context, "indexer_range_merged",
+                                 static_cast<float>(merged), OrthancPluginMetricsType_Default);
+  }
+
+  if (slowLog_.get() != NULL)
+  {
+    OrthancPluginSetMetricsValue(context, "indexer_slow_operations",
+                                 static_cast<float>(slowLog_->GetSlowCount()), OrthancPluginMetricsType_Default);
+  }
+
+  if (duplicateFilter_.get() != NULL)
+  {
+    OrthancPluginSetMetricsValue(context, "indexer_duplicates_count",
+                                 static_cast<float>(duplicateFilter_->GetDuplicatesCount()),
+                                 OrthancPluginMetricsType_Default);
+  }
 
-  Visitor visitor;
-  database_.Apply(visitor);
-  visitor.ExecuteDelete();
+  if (prefetcher_.get() != NULL)
+  {
+    size_t queueSize;
+    uint64_t prefetched, cancelled;
+    prefetcher_->GetStatistics(queueSize, prefetched, cancelled);
+
+    OrthancPluginSetMetricsValue(context, "indexer_prefetch_queue_size",
+                                 static_cast<float>(queueSize), OrthancPluginMetricsType_Default);
+    OrthancPluginSetMetricsValue(context, "indexer_prefetch_files",
+                                 static_cast<float>(prefetched), OrthancPluginMetricsType_Default);
+    OrthancPluginSetMetricsValue(context, "indexer_prefetch_cancelled",
+                                 static_cast<float>(cancelled), OrthancPluginMetricsType_Default);
+  }
 }
 
 
-static void MonitorDirectories(bool* stop, unsigned int intervalSeconds)
+static void GetSlowOperations(OrthancPluginRestOutput* output,
+                              const char* url,
+                              const OrthancPluginHttpRequest* request)
 {
-  for (;;)
+  if (request->method != OrthancPluginHttpMethod_Get)
+  {
+    OrthancPlugins::AnswerMethodNotAllowed(output, "GET");
+  }
+  else
+  {
+    Json::Value answer;
+    slowLog_->Format(answer);
+    OrthancPlugins::AnswerJson(answer, output);
+  }
+}
+
+
+static void GetMemoryBudget(OrthancPluginRestOutput* output,
+                            const char* url,
+                            const OrthancPluginHttpRequest* request)
+{
+  if (request->method != OrthancPluginHttpMethod_Get)
+  {
+    OrthancPlugins::AnswerMethodNotAllowed(output, "GET");
+  }
+  else
+  {
+    Json::Value answer;
+    memoryBudget_->Format(answer);
+    OrthancPlugins::AnswerJson(answer, output);
+  }
+}
+
+
+static void GetDevices(OrthancPluginRestOutput* output,
+                       const char* url,
+                       const OrthancPluginHttpRequest* request)
+{
+  if (request->method != OrthancPluginHttpMethod_Get)
+  {
+    OrthancPlugins::AnswerMethodNotAllowed(output, "GET");
+  }
+  else
+  {
+    Json::Value answer;
+    deviceQueues_->Format(answer);
+    OrthancPlugins::AnswerJson(answer, output);
+  }
+}
+
+
+// Answers the faster-decoding copy of an instance, or 404 if there is
+// no up-to-date copy. Orthanc itself keeps reading the original file,
+// whose size and MD5 are recorded in its attachment: This URI is meant
+// for the viewers that are configured to download the instances from
+// it, falling back to "/instances/{id}/file" on 404.
+static void GetTranscodedInstance(OrthancPluginRestOutput* output,
+                                  const char* url,
+                                  const OrthancPluginHttpRequest* request)
+{
+  if (request->method != OrthancPluginHttpMethod_Get)
+  {
+    OrthancPlugins::AnswerMethodNotAllowed(output, "GET");
+    return;
+  }
+
+  const std::string instanceId(request->groups[0]);
+
+  Json::Value info;
+  std::string path;
+  if (!OrthancPlugins::RestApiGet(info, "/instances/" + instanceId + "/attachments/dicom/info", false) ||
+      info.type() != Json::objectValue ||
+      !info.isMember("Uuid") ||
+      info["Uuid"].type() != Json::stringValue ||
+      !database_->LookupAttachment(path, info["Uuid"].asString()))
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_UnknownResource,
+                                    "Not an instance indexed by the Indexer plugin: " + instanceId);
+  }
+
+  std::string derivedPath;
+  if (!derivedStorage_->LookupCopy(derivedPath, path))
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_UnknownResource,
+                                    "No up-to-date transcoded copy of instance: " + instanceId);
+  }
+
+  FileMemoryMap reader(derivedPath);
+  OrthancPluginAnswerBuffer(OrthancPlugins::GetGlobalContext(), output,
+                            reader.length() == 0 ? NULL : reader.data(), reader.length(), "application/dicom");
+}
+
+
+static void GetFoldersHealth(OrthancPluginRestOutput* output,
+                             const char* url,
+                             const OrthancPluginHttpRequest* request)
+{
+  if (request->method != OrthancPluginHttpMethod_Get)
+  {
+    OrthancPlugins::AnswerMethodNotAllowed(output, "GET");
+  }
+  else
+  {
+    Json::Value answer;
+    watchdog_->Format(answer);
+    OrthancPlugins::AnswerJson(answer, output);
+  }
+}
+
+
+static void FormatStatistics(Json::Value& target,
+                             const std::string& path)
+{
+  IndexerDatabase::Statistics statistics;
+  database_->LookupStatistics(statistics, path);  // Zero if nothing is indexed
+
+  target = Json::objectValue;
+  target["Path"] = path;
+  target["Files"] = static_cast<Json::UInt64>(statistics.files_);
+  target["DicomFiles"] = static_cast<Json::UInt64>(statistics.dicomFiles_);
+  target["Size"] = static_cast<Json::UInt64>(statistics.size_);
+  target["LastChange"] = static_cast<Json::Int64>(statistics.lastChange_);
+}
+
+
+static void GetStatistics(OrthancPluginRestOutput* output,
+                          const char* url,
+                          const OrthancPluginHttpRequest* request)
+{
+  if (request->method != OrthancPluginHttpMethod_Get)
   {
-    std::stack<boost::filesystem::path> s;
+    OrthancPlugins::AnswerMethodNotAllowed(output, "GET");
+    return;
+  }
+
+  Json::Value answer;
 
-    for (std::list<std::string>::const_iterator it = folders_.begin();
-         it != folders_.end(); ++it)
+  for (uint32_t i = 0; i < request->getCount; i++)
+  {
+    if (std::string(request->getKeys[i]) == "path")
     {
-      s.push(*it);
+      // Statistics of one arbitrary directory
+      FormatStatistics(answer, request->getValues[i]);
+      OrthancPlugins::AnswerJson(answer, output);
+      return;
     }
+  }
 
-    while (!s.empty())
-    {
-      if (*stop)
-      {
-        return;
-      }
-      
-      boost::filesystem::path d = s.top();
-      s.pop();
+  answer = Json::objectValue;
+  answer["Folders"] = Json::arrayValue;
+  answer["StorageDirectories"] = Json::arrayValue;
 
-      boost::filesystem::directory_iterator current;
-    
-      try
-      {
-        current = boost::filesystem::directory_iterator(d);
-      }
-      catch (boost::filesystem::filesystem_error&)
-      {
-        LOG(WARNING) << "Indexer plugin cannot read directory: " << d.string();
-        continue;
-      }
+  for (size_t i = 0; i < watchdog_->GetRootsCount(); i++)
+  {
+    Json::Value item;
+    FormatStatistics(item, watchdog_->GetRootPath(i));
+    answer["Folders"].append(item);
+  }
 
-      const boost::filesystem::directory_iterator end;
-    
-      while (current != end)
-      {
-        try
-        {
-          const boost::filesystem::file_status status = boost::filesystem::status(current->path());
-          
-          switch (status.type())
-          {
-            case boost::filesystem::regular_file:
-            case boost::filesystem::reparse_file:
-              try
-              {
-                ProcessFile(current->path().string(),
-                            boost::filesystem::last_write_time(current->path()),
-                            boost::filesystem::file_size(current->path()));
-              }
-              catch (Orthanc::OrthancException& e)
-              {
-                LOG(ERROR) << e.What();
-              }              
-              break;
-          
-            case boost::filesystem::directory_file:
-              s.push(current->path());
-              break;
-          
-            default:
-              break;
-          }
-        }
-        catch (boost::filesystem::filesystem_error&)
-        {
-        }
+  for (size_t i = 0; i < placement_->GetRootsCount(); i++)
+  {
+    Json::Value item;
+    FormatStatistics(item, placement_->GetRoot(i));
+    answer["StorageDirectories"].append(item);
+  }
 
-        ++current;
-      }
+  OrthancPlugins::AnswerJson(answer, output);
+}
+
+
+// Lists a directory below the storage directory of Orthanc, using
+// only the index (the filesystem of the NAS is never accessed)
+static void BrowseStorage(OrthancPluginRestOutput* output,
+                          const char* url,
+                          const OrthancPluginHttpRequest* request)
+{
+  if (request->method != OrthancPluginHttpMethod_Get)
+  {
+    OrthancPlugins::AnswerMethodNotAllowed(output, "GET");
+    return;
+  }
+
+  std::string relative;
+  for (uint32_t i = 0; i < request->getCount; i++)
+  {
+    if (std::string(request->getKeys[i]) == "path")
+    {
+      relative = request->getValues[i];
     }
+  }
 
-    try
+  const boost::filesystem::path relativePath(relative);
+  if (relativePath.has_root_path())
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange, "The path must be relative: " + relative);
+  }
+
+  for (boost::filesystem::path::const_iterator it = relativePath.begin(); it != relativePath.end(); ++it)
+  {
+    if (it->string() == "..")
     {
-      LookupDeletedFiles();
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange, "The path cannot go upward: " + relative);
     }
-    catch (Orthanc::OrthancException& e)
+  }
+
+  std::string directory = (relative.empty() ? realStoragePath : realStoragePath / relativePath).string();
+  while (directory.size() > 1 &&
+         (directory[directory.size() - 1] == '/' ||
+          directory[directory.size() - 1] == '\\'))
+  {
+    directory.resize(directory.size() - 1);
+  }
+
+  std::list<IndexerDatabase::DirectoryChild> children;
+  database_->ListDirectory(children, directory);
+
+  typedef std::map<std::string, std::pair<unsigned int, uint64_t> >  SeriesContent;
+  SeriesContent series;
+
+  Json::Value answer = Json::objectValue;
+  answer["Path"] = relative;
+  answer["Directories"] = Json::arrayValue;
+  answer["Files"] = Json::arrayValue;
+
+  for (std::list<IndexerDatabase::DirectoryChild>::const_iterator it = children.begin(); it != children.end(); ++it)
+  {
+    Json::Value item = Json::objectValue;
+    item["Name"] = it->name_;
+    item["Size"] = static_cast<Json::UInt64>(it->size_);
+    item["LastModification"] = static_cast<Json::Int64>(it->time_);
+
+    if (it->isDirectory_)
     {
-      LOG(ERROR) << e.What();
+      item["DicomFiles"] = it->dicomFiles_;
+      item["OtherFiles"] = it->otherFiles_;
+      answer["Directories"].append(item);
     }
-    
-    for (unsigned int i = 0; i < intervalSeconds * 10; i++)
+    else
     {
-      if (*stop)
+      item["IsDicom"] = (it->dicomFiles_ != 0);
+
+      if (!it->seriesInstanceUid_.empty())
       {
-        return;
+        item["SeriesInstanceUID"] = it->seriesInstanceUid_;
+
+        std::pair<unsigned int, uint64_t>& content = series[it->seriesInstanceUid_];
+        content.first++;
+        content.second += it->size_;
       }
-      
-      boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+
+      answer["Files"].append(item);
     }
   }
+
+  // Grouping of the DICOM files of this directory by series
+  answer["Series"] = Json::arrayValue;
+
+  for (SeriesContent::const_iterator it = series.begin(); it != series.end(); ++it)
+  {
+    Json::Value item = Json::objectValue;
+    item["SeriesInstanceUID"] = it->first;
+    item["Files"] = it->second.first;
+    item["Size"] = static_cast<Json::UInt64>(it->second.second);
+    answer["Series"].append(item);
+  }
+
+  OrthancPlugins::AnswerJson(answer, output);
+}
+
+
+// caMicroscope only knows the storage directory of Orthanc, to which
+// the notified paths are relative: The files of the other storage
+// directories cannot be notified
+static void NotifyCamicroscope(const char* action,
+                               const boost::filesystem::path& file)
+{
+  const boost::filesystem::path relative = boost::filesystem::absolute(file).lexically_normal().lexically_relative(
+    boost::filesystem::absolute(realStoragePath).lexically_normal());
+
+  if (relative.empty() ||
+      *relative.begin() == "..")
+  {
+    LOG(INFO) << "Not notifying caMicroscope about a file outside of the storage directory of Orthanc: " << file.string();
+  }
+  else
+  {
+    SlowLog::Stage stage("notify");
+    camic_notifier::notify("/fs/" + std::string(action) + "?filepath=" + camic_notifier::escape(relative.string()));
+  }
 }
 
 
@@ -286,11 +1904,13 @@ static OrthancPluginErrorCode StorageCreate(const char *uuid,
                                             int64_t size,
                                             OrthancPluginContentType type)
 {
+  SlowLog::Operation operation(slowLog_.get(), "StorageCreate", uuid);
+
   try
   {
-    std::string instanceId;
+    std::string instanceId, seriesInstanceUid, sopInstanceUid;
     if (type != OrthancPluginContentType_Dicom ||
-      !ComputeInstanceId(instanceId, content, size))
+      !ComputeInstanceId(instanceId, seriesInstanceUid, sopInstanceUid, content, size))
     {
       // caMicroscope plugin: This must be an Orthanc cache file.
       // Keep it alive with the main Orthanc's database, no sooner, no earlier.
@@ -298,10 +1918,19 @@ static OrthancPluginErrorCode StorageCreate(const char *uuid,
       // Hence this must go in the same folder as the database, the index folder of Orthanc
       // (which is not the same as "a folder to be indexed by the indexer plugin")
       storageArea_->Create(uuid, content, size);
+
+      // Only the attachments that Orthanc can recompute are evictable
+      if (cacheArea_.get() != NULL &&
+          type == CONTENT_TYPE_DICOM_UNTIL_PIXEL_DATA &&
+          ComputeInstanceId(instanceId, seriesInstanceUid, sopInstanceUid, content, size))
+      {
+        cacheArea_->Add(uuid, instanceId, type, size);
+      }
+
       return OrthancPluginErrorCode_Success;
     }
 
-    if (database_.AddAttachment(uuid, instanceId))
+    if (database_->AddAttachment(uuid, instanceId))
     {
       // This StorageCreate call is from scanning a folder
       // Register it in the database, linking it to the file we encountered,
@@ -321,8 +1950,14 @@ static OrthancPluginErrorCode StorageCreate(const char *uuid,
 
       // __builtin_fprintf(stderr, "Check race condition: entered branch\n");
 
-      boost::filesystem::path dicom = realStoragePath;
-      std::string subdir_name = folder_name((const char *) content, size);
+      const boost::filesystem::path storageRoot(placement_->GetRoot(placement_->ChooseRoot(seriesInstanceUid, size)));
+
+      boost::filesystem::path dicom = storageRoot;
+      std::string subdir_name;
+      {
+        SlowLog::Stage stage("parse");
+        subdir_name = folder_name((const char *) content, size);
+      }
       if (subdir_name != "")
       {
         dicom /= subdir_name;
@@ -346,7 +1981,7 @@ static OrthancPluginErrorCode StorageCreate(const char *uuid,
       // run before "Check race condition: changed branch".
       // A mutex is not necessary as the worst case (which is not too bad:
       // having a duplicate, unused file on our FS) is now very unlikely.
-      if (database_.AddAttachment(uuid, instanceId)) {
+      if (database_->AddAttachment(uuid, instanceId)) {
         // This is the delayed thread. Undo the new created file and return;
         try
         {
@@ -360,18 +1995,20 @@ static OrthancPluginErrorCode StorageCreate(const char *uuid,
       // This thread indeed needs to save it
 
       // Pretend to have found it during a scan, to keep the caMic-compatible filepath in our database
-      // database_.AddDicomInstance is designed for files found by the indexing thread
+      // database_->AddDicomInstance is designed for files found by the indexing thread
       // as it saves the filepath
-      database_.AddDicomInstance(filepath_string,
+      database_->AddDicomInstance(filepath_string,
         write_time,
         size,
         instanceId);
+      database_->StoreInstance(instanceId, seriesInstanceUid, sopInstanceUid);
+      database_->StoreReceivedFile(filepath_string, storageRoot.string());
       // __builtin_fprintf(stderr, "Check race condition: changed branch\n");
 
       // Pretend to have received it now from processing from Orthanc
-      database_.AddAttachment(uuid, instanceId);
+      database_->AddAttachment(uuid, instanceId);
       // Notify caMicroscope of the newly received DICOM file
-      camic_notifier::notify("/fs/addedFile?filepath=" + camic_notifier::escape(dicom.lexically_relative(realStoragePath).string()));
+      NotifyCamicroscope("addedFile", dicom);
 
     }
     
@@ -384,18 +2021,51 @@ static OrthancPluginErrorCode StorageCreate(const char *uuid,
   }
   catch (...)
   {
-    return OrthancPluginErrorCode_InternalError;
+    return OrthancPluginErrorCode_InternalError;
+  }
+}
+
+
+
+static bool LookupExternalDicom(std::string& externalPath,
+                                const char *uuid,
+                                OrthancPluginContentType type)
+{
+  return (type == OrthancPluginContentType_Dicom &&
+          database_->LookupAttachment(externalPath, uuid));
+}
+
+
+class StorageRangeReader : public RangeCoalescer::IReader
+{
+public:
+  virtual void Read(void* target,
+                    const std::string& path,
+                    uint64_t start,
+                    uint64_t length) ORTHANC_OVERRIDE
+  {
+    OrthancPluginMemoryBuffer64 buffer;
+    buffer.data = target;
+    buffer.size = length;
+    StorageArea::ReadRangeFromPath(&buffer, path, start);
   }
-}
+};
 
+static StorageRangeReader  rangeReader_;
 
 
-static bool LookupExternalDicom(std::string& externalPath,
-                                const char *uuid,
-                                OrthancPluginContentType type)
+static void ReadRangeFromPath(OrthancPluginMemoryBuffer64 *target,
+                              const std::string& path,
+                              uint64_t rangeStart)
 {
-  return (type == OrthancPluginContentType_Dicom &&
-          database_.LookupAttachment(externalPath, uuid));
+  if (rangeCoalescer_.get() != NULL)
+  {
+    rangeCoalescer_->Read(target->data, path, rangeStart, target->size);
+  }
+  else
+  {
+    StorageArea::ReadRangeFromPath(target, path, rangeStart);
+  }
 }
 
 
@@ -404,16 +2074,23 @@ static OrthancPluginErrorCode StorageReadRange(OrthancPluginMemoryBuffer64 *targ
                                                OrthancPluginContentType type,
                                                uint64_t rangeStart)
 {
+  SlowLog::Operation operation(slowLog_.get(), "StorageReadRange", uuid);
+
   try
   {
     std::string externalPath;
     if (LookupExternalDicom(externalPath, uuid, type))
     {
-      StorageArea::ReadRangeFromPath(target, externalPath, rangeStart);
+      ReadRangeFromPath(target, externalPath, rangeStart);
     }
     else
     {
-      storageArea_->ReadRange(target, uuid, rangeStart);
+      ReadRangeFromPath(target, storageArea_->GetPath(uuid), rangeStart);
+
+      if (cacheArea_.get() != NULL)
+      {
+        cacheArea_->Touch(uuid);
+      }
     }
     
     return OrthancPluginErrorCode_Success;
@@ -430,20 +2107,74 @@ static OrthancPluginErrorCode StorageReadRange(OrthancPluginMemoryBuffer64 *targ
 }
 
 
+static void ReadWholeExternalDicom(OrthancPluginMemoryBuffer64 *target,
+                                   const std::string& path)
+{
+  if (readCache_.get() == NULL)
+  {
+    StorageArea::ReadWholeFromPath(target, path);
+    return;
+  }
+
+  std::time_t time;
+  uintmax_t size;
+
+  try
+  {
+    time = boost::filesystem::last_write_time(path);
+    size = boost::filesystem::file_size(path);
+  }
+  catch (boost::filesystem::filesystem_error&)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_InexistentFile);
+  }
+
+  ReadCache::Content content;
+  if (readCache_->Lookup(content, path, time, size))
+  {
+    StorageArea::CreateOrthancBuffer(target, content->c_str(), content->size());
+  }
+  else
+  {
+    StorageArea::ReadWholeFromPath(target, path);
+
+    if (target->size == size)
+    {
+      readCache_->Store(path, time, target->data, target->size);
+    }
+  }
+}
+
+
 static OrthancPluginErrorCode StorageReadWhole(OrthancPluginMemoryBuffer64 *target,
                                                const char *uuid,
                                                OrthancPluginContentType type)
 {
+  SlowLog::Operation operation(slowLog_.get(), "StorageReadWhole", uuid);
+
   try
   {
     std::string externalPath;
     if (LookupExternalDicom(externalPath, uuid, type))
     {
-      StorageArea::ReadWholeFromPath(target, externalPath);
+      // The DICOM attachment is always the original file, as its MD5
+      // and its transfer syntax are the ones known to Orthanc: The
+      // transcoded copies are served by "/indexer/instances/{id}/transcoded"
+      ReadWholeExternalDicom(target, externalPath);
+
+      if (prefetcher_.get() != NULL)
+      {
+        prefetcher_->NotifyRead(externalPath);
+      }
     }
     else
     {
       storageArea_->ReadWhole(target, uuid);
+
+      if (cacheArea_.get() != NULL)
+      {
+        cacheArea_->Touch(uuid);
+      }
     }
 
     return OrthancPluginErrorCode_Success;
@@ -463,21 +2194,23 @@ static OrthancPluginErrorCode StorageReadWhole(OrthancPluginMemoryBuffer64 *targ
 static OrthancPluginErrorCode StorageRemove(const char *uuid,
                                             OrthancPluginContentType type)
 {
+  SlowLog::Operation operation(slowLog_.get(), "StorageRemove", uuid);
+
   try
   {
     std::string externalPath;
     if (LookupExternalDicom(externalPath, uuid, type))
     {
-      database_.RemoveAttachment(uuid);
+      database_->RemoveAttachment(uuid);
 
       // Deleting from Orthanc UI/API should really delete the file or just make it invisible
       // from Orthanc until restart? If the latter, please comment out the next few lines until end of "if" true branch:
 
       // Count the number of times a file is recorded as attachment (a file registered with how many UUIDs)
       std::string instanceId;
-      database_.LookupFile(instanceId, externalPath, 0, 0);
+      database_->LookupFile(instanceId, externalPath, 0, 0);
       int64_t times;
-      database_.CountTimesAttached(times, instanceId);
+      database_->CountTimesAttached(times, instanceId);
 
       if (times == 0) {
         // Delete the file
@@ -487,20 +2220,30 @@ static OrthancPluginErrorCode StorageRemove(const char *uuid,
           try {
             // Small race condition here for the next two lines, they should execute as one statement
             boost::filesystem::remove(boostPath);
-            database_.RemoveFile(externalPath);
+            database_->RemoveFile(externalPath);
           } catch(...) {
             fprintf(stderr, "file removal failed for %s\n", externalPath.c_str());
           }
         }
-        camic_notifier::notify("/fs/deletedFile?filepath=" + camic_notifier::escape(boostPath.lexically_relative(realStoragePath).string()));
-        database_.RemoveFile(externalPath);
+        if (readCache_.get() != NULL)
+        {
+          readCache_->Invalidate(externalPath);
+        }
+
+        NotifyCamicroscope("deletedFile", boostPath);
+        database_->RemoveFile(externalPath);
       }
     }
     else
     {
 
-      database_.RemoveAttachment(uuid);
+      database_->RemoveAttachment(uuid);
       storageArea_->RemoveAttachment(uuid);
+
+      if (cacheArea_.get() != NULL)
+      {
+        cacheArea_->Remove(uuid);
+      }
     }
     
     return OrthancPluginErrorCode_Success;
@@ -517,25 +2260,231 @@ static OrthancPluginErrorCode StorageRemove(const char *uuid,
 }
 
 
+static int32_t FilterIncomingInstance(const OrthancPluginDicomInstance* instance)
+{
+  try
+  {
+    OrthancPluginContext* context = OrthancPlugins::GetGlobalContext();
+
+    // Only C-STORE, as the crawler itself uploads indexed files through the REST API
+    if (OrthancPluginGetInstanceOrigin(context, instance) != OrthancPluginInstanceOrigin_DicomProtocol)
+    {
+      return 1;
+    }
+
+    switch (duplicateFilter_->Apply(OrthancPluginGetInstanceData(context, instance),
+                                    static_cast<size_t>(OrthancPluginGetInstanceSize(context, instance))))
+    {
+      case DuplicateFilter::Decision_Store:
+        return 1;
+
+      case DuplicateFilter::Decision_Discard:
+        LOG(INFO) << "Indexer plugin has discarded a duplicate instance from modality: "
+                  << OrthancPluginGetInstanceRemoteAet(context, instance);
+        return 0;
+
+      case DuplicateFilter::Decision_Reject:
+        LOG(WARNING) << "Indexer plugin has rejected a duplicate instance from modality: "
+                     << OrthancPluginGetInstanceRemoteAet(context, instance);
+        return -1;  // The error is reported to the C-STORE SCU
+
+      default:
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+    }
+  }
+  catch (Orthanc::OrthancException& e)
+  {
+    // In case of doubt, the instance is stored
+    LOG(ERROR) << e.What();
+    return 1;
+  }
+  catch (...)
+  {
+    return 1;
+  }
+}
+
+
+static OrthancPluginErrorCode CreateStorageCommitmentScp(void** handler,
+                                                         const char* jobId,
+                                                         const char* transactionUid,
+                                                         const char* const* sopClassUids,
+                                                         const char* const* sopInstanceUids,
+                                                         uint32_t countInstances,
+                                                         const char* remoteAet,
+                                                         const char* calledAet)
+{
+  try
+  {
+    *handler = new StorageCommitmentScp(*database_, sopInstanceUids, countInstances);
+    return OrthancPluginErrorCode_Success;
+  }
+  catch (Orthanc::OrthancException& e)
+  {
+    LOG(ERROR) << e.What();
+    return static_cast<OrthancPluginErrorCode>(e.GetErrorCode());
+  }
+  catch (...)
+  {
+    return OrthancPluginErrorCode_InternalError;
+  }
+}
+
+
+// The crawlers that are still hung at shutdown are detached, and
+// would access the objects below if their filesystem operation
+// returns. These objects are thus deliberately leaked, so that they
+// survive the static destructors of the plugin.
+static void AbandonCrawlers()
+{
+  struct Objects
+  {
+    boost::shared_ptr<IndexerDatabase>     database_;
+    boost::shared_ptr<DirectoryScheduler>  scheduler_;
+    boost::shared_ptr<CrawlerWatchdog>     watchdog_;
+    boost::shared_ptr<DeviceQueues>        deviceQueues_;
+    std::vector<boost::shared_ptr<HeaderPrefetcher> >  headerPrefetchers_;
+    boost::shared_ptr<SlowLog>             slowLog_;
+  };
+
+  Objects* leaked = new Objects;
+  leaked->database_ = database_;
+  leaked->scheduler_ = scheduler_;
+  leaked->watchdog_ = watchdog_;
+  leaked->deviceQueues_ = deviceQueues_;
+  leaked->headerPrefetchers_ = headerPrefetchers_;
+  leaked->slowLog_ = slowLog_;
+}
+
+
 static OrthancPluginErrorCode OnChangeCallback(OrthancPluginChangeType changeType,
                                                OrthancPluginResourceType resourceType,
                                                const char* resourceId)
 {
   static bool stop_;
-  static boost::thread thread_;
+  static std::vector<boost::thread*> crawlers_;
+  static boost::thread watchdogThread_;
+  static boost::thread storageThread_;
+  static boost::thread freeSpaceThread_;
+  static boost::thread backfillThread_;
+  static boost::thread memoryThread_;
+  static boost::thread evictionThread_;
 
   switch (changeType)
   {
     case OrthancPluginChangeType_OrthancStarted:
       stop_ = false;
-      thread_ = boost::thread(MonitorDirectories, &stop_, intervalSeconds_);
+
+      for (size_t i = 0; i < watchdog_->GetRootsCount(); i++)
+      {
+        crawlers_.push_back(new boost::thread(MonitorRoot, &stop_, i, intervalSeconds_));
+      }
+
+      watchdogThread_ = boost::thread(WatchCrawlers, &stop_);
+      storageThread_ = boost::thread(MonitorStorageDirectories, &stop_, intervalSeconds_);
+      freeSpaceThread_ = boost::thread(MonitorFreeSpace, &stop_, placement_);
+      backfillThread_ = boost::thread(BackfillInstances, &stop_, database_);
+
+      if (memoryBudget_.get() != NULL)
+      {
+        memoryThread_ = boost::thread(MonitorMemory, &stop_);
+      }
+
+      if (cacheArea_.get() != NULL)
+      {
+        evictionThread_ = boost::thread(EvictCacheAttachments, &stop_);
+      }
+
+      if (prefetcher_.get() != NULL)
+      {
+        prefetcher_->Start(prefetchThreads_, backgroundPriority_);
+      }
+
+      if (derivedStorage_.get() != NULL)
+      {
+        // Transcoding is never more urgent than the other background tasks
+        derivedStorage_->Start(std::max(backgroundPriority_, ThreadPriority::Level_Low));
+      }
       break;
 
     case OrthancPluginChangeType_OrthancStopped:
       stop_ = true;
-      if (thread_.joinable())
+
+      if (prefetcher_.get() != NULL)
+      {
+        prefetcher_->Stop();
+      }
+
+      if (derivedStorage_.get() != NULL)
+      {
+        derivedStorage_->Stop();
+      }
+
+      // Wakes up the crawlers that wait for the slots of a hung root
+      deviceQueues_->Stop();
+
+      {
+        const boost::system_time deadline = (boost::get_system_time() +
+                                             boost::posix_time::seconds(HUNG_CRAWLERS_GRACE));
+        bool abandoned = false;
+
+        for (size_t i = 0; i < crawlers_.size(); i++)
+        {
+          // A crawler can hang in a filesystem operation that started
+          // after the last check of the watchdog, so none of them is
+          // joined without a deadline
+          if (crawlers_[i]->joinable() &&
+              !crawlers_[i]->timed_join(deadline))
+          {
+            // Joining would block the shutdown of Orthanc
+            LOG(WARNING) << "Indexer plugin is abandoning the hung crawler of folder: " << watchdog_->GetRootPath(i);
+            crawlers_[i]->detach();
+            abandoned = true;
+          }
+
+          delete crawlers_[i];
+        }
+
+        crawlers_.clear();
+
+        if (abandoned)
+        {
+          AbandonCrawlers();
+        }
+      }
+
+      if (watchdogThread_.joinable())
+      {
+        watchdogThread_.join();
+      }
+
+      if (storageThread_.joinable())
+      {
+        storageThread_.join();
+      }
+
+      if (freeSpaceThread_.joinable() &&
+          !freeSpaceThread_.timed_join(boost::posix_time::seconds(HUNG_CRAWLERS_GRACE)))
+      {
+        LOG(WARNING) << "Indexer plugin is abandoning the measure of the free space of the storage directories";
+        freeSpaceThread_.detach();
+      }
+
+      if (backfillThread_.joinable() &&
+          !backfillThread_.timed_join(boost::posix_time::seconds(HUNG_CRAWLERS_GRACE)))
+      {
+        LOG(WARNING) << "Indexer plugin is abandoning the hung recording of the series of the indexed instances";
+        backfillThread_.detach();
+      }
+
+      if (memoryThread_.joinable())
       {
-        thread_.join();
+        memoryThread_.join();
+      }
+
+      if (evictionThread_.joinable())
+      {
+        evictionThread_.join();
       }
       
       break;
@@ -583,6 +2532,8 @@ extern "C"
     bool enabled = indexer.GetBooleanValue("Enable", false);
     if (enabled)
     {
+      bool storageCommitment;
+
       try
       {
         static const char* const DATABASE = "Database";
@@ -591,10 +2542,150 @@ extern "C"
         static const char* const ORTHANC_STORAGE = "OrthancStorage";
         static const char* const STORAGE_DIRECTORY = "StorageDirectory";
         static const char* const INTERVAL = "Interval";
+        static const char* const MAXIMUM_INTERVAL = "MaximumInterval";
+        static const char* const PERSISTENT_INODE_CACHE = "PersistentInodeCache";
+        static const char* const STALL_TIMEOUT = "StallTimeout";
+        static const char* const MAXIMUM_RETRY_INTERVAL = "MaximumRetryInterval";
+        static const char* const READ_CACHE_SIZE = "ReadCacheSize";
+        static const char* const READ_CACHE_MAXIMUM_FILE_SIZE = "ReadCacheMaximumFileSize";
+        static const char* const UPLOAD_BATCH_SIZE = "UploadBatchSize";
+        static const char* const UPLOAD_BATCH_MAXIMUM_FILE_SIZE = "UploadBatchMaximumFileSize";
+        static const char* const SERIES_PREFETCH = "SeriesPrefetch";
+        static const char* const BACKGROUND_PRIORITY = "BackgroundPriority";
+        static const char* const MEMORY_BUDGET = "MemoryBudget";
+        static const char* const CACHE_ATTACHMENTS_SIZE = "CacheAttachmentsSize";
+        static const char* const COLD_FOLDERS = "ColdFolders";
+        static const char* const DIRECT_READ_THRESHOLD = "DirectReadThreshold";
+        static const char* const RANGE_COALESCING_SIZE = "RangeCoalescingSize";
+        static const char* const SLOW_OPERATION_THRESHOLD = "SlowOperationThreshold";
+        static const char* const SLOW_OPERATIONS_COUNT = "SlowOperationsCount";
+        static const char* const STORAGE_COMMITMENT = "StorageCommitment";
+        static const char* const DUPLICATE_POLICY = "DuplicatePolicy";
+        static const char* const TRANSCODING = "Transcoding";
+        static const char* const ROTATIONAL_CONCURRENCY = "RotationalConcurrency";
+        static const char* const HUGE_DIRECTORY_THREADS = "HugeDirectoryThreads";
+        static const char* const HEADER_PREFETCH_SIZE = "HeaderPrefetchSize";
+        static const char* const HEADER_PREFETCH_LOOKAHEAD = "HeaderPrefetchLookahead";
+        static const char* const SOLID_STATE_CONCURRENCY = "SolidStateConcurrency";
+        static const char* const UNKNOWN_DEVICE_CONCURRENCY = "UnknownDeviceConcurrency";
+        static const char* const TRANSCODING_DIRECTORY = "TranscodingDirectory";
+        static const char* const TRANSCODING_SYNTAX = "TranscodingSyntax";
+        static const char* const OVERWRITE_INSTANCES = "OverwriteInstances";
+        static const char* const SERIES_PREFETCH_QUEUE_SIZE = "SeriesPrefetchQueueSize";
+        static const char* const SERIES_PREFETCH_THREADS = "SeriesPrefetchThreads";
+        static const char* const SERIES_PREFETCH_TIMEOUT = "SeriesPrefetchTimeout";
+        static const char* const STORAGE_DIRECTORIES = "StorageDirectories";
+        static const char* const STORAGE_PLACEMENT = "StoragePlacement";
         static const char *const STORE_DICOM = "StoreDICOM";
         static const char *const STORAGE_COMPRESSION = "StorageCompression";
 
         intervalSeconds_ = indexer.GetUnsignedIntegerValue(INTERVAL, 10 /* 10 seconds by default */);
+
+        // By default, the maximum interval equals the interval, which
+        // disables the per-directory adaptive revisit intervals
+        unsigned int maximumInterval = indexer.GetUnsignedIntegerValue(MAXIMUM_INTERVAL, intervalSeconds_);
+        if (maximumInterval > intervalSeconds_)
+        {
+          LOG(WARNING) << "The Indexer plugin will revisit unchanged directories with an interval of up to "
+                       << maximumInterval << " seconds";
+          scheduler_.reset(new DirectoryScheduler(intervalSeconds_, maximumInterval, INTERVAL_JITTER));
+        }
+        else if (maximumInterval < intervalSeconds_)
+        {
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange,
+                                          "The \"" + std::string(MAXIMUM_INTERVAL) + "\" option of the Indexer plugin "
+                                          "cannot be smaller than its \"" + std::string(INTERVAL) + "\" option");
+        }
+
+        persistentInodeCache_ = indexer.GetBooleanValue(PERSISTENT_INODE_CACHE, false);
+        overwriteInstances_ = configuration.GetBooleanValue(OVERWRITE_INSTANCES, false);
+        storageCommitment = indexer.GetBooleanValue(STORAGE_COMMITMENT, false);
+
+        const DuplicateFilter::Policy duplicatePolicy = DuplicateFilter::ParsePolicy(
+          indexer.GetStringValue(DUPLICATE_POLICY, "Store"));
+        if (duplicatePolicy != DuplicateFilter::Policy_Store)
+        {
+          if (overwriteInstances_)
+          {
+            LOG(WARNING) << "The \"" << DUPLICATE_POLICY << "\" option of the Indexer plugin is ignored, "
+                         << "as Orthanc is configured to overwrite the instances";
+          }
+          else
+          {
+            LOG(WARNING) << "The Indexer plugin will filter the duplicate instances received through C-STORE";
+            duplicateFilter_.reset(new DuplicateFilter(*database_, duplicatePolicy));
+          }
+        }
+
+        backgroundPriority_ = ThreadPriority::Parse(indexer.GetStringValue(BACKGROUND_PRIORITY, "Normal"));
+        if (backgroundPriority_ != ThreadPriority::Level_Normal)
+        {
+          LOG(WARNING) << "The background threads of the Indexer plugin will run with priority: "
+                       << ThreadPriority::Format(backgroundPriority_);
+        }
+
+        const unsigned int memoryBudget = indexer.GetUnsignedIntegerValue(MEMORY_BUDGET, 0 /* disabled by default (in MB) */);
+        if (memoryBudget != 0)
+        {
+          LOG(WARNING) << "The caches of the Indexer plugin will share a memory budget of " << memoryBudget << "MB";
+          memoryBudget_.reset(new MemoryBudget(static_cast<uint64_t>(memoryBudget) * 1024 * 1024, MEMORY_PRESSURE_THRESHOLD));
+
+          // The snapshots of the directories being scanned cannot be
+          // shrunk, but they count against the ceiling
+          memoryBudget_->Register("directory_snapshots", snapshotsMemory_, SNAPSHOTS_MEMORY_WEIGHT);
+        }
+
+        const unsigned int readCacheSize = indexer.GetUnsignedIntegerValue(READ_CACHE_SIZE, 0 /* disabled by default (in MB) */);
+        if (readCacheSize != 0)
+        {
+          const unsigned int maximumFileSize = indexer.GetUnsignedIntegerValue(
+            READ_CACHE_MAXIMUM_FILE_SIZE, 1024 /* 1MB by default (in KB) */);
+
+          LOG(WARNING) << "The Indexer plugin will cache the DICOM files below " << maximumFileSize
+                       << "KB in memory, up to " << readCacheSize << "MB";
+          readCache_.reset(new ReadCache(static_cast<uint64_t>(readCacheSize) * 1024 * 1024,
+                                         static_cast<size_t>(maximumFileSize) * 1024, READ_CACHE_SHARDS));
+
+          if (memoryBudget_.get() != NULL)
+          {
+            memoryBudget_->Register("read_cache", *readCache_, READ_CACHE_MEMORY_WEIGHT);
+          }
+        }
+
+        uploadBatchSize_ = static_cast<size_t>(indexer.GetUnsignedIntegerValue(
+          UPLOAD_BATCH_SIZE, 0 /* disabled by default (in KB) */)) * 1024;
+        uploadBatchMaximumFileSize_ = static_cast<size_t>(indexer.GetUnsignedIntegerValue(
+          UPLOAD_BATCH_MAXIMUM_FILE_SIZE, 256 /* 256KB by default (in KB) */)) * 1024;
+
+        if (uploadBatchSize_ != 0)
+        {
+          if (uploadBatchMaximumFileSize_ == 0 ||
+              uploadBatchMaximumFileSize_ > uploadBatchSize_)
+          {
+            throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange,
+                                            "The \"" + std::string(UPLOAD_BATCH_MAXIMUM_FILE_SIZE) + "\" option of the Indexer "
+                                            "plugin must be between 1 and its \"" + std::string(UPLOAD_BATCH_SIZE) + "\" option");
+          }
+
+          LOG(WARNING) << "The Indexer plugin will upload the DICOM files below " << (uploadBatchMaximumFileSize_ / 1024)
+                       << "KB to Orthanc as ZIP archives of up to " << (uploadBatchSize_ / 1024) << "KB";
+        }
+
+        if (indexer.GetBooleanValue(SERIES_PREFETCH, false))
+        {
+          prefetchThreads_ = indexer.GetUnsignedIntegerValue(SERIES_PREFETCH_THREADS, 2);
+
+          LOG(WARNING) << "The Indexer plugin will prefetch the series that are read, into the "
+                       << (readCache_.get() == NULL ? "page cache" : "read cache and the page cache");
+          prefetcher_.reset(new SeriesPrefetcher(*database_, readCache_.get(),
+                                                 indexer.GetUnsignedIntegerValue(SERIES_PREFETCH_QUEUE_SIZE, 1000),
+                                                 indexer.GetUnsignedIntegerValue(SERIES_PREFETCH_TIMEOUT, 30 /* 30 seconds by default */)));
+
+          if (memoryBudget_.get() != NULL)
+          {
+            memoryBudget_->Register("series_prefetcher", *prefetcher_, PREFETCH_MEMORY_WEIGHT);
+          }
+        }
         
         if (!indexer.LookupListOfStrings(folders_, FOLDERS, true) ||
             folders_.empty())
@@ -609,6 +2700,35 @@ extern "C"
           LOG(WARNING) << "The Indexer plugin will monitor the content of folder: " << *it;
         }
 
+        // A quarantined folder is first retried after "Interval"
+        watchdog_.reset(new CrawlerWatchdog(folders_,
+                                            indexer.GetUnsignedIntegerValue(STALL_TIMEOUT, 60 /* 1 minute by default */),
+                                            intervalSeconds_,
+                                            indexer.GetUnsignedIntegerValue(MAXIMUM_RETRY_INTERVAL, 3600 /* 1 hour by default */)));
+
+        // The devices of the roots are only probed by their crawlers,
+        // as a hung network mount would block the startup of Orthanc.
+        // A slot held for longer than "StallTimeout" is a stalled one.
+        deviceQueues_.reset(new DeviceQueues(indexer.GetUnsignedIntegerValue(ROTATIONAL_CONCURRENCY, 2),
+                                             indexer.GetUnsignedIntegerValue(SOLID_STATE_CONCURRENCY, 16),
+                                             indexer.GetUnsignedIntegerValue(UNKNOWN_DEVICE_CONCURRENCY, 4),
+                                             indexer.GetUnsignedIntegerValue(STALL_TIMEOUT, 60)));
+        rootDevices_.resize(watchdog_->GetRootsCount());
+
+        hugeDirectoryThreads_ = indexer.GetUnsignedIntegerValue(HUGE_DIRECTORY_THREADS, 4);
+
+        const unsigned int headerPrefetchSize = indexer.GetUnsignedIntegerValue(
+          HEADER_PREFETCH_SIZE, 0 /* disabled by default (in KB) */);
+        if (headerPrefetchSize != 0)
+        {
+          const unsigned int lookahead = indexer.GetUnsignedIntegerValue(HEADER_PREFETCH_LOOKAHEAD, 32);
+          for (size_t i = 0; i < watchdog_->GetRootsCount(); i++)
+          {
+            headerPrefetchers_.push_back(boost::shared_ptr<HeaderPrefetcher>(
+                                           new HeaderPrefetcher(static_cast<size_t>(headerPrefetchSize) * 1024, lookahead)));
+          }
+        }
+
         std::string path;
         if (!indexer.LookupStringValue(path, DATABASE))
         {
@@ -623,7 +2743,7 @@ extern "C"
         }
         
         LOG(WARNING) << "Path to the database of the Indexer plugin: " << path;
-        database_.Open(path);
+        database_->Open(path);
 
         // caMicroscope: the "root" of the storageArea_ is now used only for non-DICOM files,
         // which are probably cache files, if any. To destroy them when the main Orthanc
@@ -631,6 +2751,97 @@ extern "C"
         // Please also see the comment in StorageCreate
         storageArea_.reset(new StorageArea(configuration.GetStringValue(INDEX_DIRECTORY, ORTHANC_STORAGE)));
 
+        {
+          const unsigned int directReadThreshold = indexer.GetUnsignedIntegerValue(
+            DIRECT_READ_THRESHOLD, 0 /* disabled by default (in MB) */);
+
+          std::list<std::string> coldFolders;
+          indexer.LookupListOfStrings(coldFolders, COLD_FOLDERS, true);
+
+          if (directReadThreshold != 0 ||
+              !coldFolders.empty())
+          {
+            if (directReadThreshold != 0)
+            {
+              LOG(WARNING) << "The Indexer plugin will bypass the page cache when reading "
+                           << directReadThreshold << "MB or more";
+            }
+
+            for (std::list<std::string>::const_iterator it = coldFolders.begin(); it != coldFolders.end(); ++it)
+            {
+              LOG(WARNING) << "The Indexer plugin will bypass the page cache when reading from cold folder: " << *it;
+            }
+
+            StorageArea::ConfigureDirectReads(static_cast<uint64_t>(directReadThreshold) * 1024 * 1024, coldFolders);
+          }
+        }
+
+        const unsigned int slowOperationThreshold = indexer.GetUnsignedIntegerValue(
+          SLOW_OPERATION_THRESHOLD, 0 /* disabled by default (in milliseconds) */);
+        if (slowOperationThreshold != 0)
+        {
+          LOG(WARNING) << "The Indexer plugin will log the operations lasting more than "
+                       << slowOperationThreshold << "ms, see URI /indexer/slow-operations";
+          slowLog_.reset(new SlowLog(slowOperationThreshold,
+                                     indexer.GetUnsignedIntegerValue(SLOW_OPERATIONS_COUNT, 100)));
+        }
+
+        const unsigned int rangeCoalescingSize = indexer.GetUnsignedIntegerValue(
+          RANGE_COALESCING_SIZE, 0 /* disabled by default (in MB) */);
+        if (rangeCoalescingSize != 0)
+        {
+          rangeCoalescer_.reset(new RangeCoalescer(rangeReader_, static_cast<uint64_t>(rangeCoalescingSize) * 1024 * 1024));
+        }
+
+        const unsigned int cacheAttachmentsSize = indexer.GetUnsignedIntegerValue(
+          CACHE_ATTACHMENTS_SIZE, 0 /* unbounded by default (in MB) */);
+        if (cacheAttachmentsSize != 0)
+        {
+          LOG(WARNING) << "The Indexer plugin will evict the least recently used cache attachments "
+                       << "of Orthanc above " << cacheAttachmentsSize << "MB";
+          cacheArea_.reset(new CacheArea(*database_, static_cast<uint64_t>(cacheAttachmentsSize) * 1024 * 1024));
+        }
+
+        if (indexer.GetBooleanValue(TRANSCODING, false))
+        {
+          std::string directory;
+          if (!indexer.LookupStringValue(directory, TRANSCODING_DIRECTORY))
+          {
+            throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange,
+                                            "Missing configuration option for Indexer plugin: " + std::string(TRANSCODING_DIRECTORY));
+          }
+
+          // The copies must not be crawled, as they would be uploaded to Orthanc
+          const boost::filesystem::path derived = boost::filesystem::absolute(directory).lexically_normal();
+          for (std::list<std::string>::const_iterator it = folders_.begin(); it != folders_.end(); ++it)
+          {
+            const boost::filesystem::path folder = boost::filesystem::absolute(*it).lexically_normal();
+            const boost::filesystem::path relative = derived.lexically_relative(folder);
+            if (!relative.empty() &&
+                *relative.begin() != "..")
+            {
+              throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange,
+                                              "The \"" + std::string(TRANSCODING_DIRECTORY) + "\" option of the Indexer "
+                                              "plugin cannot be inside an indexed folder: " + *it);
+            }
+          }
+
+          const std::string syntax = indexer.GetStringValue(TRANSCODING_SYNTAX, "1.2.840.10008.1.2.4.80" /* JPEG-LS lossless */);
+          LOG(WARNING) << "The Indexer plugin will transcode the JPEG 2000 files to transfer syntax "
+                       << syntax << " into directory: " << directory;
+
+          // The file and its copy are both held in memory during the
+          // transcoding, in addition to the decoded pixels
+          uint64_t maximumSize = 0;
+          if (memoryBudget_.get() != NULL)
+          {
+            maximumSize = memoryBudget_->GetCeiling() / TRANSCODING_MEMORY_FACTOR;
+          }
+
+          Orthanc::SystemToolbox::MakeDirectory(directory);
+          derivedStorage_.reset(new DerivedStorage(*database_, directory, syntax, maximumSize));
+        }
+
         realStoragePath = boost::filesystem::path(configuration.GetStringValue(STORAGE_DIRECTORY, ORTHANC_STORAGE));
 
         if (!boost::filesystem::exists(realStoragePath))
@@ -639,6 +2850,34 @@ extern "C"
           return -1;
         }
 
+        // The DICOM files received by Orthanc are spread over
+        // "StorageDirectories", which defaults to "StorageDirectory"
+        std::list<std::string> storageDirectories;
+        if (!indexer.LookupListOfStrings(storageDirectories, STORAGE_DIRECTORIES, true) ||
+            storageDirectories.empty())
+        {
+          storageDirectories.push_back(realStoragePath.string());
+        }
+
+        for (std::list<std::string>::const_iterator it = storageDirectories.begin();
+             it != storageDirectories.end(); ++it)
+        {
+          if (!boost::filesystem::is_directory(*it))
+          {
+            throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange,
+                                            "Inexistent storage directory for the Indexer plugin: " + *it);
+          }
+        }
+
+        placement_.reset(new StoragePlacement(storageDirectories, StoragePlacement::ParsePolicy(
+                                                indexer.GetStringValue(STORAGE_PLACEMENT, "RoundRobin"))));
+
+        if (storageDirectories.size() > 1)
+        {
+          LOG(WARNING) << "The Indexer plugin will spread the received DICOM files over "
+                       << storageDirectories.size() << " storage directories";
+        }
+
         // caMicroscope checks:
         bool indexOnly = !configuration.GetBooleanValue(STORE_DICOM, true);
         if (indexOnly)
@@ -665,7 +2904,41 @@ extern "C"
       }
 
       OrthancPluginRegisterOnChangeCallback(context, OnChangeCallback);
+      OrthancPluginRegisterRefreshMetricsCallback(context, RefreshMetrics);
+      OrthancPlugins::RegisterRestCallback<GetFoldersHealth>("/indexer/folders", true);
+      OrthancPlugins::RegisterRestCallback<GetDevices>("/indexer/devices", true);
+      OrthancPlugins::RegisterRestCallback<BrowseStorage>("/indexer/browse", true);
+      OrthancPlugins::RegisterRestCallback<GetStatistics>("/indexer/statistics", true);
+
+      if (memoryBudget_.get() != NULL)
+      {
+        OrthancPlugins::RegisterRestCallback<GetMemoryBudget>("/indexer/memory", true);
+      }
+
+      if (slowLog_.get() != NULL)
+      {
+        OrthancPlugins::RegisterRestCallback<GetSlowOperations>("/indexer/slow-operations", true);
+      }
+
+      if (derivedStorage_.get() != NULL)
+      {
+        OrthancPlugins::RegisterRestCallback<GetTranscodedInstance>("/indexer/instances/([^/]*)/transcoded", true);
+      }
+
       OrthancPluginRegisterStorageArea2(context, StorageCreate, StorageReadWhole, StorageReadRange, StorageRemove);
+
+      if (duplicateFilter_.get() != NULL)
+      {
+        OrthancPluginRegisterIncomingDicomInstanceFilter(context, FilterIncomingInstance);
+      }
+
+      if (storageCommitment)
+      {
+        LOG(WARNING) << "The Indexer plugin will answer the storage commitment requests from its index";
+        OrthancPluginRegisterStorageCommitmentScpCallback(context, CreateStorageCommitmentScp,
+                                                          OrthancPlugins::IStorageCommitmentScpHandler::Destructor,
+                                                          OrthancPlugins::IStorageCommitmentScpHandler::Lookup);
+      }
     }
     else
     {
@@ -1,4 +1,4 @@
-CREATE TABLE Files(
+CREATE TABLE IF NOT EXISTS Files(
        path TEXT PRIMARY KEY NOT NULL,
        time INTEGER NOT NULL,
        size INTEGER NOT NULL,
@@ -6,9 +6,85 @@ CREATE TABLE Files(
        instanceId TEXT NOT NULL
        );
 
-CREATE TABLE Attachments(
+CREATE TABLE IF NOT EXISTS Attachments(
        uuid TEXT PRIMARY KEY NOT NULL,
        instanceId NOT NULL
        );
 
-CREATE INDEX InstancesIndex ON Files(instanceId);
+CREATE INDEX IF NOT EXISTS InstancesIndex ON Files(instanceId);
+CREATE INDEX IF NOT EXISTS AttachmentsInstanceIndex ON Attachments(instanceId);
+
+-- Revisit schedule of each crawled directory (all times in seconds)
+CREATE TABLE IF NOT EXISTS Directories(
+       path TEXT PRIMARY KEY NOT NULL,
+       parent TEXT NOT NULL,
+       lastVisit INTEGER NOT NULL,
+       lastChange INTEGER NOT NULL,
+       visits INTEGER NOT NULL,
+       changes INTEGER NOT NULL,
+       revisitInterval INTEGER NOT NULL,
+       nextVisit INTEGER NOT NULL
+       );
+
+CREATE INDEX IF NOT EXISTS DirectoriesParentIndex ON Directories(parent);
+
+-- Identification results of the crawled files, indexed by the
+-- identity of their inode (used to recognize hard links)
+CREATE TABLE IF NOT EXISTS Inodes(
+       device INTEGER NOT NULL,
+       inode INTEGER NOT NULL,
+       time INTEGER NOT NULL,
+       size INTEGER NOT NULL,
+       isDicom INTEGER NOT NULL,
+       instanceId TEXT NOT NULL,
+       PRIMARY KEY(device, inode)
+       );
+
+-- DICOM identifiers of the indexed instances (used to prefetch series)
+CREATE TABLE IF NOT EXISTS Instances(
+       instanceId TEXT PRIMARY KEY NOT NULL,
+       seriesInstanceUid TEXT NOT NULL,
+       sopInstanceUid TEXT NOT NULL
+       );
+
+CREATE INDEX IF NOT EXISTS InstancesSeriesIndex ON Instances(seriesInstanceUid);
+CREATE INDEX IF NOT EXISTS InstancesSopIndex ON Instances(sopInstanceUid);
+
+-- Storage directory that was chosen for each DICOM file received by Orthanc
+CREATE TABLE IF NOT EXISTS ReceivedFiles(
+       path TEXT PRIMARY KEY NOT NULL,
+       root TEXT NOT NULL
+       );
+
+-- Counters of the files below each directory, rolled up to the root
+-- of the filesystem, and maintained together with the Files table
+CREATE TABLE IF NOT EXISTS DirectoryStatistics(
+       path TEXT PRIMARY KEY NOT NULL,
+       files INTEGER NOT NULL,
+       dicomFiles INTEGER NOT NULL,
+       size INTEGER NOT NULL,
+       lastChange INTEGER NOT NULL
+       );
+
+-- Cache attachments of Orthanc whose total size is bounded
+CREATE TABLE IF NOT EXISTS CacheAttachments(
+       uuid TEXT PRIMARY KEY NOT NULL,
+       instanceId TEXT NOT NULL,
+       type INTEGER NOT NULL,
+       size INTEGER NOT NULL
+       );
+
+-- Faster-decoding copies of the indexed DICOM files, valid as long as
+-- the original has the same time and size (an empty derivedPath means
+-- that the original is not transcoded)
+CREATE TABLE IF NOT EXISTS DerivedFiles(
+       path TEXT PRIMARY KEY NOT NULL,
+       time INTEGER NOT NULL,
+       size INTEGER NOT NULL,
+       derivedPath TEXT NOT NULL
+       );
+
+-- Copies whose original is not indexed anymore, and that must be deleted
+CREATE TABLE IF NOT EXISTS DerivedGarbage(
+       derivedPath TEXT PRIMARY KEY NOT NULL
+       );
@@ -0,0 +1,268 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "RangeCoalescer.h"
+
+#include "SlowLog.h"
+
+#include <OrthancException.h>
+
+#include <algorithm>
+#include <string.h>
+
+
+struct RangeCoalescer::Flight
+{
+  uint64_t             start_;
+  uint64_t             end_;
+  bool                 started_;
+  bool                 done_;
+  bool                 failed_;
+  Orthanc::ErrorCode   error_;
+  std::string          details_;
+  std::string          buffer_;
+  FlightPtr            blocker_;   // Running flight this (pending) flight waits for
+
+  Flight(uint64_t start,
+         uint64_t end) :
+    start_(start),
+    end_(end),
+    started_(false),
+    done_(false),
+    failed_(false),
+    error_(Orthanc::ErrorCode_InternalError)
+  {
+  }
+
+  bool Contains(uint64_t start,
+                uint64_t end) const
+  {
+    return (start_ <= start &&
+            end <= end_);
+  }
+
+  // Ranges sharing at least one byte
+  bool Overlaps(uint64_t start,
+                uint64_t end) const
+  {
+    return (start < end_ &&
+            start_ < end);
+  }
+};
+
+
+RangeCoalescer::FlightPtr RangeCoalescer::Enter(bool& isLeader,
+                                                const std::string& path,
+                                                uint64_t start,
+                                                uint64_t end)
+{
+  // The mutex must be locked by the caller
+  std::list<FlightPtr>& flights = flights_[path];
+
+  // Identical or included range: Share the result of the flight
+  for (std::list<FlightPtr>::const_iterator it = flights.begin(); it != flights.end(); ++it)
+  {
+    if ((*it)->Contains(start, end))
+    {
+      merged_++;
+      isLeader = false;
+      return *it;
+    }
+  }
+
+  // Overlapping range: Extend a flight that has not started yet. An
+  // adjacent range is not merged, as it would wait for no reason.
+  for (std::list<FlightPtr>::const_iterator it = flights.begin(); it != flights.end(); ++it)
+  {
+    if (!(*it)->started_ &&
+        (*it)->Overlaps(start, end) &&
+        std::max(end, (*it)->end_) - std::min(start, (*it)->start_) <= maximumSize_)
+    {
+      (*it)->start_ = std::min(start, (*it)->start_);
+      (*it)->end_ = std::max(end, (*it)->end_);
+      merged_++;
+      isLeader = false;
+      return *it;
+    }
+  }
+
+  // New flight, that is delayed until the end of a running flight
+  // that overlaps its range, so as to give a chance to the next
+  // requests to be merged into it
+  FlightPtr flight(new Flight(start, end));
+
+  for (std::list<FlightPtr>::const_iterator it = flights.begin(); it != flights.end(); ++it)
+  {
+    if ((*it)->started_ &&
+        (*it)->Overlaps(start, end))
+    {
+      flight->blocker_ = *it;
+      break;
+    }
+  }
+
+  flights.push_back(flight);
+  isLeader = true;
+  return flight;
+}
+
+
+void RangeCoalescer::Execute(const std::string& path,
+                             const FlightPtr& flight)
+{
+  // The range of the flight cannot change anymore, as it has started
+  try
+  {
+    flight->buffer_.resize(flight->end_ - flight->start_);
+    reader_.Read(&flight->buffer_[0], path, flight->start_, flight->end_ - flight->start_);
+  }
+  catch (Orthanc::OrthancException& e)
+  {
+    flight->failed_ = true;
+    flight->error_ = e.GetErrorCode();
+    if (e.HasDetails())
+    {
+      flight->details_ = e.GetDetails();
+    }
+  }
+  catch (...)
+  {
+    flight->failed_ = true;
+    flight->error_ = Orthanc::ErrorCode_InternalError;
+  }
+}
+
+
+RangeCoalescer::RangeCoalescer(IReader& reader,
+                               uint64_t maximumSize) :
+  reader_(reader),
+  maximumSize_(maximumSize),
+  requests_(0),
+  reads_(0),
+  merged_(0)
+{
+}
+
+
+void RangeCoalescer::Read(void* target,
+                          const std::string& path,
+                          uint64_t start,
+                          uint64_t length)
+{
+  if (length == 0 ||
+      length > maximumSize_)
+  {
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      requests_++;
+      reads_++;
+    }
+
+    reader_.Read(target, path, start, length);
+    return;
+  }
+
+  FlightPtr flight;
+
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    requests_++;
+
+    bool isLeader;
+    flight = Enter(isLeader, path, start, start + length);
+
+    if (isLeader)
+    {
+      if (flight->blocker_.get() != NULL)
+      {
+        SlowLog::Stage stage("coalesce-wait");
+        while (!flight->blocker_->done_)
+        {
+          done_.wait(lock);
+        }
+      }
+
+      flight->blocker_.reset();
+      flight->started_ = true;
+      reads_++;
+
+      lock.unlock();
+      Execute(path, flight);
+      lock.lock();
+
+      flight->done_ = true;
+
+      Flights::iterator found = flights_.find(path);
+      if (found != flights_.end())
+      {
+        found->second.remove(flight);
+        if (found->second.empty())
+        {
+          flights_.erase(found);
+        }
+      }
+
+      done_.notify_all();
+    }
+    else
+    {
+      SlowLog::Stage stage("coalesce-wait");
+      while (!flight->done_)
+      {
+        done_.wait(lock);
+      }
+    }
+  }
+
+  // From now on, the flight is immutable
+  if (!flight->failed_)
+  {
+    memcpy(target, flight->buffer_.c_str() + (start - flight->start_), length);
+  }
+  else if (flight->start_ != start ||
+           flight->end_ != start + length)
+  {
+    // The failure might only be due to the range of another request
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      reads_++;
+    }
+
+    reader_.Read(target, path, start, length);
+  }
+  else if (flight->details_.empty())
+  {
+    throw Orthanc::OrthancException(flight->error_);
+  }
+  else
+  {
+    throw Orthanc::OrthancException(flight->error_, flight->details_);
+  }
+}
+
+
+void RangeCoalescer::GetStatistics(uint64_t& requests,
+                                   uint64_t& reads,
+                                   uint64_t& merged)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  requests = requests_;
+  reads = reads_;
+  merged = merged_;
+}
@@ -0,0 +1,97 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <list>
+#include <map>
+#include <stdint.h>
+#include <string>
+
+
+/**
+ * Single-flight layer above the range reads of the storage area. The
+ * concurrent reads of the same range of a file (e.g. several viewers
+ * opening the same slide) wait for one I/O and share its result. The
+ * reads that overlap a running read of the same file are queued
+ * behind it, and merged together into one larger read while they
+ * wait. Adjacent reads never wait. If a merged read fails (e.g. the
+ * file was truncated), each request is retried on its own, so that a
+ * request never fails because of the range of another one.
+ **/
+class RangeCoalescer : public boost::noncopyable
+{
+public:
+  class IReader : public boost::noncopyable
+  {
+  public:
+    virtual ~IReader()
+    {
+    }
+
+    // Must fill exactly "length" bytes, or throw an OrthancException
+    virtual void Read(void* target,
+                      const std::string& path,
+                      uint64_t start,
+                      uint64_t length) = 0;
+  };
+
+private:
+  struct Flight;
+  typedef boost::shared_ptr<Flight>                      FlightPtr;
+  typedef std::map<std::string, std::list<FlightPtr> >   Flights;
+
+  IReader&                   reader_;
+  uint64_t                   maximumSize_;
+  boost::mutex               mutex_;
+  boost::condition_variable  done_;
+  Flights                    flights_;
+  uint64_t                   requests_;
+  uint64_t                   reads_;
+  uint64_t                   merged_;
+
+  FlightPtr Enter(bool& isLeader,
+                  const std::string& path,
+                  uint64_t start,
+                  uint64_t end);
+
+  void Execute(const std::string& path,
+               const FlightPtr& flight);
+
+public:
+  // The ranges larger than "maximumSize" are read directly, and are
+  // never merged into a larger range
+  RangeCoalescer(IReader& reader,
+                 uint64_t maximumSize);
+
+  void Read(void* target,
+            const std::string& path,
+            uint64_t start,
+            uint64_t length);
+
+  // "merged" counts the requests that were served by the read of
+  // another request, "reads" counts the actual I/Os
+  void GetStatistics(uint64_t& requests,
+                     uint64_t& reads,
+                     uint64_t& merged);
+};
@@ -0,0 +1,313 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "ReadCache.h"
+
+#include <OrthancException.h>
+
+#include <boost/functional/hash.hpp>
+#include <cassert>
+
+
+class ReadCache::Shard : public boost::noncopyable
+{
+private:
+  typedef std::list<std::string>  Recency;  // Most recently used first
+
+  struct Entry
+  {
+    std::time_t        time_;
+    Content            content_;
+    Recency::iterator  recency_;
+  };
+
+  typedef std::map<std::string, Entry>  Index;
+
+  boost::mutex  mutex_;
+  uint64_t      budget_;
+  uint64_t      size_;
+  Recency       recency_;
+  Index         content_;
+  uint64_t      hits_;
+  uint64_t      misses_;
+
+  void RemoveInternal(Index::iterator it)
+  {
+    size_ -= it->second.content_->size();
+    recency_.erase(it->second.recency_);
+    content_.erase(it);
+  }
+
+public:
+  explicit Shard(uint64_t budget) :
+    budget_(budget),
+    size_(0),
+    hits_(0),
+    misses_(0)
+  {
+  }
+
+  bool Lookup(Content& content,
+              const std::string& path,
+              const std::time_t time,
+              const uintmax_t size)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Index::iterator found = content_.find(path);
+
+    if (found == content_.end())
+    {
+      misses_++;
+      return false;
+    }
+    else if (found->second.time_ != time ||
+             found->second.content_->size() != size)
+    {
+      // The file has been modified
+      RemoveInternal(found);
+      misses_++;
+      return false;
+    }
+    else
+    {
+      recency_.splice(recency_.begin(), recency_, found->second.recency_);
+      content = found->second.content_;
+      hits_++;
+      return true;
+    }
+  }
+
+  bool Contains(const std::string& path,
+                const std::time_t time,
+                const uintmax_t size)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Index::const_iterator found = content_.find(path);
+    return (found != content_.end() &&
+            found->second.time_ == time &&
+            found->second.content_->size() == size);
+  }
+
+  void Store(const std::string& path,
+             const std::time_t time,
+             const Content& content)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Index::iterator found = content_.find(path);
+    if (found != content_.end())
+    {
+      RemoveInternal(found);
+    }
+
+    if (content->size() <= budget_)
+    {
+      while (size_ + content->size() > budget_)
+      {
+        assert(!recency_.empty());
+        RemoveInternal(content_.find(recency_.back()));
+      }
+
+      recency_.push_front(path);
+
+      Entry& entry = content_[path];
+      entry.time_ = time;
+      entry.content_ = content;
+      entry.recency_ = recency_.begin();
+      size_ += content->size();
+    }
+  }
+
+  void Shrink(uint64_t target)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    while (size_ > target)
+    {
+      assert(!recency_.empty());
+      RemoveInternal(content_.find(recency_.back()));
+    }
+  }
+
+  uint64_t GetSize()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return size_;
+  }
+
+  void Invalidate(const std::string& path)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Index::iterator found = content_.find(path);
+    if (found != content_.end())
+    {
+      RemoveInternal(found);
+    }
+  }
+
+  void GetStatistics(uint64_t& size,
+                     size_t& count,
+                     uint64_t& hits,
+                     uint64_t& misses)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    size = size_;
+    count = content_.size();
+    hits = hits_;
+    misses = misses_;
+  }
+};
+
+
+ReadCache::Shard& ReadCache::GetShard(const std::string& path)
+{
+  boost::hash<std::string> hasher;
+  return *shards_[hasher(path) % shards_.size()];
+}
+
+
+ReadCache::ReadCache(uint64_t budget,
+                     size_t maximumFileSize,
+                     unsigned int shardsCount) :
+  maximumFileSize_(maximumFileSize)
+{
+  if (shardsCount == 0)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+  }
+
+  shards_.resize(shardsCount);
+
+  for (size_t i = 0; i < shardsCount; i++)
+  {
+    shards_[i] = new Shard(budget / shardsCount);
+  }
+}
+
+
+ReadCache::~ReadCache()
+{
+  for (size_t i = 0; i < shards_.size(); i++)
+  {
+    assert(shards_[i] != NULL);
+    delete shards_[i];
+  }
+}
+
+
+bool ReadCache::Lookup(Content& content,
+                       const std::string& path,
+                       const std::time_t time,
+                       const uintmax_t size)
+{
+  return (IsCacheable(size) &&
+          GetShard(path).Lookup(content, path, time, size));
+}
+
+
+bool ReadCache::Contains(const std::string& path,
+                         const std::time_t time,
+                         const uintmax_t size)
+{
+  return (IsCacheable(size) &&
+          GetShard(path).Contains(path, time, size));
+}
+
+
+void ReadCache::Store(const std::string& path,
+                      const std::time_t time,
+                      const void* data,
+                      size_t size)
+{
+  if (IsCacheable(size))
+  {
+    Content content(new std::string(reinterpret_cast<const char*>(data), size));
+    GetShard(path).Store(path, time, content);
+  }
+}
+
+
+void ReadCache::Store(const std::string& path,
+                      const std::time_t time,
+                      const Content& content)
+{
+  if (content.get() == NULL)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_NullPointer);
+  }
+  else if (IsCacheable(content->size()))
+  {
+    GetShard(path).Store(path, time, content);
+  }
+}
+
+
+void ReadCache::Invalidate(const std::string& path)
+{
+  GetShard(path).Invalidate(path);
+}
+
+
+void ReadCache::GetStatistics(uint64_t& size,
+                              size_t& count,
+                              uint64_t& hits,
+                              uint64_t& misses)
+{
+  size = 0;
+  count = 0;
+  hits = 0;
+  misses = 0;
+
+  for (size_t i = 0; i < shards_.size(); i++)
+  {
+    uint64_t shardSize, shardHits, shardMisses;
+    size_t shardCount;
+    shards_[i]->GetStatistics(shardSize, shardCount, shardHits, shardMisses);
+
+    size += shardSize;
+    count += shardCount;
+    hits += shardHits;
+    misses += shardMisses;
+  }
+}
+
+
+uint64_t ReadCache::GetMemoryUsage()
+{
+  uint64_t size = 0;
+
+  for (size_t i = 0; i < shards_.size(); i++)
+  {
+    size += shards_[i]->GetSize();
+  }
+
+  return size;
+}
+
+
+void ReadCache::ShrinkMemory(uint64_t target)
+{
+  for (size_t i = 0; i < shards_.size(); i++)
+  {
+    shards_[i]->Shrink(target / shards_.size());
+  }
+}
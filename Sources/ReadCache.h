@@ -0,0 +1,98 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include "MemoryBudget.h"
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <ctime>
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+
+/**
+ * In-memory LRU cache of the content of small files, whose total size
+ * is bounded by a byte budget. An entry is only valid as long as the
+ * modification time and the size of the file are unchanged. The cache
+ * is split into shards, each with its own mutex and its own share of
+ * the budget, to avoid contention between the threads of Orthanc.
+ **/
+class ReadCache : public MemoryBudget::IConsumer
+{
+public:
+  typedef boost::shared_ptr<const std::string>  Content;
+
+private:
+  class Shard;
+
+  std::vector<Shard*>  shards_;
+  size_t               maximumFileSize_;
+
+  Shard& GetShard(const std::string& path);
+
+public:
+  ReadCache(uint64_t budget,
+            size_t maximumFileSize,
+            unsigned int shardsCount);
+
+  ~ReadCache();
+
+  bool IsCacheable(uintmax_t size) const
+  {
+    return size <= maximumFileSize_;
+  }
+
+  // The returned content stays valid even if evicted in the meantime
+  bool Lookup(Content& content,
+              const std::string& path,
+              const std::time_t time,
+              const uintmax_t size);
+
+  // Neither updates the recency, nor the statistics
+  bool Contains(const std::string& path,
+                const std::time_t time,
+                const uintmax_t size);
+
+  void Store(const std::string& path,
+             const std::time_t time,
+             const void* data,
+             size_t size);
+
+  // Takes ownership of the content, without copying it
+  void Store(const std::string& path,
+             const std::time_t time,
+             const Content& content);
+
+  void Invalidate(const std::string& path);
+
+  void GetStatistics(uint64_t& size,
+                     size_t& count,
+                     uint64_t& hits,
+                     uint64_t& misses);
+
+  // Only accounts for the content of the files
+  virtual uint64_t GetMemoryUsage() ORTHANC_OVERRIDE;
+
+  // Evicts the least recently used files of each shard
+  virtual void ShrinkMemory(uint64_t target) ORTHANC_OVERRIDE;
+};
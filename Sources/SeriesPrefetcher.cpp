@@ -0,0 +1,381 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "SeriesPrefetcher.h"
+
+#include <Logging.h>
+#include <OrthancException.h>
+#include <SystemToolbox.h>
+
+#include <boost/filesystem.hpp>
+
+#if defined(__linux__)
+#  include <fcntl.h>
+#  include <unistd.h>
+#endif
+
+
+void SeriesPrefetcher::ExpandRead(const std::string& path)
+{
+  std::string series;
+  if (!database_.LookupSeries(series, path))
+  {
+    return;
+  }
+
+  const boost::posix_time::ptime now = boost::posix_time::second_clock::universal_time();
+
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    SeriesAccesses::iterator found = accesses_.find(series);
+    if (found != accesses_.end() &&
+        found->second + timeout_ > now)
+    {
+      // The series is already being prefetched, keep it alive
+      found->second = now;
+      return;
+    }
+
+    accesses_[series] = now;
+
+    // Forget about the series that are not read anymore
+    for (SeriesAccesses::iterator it = accesses_.begin(); it != accesses_.end(); )
+    {
+      if (it->second + timeout_ <= now)
+      {
+        accesses_.erase(it++);
+      }
+      else
+      {
+        ++it;
+      }
+    }
+  }
+
+  std::list<std::string> siblings;
+  database_.ListSeriesFiles(siblings, series, maximumQueueSize_);
+
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    // The most recently opened series goes first, and the oldest
+    // series are dropped if the queue is full
+    std::deque<Task>::iterator position = tasks_.begin();
+
+    for (std::list<std::string>::const_iterator it = siblings.begin(); it != siblings.end(); ++it)
+    {
+      if (*it != path)
+      {
+        Task task;
+        task.series_ = series;
+        task.path_ = *it;
+        position = tasks_.insert(position, task) + 1;
+      }
+    }
+
+    while (tasks_.size() > maximumQueueSize_)
+    {
+      tasks_.pop_back();
+      cancelled_++;
+    }
+  }
+
+  condition_.notify_all();
+}
+
+
+void SeriesPrefetcher::Prefetch(const std::string& path)
+{
+  // The lock of the read cache, on which the storage callbacks wait,
+  // is only taken outside of the filesystem sections
+  std::time_t time;
+  uintmax_t size;
+
+  try
+  {
+    ThreadPriority::FilesystemSection section(priority_);
+    time = boost::filesystem::last_write_time(path);
+    size = boost::filesystem::file_size(path);
+  }
+  catch (boost::filesystem::filesystem_error&)
+  {
+    return;  // The file has been removed in the meantime
+  }
+
+  if (readCache_ != NULL &&
+      readCache_->IsCacheable(size))
+  {
+    if (!readCache_->Contains(path, time, size))
+    {
+      // The file is read once, directly into the buffer of the cache
+      boost::shared_ptr<std::string> content(new std::string);
+
+      {
+        ThreadPriority::FilesystemSection section(priority_);
+        Orthanc::SystemToolbox::ReadFile(*content, path);
+      }
+
+      if (content->size() == size)
+      {
+        readCache_->Store(path, time, content);
+      }
+    }
+  }
+  else
+  {
+#if defined(__linux__)
+    ThreadPriority::FilesystemSection section(priority_);
+
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd != -1)
+    {
+      posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+      close(fd);
+    }
+#endif
+  }
+}
+
+
+void SeriesPrefetcher::Worker(SeriesPrefetcher* that,
+                              ThreadPriority::Level priority)
+{
+  ThreadPriority::ApplyToCurrentThread(priority);
+
+  for (;;)
+  {
+    {
+      boost::mutex::scoped_lock lock(that->mutex_);
+
+      while (!that->stop_ &&
+             that->reads_.empty() &&
+             that->tasks_.empty())
+      {
+        that->condition_.wait(lock);
+      }
+
+      if (that->stop_)
+      {
+        return;
+      }
+    }
+
+    try
+    {
+      that->Step();
+    }
+    catch (Orthanc::OrthancException& e)
+    {
+      LOG(INFO) << "Error while prefetching a series: " << e.What();
+    }
+  }
+}
+
+
+SeriesPrefetcher::SeriesPrefetcher(IndexerDatabase& database,
+                                   ReadCache* readCache,
+                                   size_t maximumQueueSize,
+                                   unsigned int timeout) :
+  database_(database),
+  readCache_(readCache),
+  maximumQueueSize_(maximumQueueSize),
+  timeout_(timeout),
+  stop_(false),
+  priority_(ThreadPriority::Level_Normal),
+  prefetched_(0),
+  cancelled_(0)
+{
+  if (maximumQueueSize == 0 ||
+      timeout == 0)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+  }
+}
+
+
+SeriesPrefetcher::~SeriesPrefetcher()
+{
+  Stop();
+}
+
+
+void SeriesPrefetcher::Start(unsigned int threadsCount,
+                             ThreadPriority::Level priority)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  if (!workers_.empty())
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+  }
+
+  stop_ = false;
+  priority_ = priority;
+
+  for (unsigned int i = 0; i < threadsCount; i++)
+  {
+    workers_.push_back(new boost::thread(Worker, this, priority));
+  }
+}
+
+
+void SeriesPrefetcher::Stop()
+{
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    stop_ = true;
+  }
+
+  condition_.notify_all();
+
+  for (size_t i = 0; i < workers_.size(); i++)
+  {
+    if (workers_[i]->joinable())
+    {
+      workers_[i]->join();
+    }
+
+    delete workers_[i];
+  }
+
+  workers_.clear();
+}
+
+
+void SeriesPrefetcher::NotifyRead(const std::string& path)
+{
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    // The reads are only expanded into tasks by the workers, as this
+    // requires accessing the database
+    if (reads_.size() >= maximumQueueSize_)
+    {
+      return;
+    }
+
+    reads_.push_back(path);
+  }
+
+  condition_.notify_one();
+}
+
+
+bool SeriesPrefetcher::Step()
+{
+  bool isRead = false;
+  std::string read;
+  Task task;
+
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (!reads_.empty())
+    {
+      // Reads have priority, to cancel the series that are not read anymore
+      isRead = true;
+      read = reads_.front();
+      reads_.pop_front();
+    }
+    else if (!tasks_.empty())
+    {
+      task = tasks_.front();
+      tasks_.pop_front();
+
+      SeriesAccesses::const_iterator found = accesses_.find(task.series_);
+      if (found == accesses_.end() ||
+          found->second + timeout_ <= boost::posix_time::second_clock::universal_time())
+      {
+        cancelled_++;
+        return true;
+      }
+    }
+    else
+    {
+      return false;
+    }
+  }
+
+  if (isRead)
+  {
+    ExpandRead(read);
+  }
+  else
+  {
+    Prefetch(task.path_);
+
+    boost::mutex::scoped_lock lock(mutex_);
+    prefetched_++;
+  }
+
+  return true;
+}
+
+
+void SeriesPrefetcher::GetStatistics(size_t& queueSize,
+                                     uint64_t& prefetched,
+                                     uint64_t& cancelled)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  queueSize = tasks_.size();
+  prefetched = prefetched_;
+  cancelled = cancelled_;
+}
+
+
+uint64_t SeriesPrefetcher::GetMemoryUsageInternal() const
+{
+  uint64_t usage = 0;
+
+  for (std::deque<std::string>::const_iterator it = reads_.begin(); it != reads_.end(); ++it)
+  {
+    usage += sizeof(std::string) + it->size();
+  }
+
+  for (std::deque<Task>::const_iterator it = tasks_.begin(); it != tasks_.end(); ++it)
+  {
+    usage += sizeof(Task) + it->series_.size() + it->path_.size();
+  }
+
+  return usage;
+}
+
+
+uint64_t SeriesPrefetcher::GetMemoryUsage()
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  return GetMemoryUsageInternal();
+}
+
+
+void SeriesPrefetcher::ShrinkMemory(uint64_t target)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  uint64_t usage = GetMemoryUsageInternal();
+
+  while (usage > target &&
+         !tasks_.empty())
+  {
+    usage -= sizeof(Task) + tasks_.back().series_.size() + tasks_.back().path_.size();
+    tasks_.pop_back();
+    cancelled_++;
+  }
+}
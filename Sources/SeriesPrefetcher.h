@@ -0,0 +1,108 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include "IndexerDatabase.h"
+#include "MemoryBudget.h"
+#include "ReadCache.h"
+#include "ThreadPriority.h"
+
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/thread.hpp>
+#include <deque>
+#include <map>
+#include <vector>
+
+
+/**
+ * Asynchronous prefetching of the sibling files of a series, once one
+ * of its instances has been read. The files are loaded into the read
+ * cache if they are small enough, or announced to the page cache of
+ * the operating system otherwise. The queue is bounded: Its oldest
+ * files are dropped in favor of the most recently opened series, and
+ * the files of a series that has not been read for "timeout" seconds
+ * are not prefetched anymore.
+ **/
+class SeriesPrefetcher : public MemoryBudget::IConsumer
+{
+private:
+  struct Task
+  {
+    std::string  series_;
+    std::string  path_;
+  };
+
+  typedef std::map<std::string, boost::posix_time::ptime>  SeriesAccesses;
+
+  IndexerDatabase&               database_;
+  ReadCache*                     readCache_;
+  size_t                         maximumQueueSize_;
+  boost::posix_time::seconds     timeout_;
+  boost::mutex                   mutex_;
+  boost::condition_variable      condition_;
+  std::deque<std::string>        reads_;
+  std::deque<Task>               tasks_;
+  SeriesAccesses                 accesses_;
+  bool                           stop_;
+  std::vector<boost::thread*>    workers_;
+  ThreadPriority::Level          priority_;  // Of the workers
+  uint64_t                       prefetched_;
+  uint64_t                       cancelled_;
+
+  void ExpandRead(const std::string& path);
+
+  void Prefetch(const std::string& path);
+
+  uint64_t GetMemoryUsageInternal() const;
+
+  static void Worker(SeriesPrefetcher* that,
+                     ThreadPriority::Level priority);
+
+public:
+  // "readCache" can be NULL, in which case only the page cache is used
+  SeriesPrefetcher(IndexerDatabase& database,
+                   ReadCache* readCache,
+                   size_t maximumQueueSize,
+                   unsigned int timeout);
+
+  ~SeriesPrefetcher();
+
+  void Start(unsigned int threadsCount,
+             ThreadPriority::Level priority);
+
+  void Stop();
+
+  // Cheap, to be called from the storage area callbacks
+  void NotifyRead(const std::string& path);
+
+  // Processes one pending read or prefetch, without blocking. Returns
+  // "false" iff. there was nothing to do.
+  bool Step();
+
+  void GetStatistics(size_t& queueSize,
+                     uint64_t& prefetched,
+                     uint64_t& cancelled);
+
+  virtual uint64_t GetMemoryUsage() ORTHANC_OVERRIDE;
+
+  // Cancels the prefetching of the oldest series
+  virtual void ShrinkMemory(uint64_t target) ORTHANC_OVERRIDE;
+};
@@ -0,0 +1,233 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "SlowLog.h"
+
+#include <Logging.h>
+#include <OrthancException.h>
+
+#include <boost/lexical_cast.hpp>
+#include <boost/thread/tss.hpp>
+#include <string.h>
+
+
+static void KeepOperation(SlowLog::Operation* /* operation */)
+{
+  // The operations are owned by the stack of their thread
+}
+
+
+// Operation that is running in the current thread, NULL if none
+static boost::thread_specific_ptr<SlowLog::Operation> current_(KeepOperation);
+
+static const char* const OTHER_STAGE = "other";
+
+
+static uint64_t GetMicroseconds(const boost::posix_time::time_duration& duration)
+{
+  // Zero if the clock was set back in the meantime
+  return (duration.is_negative() ? 0 : static_cast<uint64_t>(duration.total_microseconds()));
+}
+
+
+void SlowLog::Operation::Switch(const char* stage)
+{
+  const boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+  const uint64_t elapsed = GetMicroseconds(now - last_);
+  last_ = now;
+
+  size_t i = 0;
+  while (i < bucketsCount_ &&
+         strcmp(buckets_[i].stage_, stage_) != 0)
+  {
+    i++;
+  }
+
+  if (i == bucketsCount_)
+  {
+    if (bucketsCount_ < MAX_BUCKETS)
+    {
+      buckets_[i].stage_ = stage_;
+      buckets_[i].duration_ = 0;
+      bucketsCount_++;
+    }
+    else
+    {
+      i = 0;  // Too many stages, the first bucket is "other"
+    }
+  }
+
+  buckets_[i].duration_ += elapsed;
+  stage_ = stage;
+}
+
+
+SlowLog::Operation::Operation(SlowLog* log,
+                              const char* name,
+                              const char* detail) :
+  log_(log),
+  name_(name),
+  detail_(detail),
+  outer_(NULL),
+  stage_(OTHER_STAGE),
+  bucketsCount_(0)
+{
+  if (log_ != NULL)
+  {
+    outer_ = current_.get();
+    current_.reset(this);
+    start_ = boost::posix_time::microsec_clock::universal_time();
+    last_ = start_;
+  }
+}
+
+
+SlowLog::Operation::~Operation()
+{
+  if (log_ != NULL)
+  {
+    Switch(OTHER_STAGE);
+    current_.reset(outer_);
+
+    const uint64_t duration = GetMicroseconds(last_ - start_);
+    if (duration >= log_->threshold_)
+    {
+      try
+      {
+        log_->Record(*this, duration);
+      }
+      catch (...)
+      {
+        // Never throw from a destructor
+      }
+    }
+  }
+}
+
+
+SlowLog::Stage::Stage(const char* stage) :
+  operation_(current_.get()),
+  previous_(NULL)
+{
+  if (operation_ != NULL)
+  {
+    previous_ = operation_->stage_;
+    operation_->Switch(stage);
+  }
+}
+
+
+SlowLog::Stage::~Stage()
+{
+  if (operation_ != NULL)
+  {
+    operation_->Switch(previous_);
+  }
+}
+
+
+void SlowLog::Stage::Rename(const char* stage)
+{
+  if (operation_ != NULL)
+  {
+    operation_->Switch(stage);
+  }
+}
+
+
+void SlowLog::Record(const Operation& operation,
+                     uint64_t duration)
+{
+  Entry entry;
+  entry.name_ = operation.name_;
+  entry.detail_ = (operation.detail_ == NULL ? "" : operation.detail_);
+  entry.end_ = boost::posix_time::microsec_clock::universal_time();
+  entry.duration_ = duration;
+
+  std::string breakdown;
+  for (size_t i = 0; i < operation.bucketsCount_; i++)
+  {
+    if (operation.buckets_[i].duration_ != 0)
+    {
+      entry.stages_.push_back(std::make_pair(std::string(operation.buckets_[i].stage_),
+                                             operation.buckets_[i].duration_));
+      breakdown += (" " + std::string(operation.buckets_[i].stage_) + "=" +
+                    boost::lexical_cast<std::string>(operation.buckets_[i].duration_ / 1000) + "ms");
+    }
+  }
+
+  LOG(WARNING) << "Slow operation in the Indexer plugin (" << (duration / 1000) << "ms): "
+               << entry.name_ << (entry.detail_.empty() ? "" : " " + entry.detail_) << ":" << breakdown;
+
+  boost::mutex::scoped_lock lock(mutex_);
+
+  slowCount_++;
+  entries_.push_front(entry);
+  if (entries_.size() > capacity_)
+  {
+    entries_.pop_back();
+  }
+}
+
+
+SlowLog::SlowLog(unsigned int threshold,
+                 size_t capacity) :
+  threshold_(static_cast<uint64_t>(threshold) * 1000),
+  capacity_(capacity),
+  slowCount_(0)
+{
+  if (threshold == 0 ||
+      capacity == 0)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+  }
+}
+
+
+uint64_t SlowLog::GetSlowCount()
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  return slowCount_;
+}
+
+
+void SlowLog::Format(Json::Value& target)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  target = Json::arrayValue;
+
+  for (std::deque<Entry>::const_iterator it = entries_.begin(); it != entries_.end(); ++it)
+  {
+    Json::Value item = Json::objectValue;
+    item["Operation"] = it->name_;
+    item["Detail"] = it->detail_;
+    item["End"] = boost::posix_time::to_iso_string(it->end_);
+    item["Duration"] = static_cast<double>(it->duration_) / 1000.0;
+
+    Json::Value stages = Json::objectValue;
+    for (size_t i = 0; i < it->stages_.size(); i++)
+    {
+      stages[it->stages_[i].first] = static_cast<double>(it->stages_[i].second) / 1000.0;
+    }
+
+    item["Stages"] = stages;
+    target.append(item);
+  }
+}
@@ -0,0 +1,132 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <deque>
+#include <json/value.h>
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+
+/**
+ * Bounded log of the operations (storage callbacks, identification
+ * of the crawled files...) that last longer than a threshold, with
+ * the breakdown of their duration by stage (lock wait, SQLite, stat,
+ * mmap, REST...). An operation only reads the clock when it enters
+ * or leaves a stage, and nothing is allocated unless it is slow. The
+ * stages are attached to the operation that is running in the
+ * current thread, so that the lower layers can declare their stages
+ * without knowing about the operation.
+ **/
+class SlowLog : public boost::noncopyable
+{
+public:
+  class Operation : public boost::noncopyable
+  {
+  private:
+    friend class SlowLog;
+
+    struct Bucket
+    {
+      const char*  stage_;
+      uint64_t     duration_;  // In microseconds
+    };
+
+    enum
+    {
+      MAX_BUCKETS = 16
+    };
+
+    SlowLog*                  log_;
+    const char*               name_;
+    const char*               detail_;
+    Operation*                outer_;
+    boost::posix_time::ptime  start_;
+    boost::posix_time::ptime  last_;
+    const char*               stage_;
+    Bucket                    buckets_[MAX_BUCKETS];
+    size_t                    bucketsCount_;
+
+    void Switch(const char* stage);
+
+  public:
+    // Does nothing if "log" is NULL. The "name" and the "detail"
+    // (e.g. a path) must outlive the operation.
+    Operation(SlowLog* log,
+              const char* name,
+              const char* detail);
+
+    ~Operation();
+  };
+
+  // Accounts the time spent in its scope to "stage", in the operation
+  // of the current thread, if any. The stages can be nested, the time
+  // of an inner stage is not accounted to the outer stage.
+  class Stage : public boost::noncopyable
+  {
+  private:
+    Operation*   operation_;
+    const char*  previous_;
+
+  public:
+    explicit Stage(const char* stage);
+
+    ~Stage();
+
+    // Accounts the rest of the scope to another stage (e.g. from
+    // waiting for a lock, to using the locked resource)
+    void Rename(const char* stage);
+  };
+
+private:
+  struct Entry
+  {
+    std::string                                     name_;
+    std::string                                     detail_;
+    boost::posix_time::ptime                        end_;
+    uint64_t                                        duration_;
+    std::vector<std::pair<std::string, uint64_t> >  stages_;
+  };
+
+  boost::mutex       mutex_;
+  uint64_t           threshold_;  // In microseconds
+  size_t             capacity_;
+  std::deque<Entry>  entries_;
+  uint64_t           slowCount_;
+
+  void Record(const Operation& operation,
+              uint64_t duration);
+
+public:
+  // "threshold" is in milliseconds, only the "capacity" most recent
+  // slow operations are kept
+  SlowLog(unsigned int threshold,
+          size_t capacity);
+
+  uint64_t GetSlowCount();
+
+  // The most recent operations come first, durations are in milliseconds
+  void Format(Json::Value& target);
+};
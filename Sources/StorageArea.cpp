@@ -19,6 +19,7 @@
 
 #include "StorageArea.h"
 #include "FileMemoryMap.h"
+#include "SlowLog.h"
 
 #include "../Resources/Orthanc/Plugins/OrthancPluginCppWrapper.h"
 
@@ -27,6 +28,234 @@
 #include <OrthancException.h>
 
 #include <boost/filesystem.hpp>
+#include <algorithm>
+#include <string.h>
+
+#if defined(__linux__)
+#  include <errno.h>
+#  include <fcntl.h>
+#  include <stdlib.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#endif
+
+
+uint64_t                            StorageArea::directReadThreshold_ = 0;
+std::list<boost::filesystem::path>  StorageArea::coldFolders_;
+
+
+#if defined(__linux__)
+static const size_t DIRECT_ALIGNMENT = 4096;  // Largest logical block size of the usual devices
+static const size_t DIRECT_BUFFER_SIZE = 4 * 1024 * 1024;  // Maximum size of one "pread()"
+
+namespace
+{
+  class FileDescriptor : public boost::noncopyable
+  {
+  private:
+    int  fd_;
+
+  public:
+    explicit FileDescriptor(int fd) :
+      fd_(fd)
+    {
+    }
+
+    ~FileDescriptor()
+    {
+      if (fd_ >= 0)
+      {
+        close(fd_);
+      }
+    }
+
+    int Get() const
+    {
+      return fd_;
+    }
+  };
+
+  class AlignedBuffer : public boost::noncopyable
+  {
+  private:
+    void*   data_;
+    size_t  size_;
+
+  public:
+    explicit AlignedBuffer(size_t size) :
+      size_(size)
+    {
+      if (posix_memalign(&data_, DIRECT_ALIGNMENT, size) != 0)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_NotEnoughMemory);
+      }
+    }
+
+    ~AlignedBuffer()
+    {
+      free(data_);
+    }
+
+    char* Get()
+    {
+      return reinterpret_cast<char*>(data_);
+    }
+
+    size_t GetSize() const
+    {
+      return size_;
+    }
+  };
+}
+
+
+static uint64_t AlignUp(uint64_t size)
+{
+  return (size + DIRECT_ALIGNMENT - 1) / DIRECT_ALIGNMENT * DIRECT_ALIGNMENT;
+}
+
+
+// Opens the file with O_DIRECT if the filesystem supports it
+static int OpenDirect(bool& isDirect,
+                      const std::string& path)
+{
+  int fd = open(path.c_str(), O_RDONLY | O_DIRECT | O_CLOEXEC);
+
+  if (fd < 0 &&
+      errno == EINVAL)
+  {
+    fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    isDirect = false;
+  }
+  else
+  {
+    isDirect = true;
+  }
+
+  if (fd < 0)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_InexistentFile);
+  }
+
+  return fd;
+}
+
+
+// O_DIRECT requires the offsets, the sizes and the memory to be
+// aligned, hence the aligned reads through a bounce buffer, whose
+// useful part is copied into "target". The reads are bounded by the
+// aligned end of the range, so that a small range only reads (and
+// allocates) the few blocks it spans.
+static void ReadDirect(char* target,
+                       int fd,
+                       bool isDirect,
+                       uint64_t offset,
+                       uint64_t length)
+{
+  const uint64_t end = offset + length;
+  uint64_t position = offset - offset % DIRECT_ALIGNMENT;
+
+  AlignedBuffer buffer(static_cast<size_t>(std::min(static_cast<uint64_t>(DIRECT_BUFFER_SIZE),
+                                                    AlignUp(end - position))));
+
+  while (position < end)
+  {
+    const size_t size = static_cast<size_t>(std::min(static_cast<uint64_t>(buffer.GetSize()),
+                                                     AlignUp(end - position)));
+    const ssize_t count = pread(fd, buffer.Get(), size, position);
+
+    if (count < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      else if (errno == EINVAL &&
+               isDirect)
+      {
+        // The device has a larger logical block: Use the page cache,
+        // whose pages are dropped at the end
+        const int flags = fcntl(fd, F_GETFL);
+        if (flags < 0 ||
+            fcntl(fd, F_SETFL, flags & ~O_DIRECT) < 0)
+        {
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+        }
+
+        isDirect = false;
+        continue;
+      }
+      else
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_InexistentFile);
+      }
+    }
+    else if (count == 0)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_CorruptedFile);  // Truncated file
+    }
+
+    const uint64_t from = std::max(position, offset);
+    const uint64_t to = std::min(position + static_cast<uint64_t>(count), end);
+
+    if (from < to)
+    {
+      memcpy(target + (from - offset), buffer.Get() + (from - position), to - from);
+    }
+
+    position += count;
+  }
+
+  if (!isDirect)
+  {
+    posix_fadvise(fd, offset, length, POSIX_FADV_DONTNEED);
+  }
+}
+#endif
+
+
+bool StorageArea::IsDirectRead(const std::string& path,
+                               uint64_t length)
+{
+#if defined(__linux__)
+  if (directReadThreshold_ != 0 &&
+      length >= directReadThreshold_)
+  {
+    return true;
+  }
+
+  if (!coldFolders_.empty())
+  {
+    const boost::filesystem::path file = boost::filesystem::absolute(path).lexically_normal();
+
+    for (std::list<boost::filesystem::path>::const_iterator it = coldFolders_.begin(); it != coldFolders_.end(); ++it)
+    {
+      const boost::filesystem::path relative = file.lexically_relative(*it);
+      if (!relative.empty() &&
+          *relative.begin() != "..")
+      {
+        return true;
+      }
+    }
+  }
+#endif
+
+  return false;
+}
+
+
+void StorageArea::ConfigureDirectReads(uint64_t threshold,
+                                       const std::list<std::string>& coldFolders)
+{
+  directReadThreshold_ = threshold;
+  coldFolders_.clear();
+
+  for (std::list<std::string>::const_iterator it = coldFolders.begin(); it != coldFolders.end(); ++it)
+  {
+    coldFolders_.push_back(boost::filesystem::absolute(*it).lexically_normal());
+  }
+}
+
 
 
 static boost::filesystem::path GetPathInternal(const std::string& root,
@@ -51,10 +280,12 @@ static boost::filesystem::path GetPathInternal(const std::string& root,
 }
 
 
-static void CreateOrthancBuffer(OrthancPluginMemoryBuffer64 *target,
-                                const char *data,
-                                uintmax_t length)
+void StorageArea::CreateOrthancBuffer(OrthancPluginMemoryBuffer64 *target,
+                                      const char *data,
+                                      uintmax_t length)
 {
+  SlowLog::Stage stage("copy");
+
   OrthancPluginErrorCode code = OrthancPluginCreateMemoryBuffer64(
     OrthancPlugins::GetGlobalContext(), target, length);
 
@@ -77,6 +308,58 @@ static void CreateOrthancBuffer(OrthancPluginMemoryBuffer64 *target,
 void StorageArea::ReadWholeFromPath(OrthancPluginMemoryBuffer64 *target,
                                     const std::string& path)
 {
+#if defined(__linux__)
+  struct stat info;
+  bool direct = false;
+
+  if (directReadThreshold_ != 0 ||
+      !coldFolders_.empty())
+  {
+    SlowLog::Stage stage("stat");
+    direct = (stat(path.c_str(), &info) == 0 &&
+              IsDirectRead(path, static_cast<uint64_t>(info.st_size)));
+  }
+
+  if (direct)
+  {
+    SlowLog::Stage stage("read");
+
+    bool isDirect;
+    FileDescriptor fd(OpenDirect(isDirect, path));
+
+    if (fstat(fd.Get(), &info) != 0)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InexistentFile);
+    }
+
+    const uint64_t size = static_cast<uint64_t>(info.st_size);
+
+    OrthancPluginErrorCode code = OrthancPluginCreateMemoryBuffer64(
+      OrthancPlugins::GetGlobalContext(), target, size);
+
+    if (code != OrthancPluginErrorCode_Success)
+    {
+      throw Orthanc::OrthancException(static_cast<Orthanc::ErrorCode>(code));
+    }
+
+    try
+    {
+      if (size != 0)
+      {
+        ReadDirect(reinterpret_cast<char*>(target->data), fd.Get(), isDirect, 0, size);
+      }
+    }
+    catch (Orthanc::OrthancException&)
+    {
+      OrthancPluginFreeMemoryBuffer64(OrthancPlugins::GetGlobalContext(), target);
+      throw;
+    }
+
+    return;
+  }
+#endif
+
+  SlowLog::Stage stage("mmap");
   FileMemoryMap reader = FileMemoryMap(path);
   CreateOrthancBuffer(target, reader.data(), reader.length());
 }   
@@ -86,6 +369,20 @@ void StorageArea::ReadRangeFromPath(OrthancPluginMemoryBuffer64 *target,
                                     const std::string& path,
                                     uint64_t rangeStart)
 {
+#if defined(__linux__)
+  if (target->size != 0 &&
+      IsDirectRead(path, target->size))
+  {
+    SlowLog::Stage stage("read");
+
+    bool isDirect;
+    FileDescriptor fd(OpenDirect(isDirect, path));
+    ReadDirect(reinterpret_cast<char*>(target->data), fd.Get(), isDirect, rangeStart, target->size);
+    return;
+  }
+#endif
+
+  SlowLog::Stage stage("mmap");
   FileMemoryMap reader = FileMemoryMap(path, rangeStart, target->size);
   if (reader.length() != target->size)
   {
@@ -93,6 +390,8 @@ void StorageArea::ReadRangeFromPath(OrthancPluginMemoryBuffer64 *target,
   }
   else if (reader.length() != 0)
   {
+    // The pages of the file are faulted in during the copy
+    stage.Rename("copy");
     memcpy(target->data, reader.data(), reader.length());
   }
 }
@@ -132,6 +431,7 @@ __builtin_printf("storagearea::create %s\n", path.string().c_str());
     }
   }
       
+  SlowLog::Stage stage("write");
   Orthanc::SystemToolbox::WriteFile(content, size, path.string(), false);
 }
   
@@ -23,14 +23,32 @@
 
 #include <boost/noncopyable.hpp>
 #include <boost/filesystem.hpp>
+#include <list>
 #include <string>
 
 class StorageArea : public boost::noncopyable
 {
 private:
+  static uint64_t                                directReadThreshold_;
+  static std::list<boost::filesystem::path>      coldFolders_;
+
   std::string  root_;
 
+  static bool IsDirectRead(const std::string& path,
+                           uint64_t length);
+
 public:
+  // The reads of at least "threshold" bytes (0 means never), and all
+  // the reads of the files below the "coldFolders", use O_DIRECT so
+  // that they don't evict the hot files from the page cache. To be
+  // called before the storage area is registered.
+  static void ConfigureDirectReads(uint64_t threshold,
+                                   const std::list<std::string>& coldFolders);
+
+  static void CreateOrthancBuffer(OrthancPluginMemoryBuffer64 *target,
+                                  const char *data,
+                                  uintmax_t length);
+
   static void ReadWholeFromPath(OrthancPluginMemoryBuffer64 *target,
                                 const std::string& path);  
 
@@ -0,0 +1,96 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "StorageCommitmentScp.h"
+
+#include <Logging.h>
+#include <OrthancException.h>
+
+#include <boost/filesystem.hpp>
+
+
+bool StorageCommitmentScp::LookupInOrthanc(const std::string& sopInstanceUid)
+{
+  Json::Value answer;
+  if (OrthancPlugins::RestApiPost(answer, "/tools/lookup", sopInstanceUid, false) &&
+      answer.type() == Json::arrayValue)
+  {
+    for (Json::Value::ArrayIndex i = 0; i < answer.size(); i++)
+    {
+      if (answer[i].isMember("Type") &&
+          answer[i]["Type"].asString() == "Instance")
+      {
+        return true;
+      }
+    }
+  }
+
+  return false;
+}
+
+
+StorageCommitmentScp::StorageCommitmentScp(IndexerDatabase& database,
+                                           const char* const* sopInstanceUids,
+                                           uint32_t countInstances)
+{
+  if (countInstances != 0 &&
+      sopInstanceUids == NULL)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_NullPointer);
+  }
+
+  std::set<std::string> uids;
+  for (uint32_t i = 0; i < countInstances; i++)
+  {
+    uids.insert(sopInstanceUids[i]);
+  }
+
+  database.LookupSopInstances(files_, uids);
+
+  LOG(INFO) << "Indexer plugin has found " << files_.size() << " out of " << uids.size()
+            << " SOP instances of a storage commitment request in its index";
+}
+
+
+// The SOP class is not checked, as it is not indexed
+OrthancPluginStorageCommitmentFailureReason StorageCommitmentScp::Lookup(const std::string& /* sopClassUid */,
+                                                                         const std::string& sopInstanceUid)
+{
+  IndexedFiles::const_iterator found = files_.find(sopInstanceUid);
+
+  if (found == files_.end())
+  {
+    return (LookupInOrthanc(sopInstanceUid) ?
+            OrthancPluginStorageCommitmentFailureReason_Success :
+            OrthancPluginStorageCommitmentFailureReason_NoSuchObjectInstance);
+  }
+
+  for (std::list<std::string>::const_iterator it = found->second.begin(); it != found->second.end(); ++it)
+  {
+    boost::system::error_code error;
+    if (boost::filesystem::is_regular_file(*it, error))
+    {
+      return OrthancPluginStorageCommitmentFailureReason_Success;
+    }
+  }
+
+  LOG(WARNING) << "Indexer plugin cannot commit SOP instance " << sopInstanceUid
+               << ", as none of its files is available anymore";
+  return OrthancPluginStorageCommitmentFailureReason_NoSuchObjectInstance;
+}
@@ -0,0 +1,53 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include "IndexerDatabase.h"
+
+#include "../Resources/Orthanc/Plugins/OrthancPluginCppWrapper.h"
+
+
+/**
+ * Handler of one storage commitment request, whose SOP instances are
+ * all looked up in the index of the plugin when the request is
+ * received, instead of one at a time in the database of
+ * Orthanc. Committed instances must still have one of their files on
+ * the disk. The instances that are unknown to the index (e.g. indexed
+ * by a former version of the plugin) are looked up by Orthanc.
+ **/
+class StorageCommitmentScp : public OrthancPlugins::IStorageCommitmentScpHandler
+{
+private:
+  typedef std::map<std::string, std::list<std::string> >  IndexedFiles;
+
+  IndexedFiles  files_;
+
+protected:
+  // Returns "true" iff. Orthanc stores this SOP instance
+  virtual bool LookupInOrthanc(const std::string& sopInstanceUid);
+
+public:
+  StorageCommitmentScp(IndexerDatabase& database,
+                       const char* const* sopInstanceUids,
+                       uint32_t countInstances);
+
+  virtual OrthancPluginStorageCommitmentFailureReason Lookup(const std::string& sopClassUid,
+                                                             const std::string& sopInstanceUid) ORTHANC_OVERRIDE;
+};
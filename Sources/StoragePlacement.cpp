@@ -0,0 +1,188 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "StoragePlacement.h"
+
+#include <OrthancException.h>
+
+#include <boost/filesystem/operations.hpp>
+
+
+// FNV-1a, as the placement of a series must not change across
+// versions of the compiler or of Boost
+static uint64_t HashSeries(const std::string& seriesInstanceUid)
+{
+  uint64_t hash = 14695981039346656037ull;
+
+  for (size_t i = 0; i < seriesInstanceUid.size(); i++)
+  {
+    hash ^= static_cast<uint8_t>(seriesInstanceUid[i]);
+    hash *= 1099511628211ull;
+  }
+
+  return hash;
+}
+
+
+size_t StoragePlacement::ChooseMostFreeSpace(uintmax_t size)
+{
+  size_t best = 0;
+  for (size_t i = 1; i < roots_.size(); i++)
+  {
+    if (available_[i] > available_[best])
+    {
+      best = i;
+    }
+  }
+
+  // Account for the file until the next refresh, so that concurrent
+  // writes are spread over the directories with similar free space
+  available_[best] = (available_[best] > size ? available_[best] - size : 0);
+
+  return best;
+}
+
+
+StoragePlacement::StoragePlacement(const std::list<std::string>& roots,
+                                   Policy policy) :
+  roots_(roots.begin(), roots.end()),
+  policy_(policy),
+  next_(0),
+  available_(roots.size(), 0),
+  measured_(roots.size(), false)
+{
+  if (roots.empty())
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+  }
+}
+
+
+StoragePlacement::Policy StoragePlacement::ParsePolicy(const std::string& value)
+{
+  if (value == "RoundRobin")
+  {
+    return Policy_RoundRobin;
+  }
+  else if (value == "MostFreeSpace")
+  {
+    return Policy_MostFreeSpace;
+  }
+  else if (value == "SeriesHash")
+  {
+    return Policy_SeriesHash;
+  }
+  else
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange,
+                                    "Unknown storage placement policy: " + value);
+  }
+}
+
+
+const std::string& StoragePlacement::GetRoot(size_t index) const
+{
+  if (index >= roots_.size())
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+  }
+  else
+  {
+    return roots_[index];
+  }
+}
+
+
+size_t StoragePlacement::ChooseRoot(const std::string& seriesInstanceUid,
+                                    uintmax_t size)
+{
+  if (roots_.size() == 1)
+  {
+    return 0;
+  }
+
+  switch (policy_)
+  {
+    case Policy_RoundRobin:
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      const size_t index = next_;
+      next_ = (next_ + 1) % roots_.size();
+      return index;
+    }
+
+    case Policy_MostFreeSpace:
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      return ChooseMostFreeSpace(size);
+    }
+
+    case Policy_SeriesHash:
+      return static_cast<size_t>(HashSeries(seriesInstanceUid) % roots_.size());
+
+    default:
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+  }
+}
+
+
+void StoragePlacement::RefreshFreeSpace()
+{
+  // The mutex is not held while measuring, so that a hung directory
+  // doesn't block the choice of the directories
+  std::vector<uintmax_t> available(roots_.size(), 0);
+  std::vector<bool> measured(roots_.size(), false);
+
+  for (size_t i = 0; i < roots_.size(); i++)
+  {
+    boost::system::error_code error;
+    const boost::filesystem::space_info info = boost::filesystem::space(roots_[i], error);
+
+    if (!error)
+    {
+      available[i] = info.available;
+      measured[i] = true;
+    }
+  }
+
+  boost::mutex::scoped_lock lock(mutex_);
+  available_.swap(available);
+  measured_.swap(measured);
+}
+
+
+bool StoragePlacement::LookupFreeSpace(uintmax_t& available,
+                                       size_t index)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  if (index >= roots_.size())
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+  }
+  else if (measured_[index])
+  {
+    available = available_[index];
+    return true;
+  }
+  else
+  {
+    return false;
+  }
+}
@@ -0,0 +1,84 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <list>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+
+/**
+ * Choice of the storage directory receiving each DICOM instance that
+ * is sent to Orthanc, so that the write bandwidth and the capacity of
+ * several filesystems can be combined. The free space of the
+ * directories is only measured by "RefreshFreeSpace()", which is to be
+ * called by a background thread, as "statvfs()" hangs on a dead
+ * network mount.
+ **/
+class StoragePlacement : public boost::noncopyable
+{
+public:
+  enum Policy
+  {
+    Policy_RoundRobin,
+    Policy_MostFreeSpace,  // As of the last call to "RefreshFreeSpace()"
+    Policy_SeriesHash      // All the instances of one series go to the same directory
+  };
+
+private:
+  std::vector<std::string>  roots_;
+  Policy                    policy_;
+  boost::mutex              mutex_;
+  size_t                    next_;
+  std::vector<uintmax_t>    available_;  // Decreased by the files written since the last refresh
+  std::vector<bool>         measured_;   // Whether the last measure of the free space has succeeded
+
+  size_t ChooseMostFreeSpace(uintmax_t size);
+
+public:
+  StoragePlacement(const std::list<std::string>& roots,
+                   Policy policy);
+
+  static Policy ParsePolicy(const std::string& value);
+
+  Policy GetPolicy() const
+  {
+    return policy_;
+  }
+
+  size_t GetRootsCount() const
+  {
+    return roots_.size();
+  }
+
+  const std::string& GetRoot(size_t index) const;
+
+  size_t ChooseRoot(const std::string& seriesInstanceUid,
+                    uintmax_t size);
+
+  void RefreshFreeSpace();
+
+  // Returns "false" if the free space could not be measured
+  bool LookupFreeSpace(uintmax_t& available,
+                       size_t index);
+};
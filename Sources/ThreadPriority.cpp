@@ -0,0 +1,159 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "ThreadPriority.h"
+
+#include <Logging.h>
+#include <OrthancException.h>
+
+#if defined(__linux__)
+#  include <errno.h>
+#  include <string.h>
+#  include <sys/resource.h>
+#  include <sys/syscall.h>
+#  include <unistd.h>
+#endif
+
+
+#if defined(__linux__)
+// The glibc doesn't provide a wrapper around "ioprio_set()", whose
+// constants are taken from "linux/ioprio.h"
+static const int IOPRIO_CLASS_SHIFT = 13;
+static const int IOPRIO_CLASS_BE = 2;
+static const int IOPRIO_CLASS_IDLE = 3;
+static const int IOPRIO_WHO_PROCESS = 1;
+static const int IOPRIO_LOWEST_BE_LEVEL = 7;
+static const int LOW_NICE_VALUE = 10;
+
+
+static bool SetIoPriority(pid_t thread,
+                          int ioClass,
+                          int level)
+{
+  if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, thread, (ioClass << IOPRIO_CLASS_SHIFT) | level) == 0)
+  {
+    return true;
+  }
+  else
+  {
+    LOG(WARNING) << "Cannot change the I/O priority of a thread: " << strerror(errno);
+    return false;
+  }
+}
+#endif
+
+
+ThreadPriority::FilesystemSection::FilesystemSection(Level level) :
+  idle_(false)
+{
+#if defined(__linux__)
+  // Thread 0 is the calling thread. Failures are not logged, as
+  // "ApplyToCurrentThread()" has already reported them.
+  idle_ = (level == Level_Idle &&
+           syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) == 0);
+#endif
+}
+
+
+ThreadPriority::FilesystemSection::~FilesystemSection()
+{
+#if defined(__linux__)
+  if (idle_)
+  {
+    // Back to the I/O priority of "ApplyToCurrentThread()", which is
+    // allowed for unprivileged threads, contrarily to SCHED_IDLE
+    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, (IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT) | IOPRIO_LOWEST_BE_LEVEL);
+  }
+#endif
+}
+
+
+ThreadPriority::Level ThreadPriority::Parse(const std::string& value)
+{
+  if (value == "Normal")
+  {
+    return Level_Normal;
+  }
+  else if (value == "Low")
+  {
+    return Level_Low;
+  }
+  else if (value == "Idle")
+  {
+    return Level_Idle;
+  }
+  else
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange,
+                                    "Unknown priority for the background threads: " + value);
+  }
+}
+
+
+const char* ThreadPriority::Format(Level level)
+{
+  switch (level)
+  {
+    case Level_Normal:
+      return "Normal";
+
+    case Level_Low:
+      return "Low";
+
+    case Level_Idle:
+      return "Idle";
+
+    default:
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+  }
+}
+
+
+bool ThreadPriority::ApplyToCurrentThread(Level level)
+{
+  if (level == Level_Normal)
+  {
+    return true;
+  }
+
+#if defined(__linux__)
+  // On Linux, the nice value and the I/O priority of "PRIO_PROCESS"
+  // are per-thread if given the thread ID
+  const pid_t thread = static_cast<pid_t>(syscall(SYS_gettid));
+
+  switch (level)
+  {
+    case Level_Low:
+    case Level_Idle:  // The idle I/O class is only used by "FilesystemSection"
+      if (setpriority(PRIO_PROCESS, thread, LOW_NICE_VALUE) != 0)
+      {
+        LOG(WARNING) << "Cannot change the nice value of a thread: " << strerror(errno);
+        return false;
+      }
+
+      return SetIoPriority(thread, IOPRIO_CLASS_BE, IOPRIO_LOWEST_BE_LEVEL);
+
+    default:
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+  }
+#else
+  LOG(WARNING) << "Priority of the background threads is only supported on Linux";
+  return false;
+#endif
+}
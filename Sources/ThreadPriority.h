@@ -0,0 +1,69 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <string>
+
+
+/**
+ * Scheduling of the background threads of the plugin (crawlers and
+ * prefetchers), so that the kernel favors the threads of Orthanc that
+ * answer the viewers. Only the calling thread is affected, which
+ * leaves the storage callbacks invoked by Orthanc at their normal
+ * priority. This is only implemented on Linux.
+ *
+ * The background threads lock the index, on which the storage
+ * callbacks wait. SCHED_IDLE is not used, as a thread holding the lock
+ * could be starved by the busy threads of Orthanc (priority inversion),
+ * and an unprivileged thread cannot leave SCHED_IDLE once the lock is
+ * taken. The idle I/O class, which can be left, is only used within
+ * the filesystem operations that are done without the lock.
+ **/
+class ThreadPriority
+{
+public:
+  enum Level
+  {
+    Level_Normal,
+    Level_Low,   // Nice value of 10, lowest best-effort I/O priority
+    Level_Idle   // Same as "Low", with the idle I/O class in the filesystem sections
+  };
+
+  // Filesystem operation of a background thread, which must not lock
+  // the index. Only changes the I/O class at the "Idle" level.
+  class FilesystemSection : public boost::noncopyable
+  {
+  private:
+    bool  idle_;
+
+  public:
+    explicit FilesystemSection(Level level);
+
+    ~FilesystemSection();
+  };
+
+  static Level Parse(const std::string& value);
+
+  static const char* Format(Level level);
+
+  // Returns "false" if the priority could not be changed
+  static bool ApplyToCurrentThread(Level level);
+};
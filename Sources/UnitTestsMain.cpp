@@ -19,14 +19,45 @@
 
 #include <gtest/gtest.h>
 
+#include "CacheArea.h"
+#include "ChunkWorkers.h"
+#include "CrawlerWatchdog.h"
+#include "DerivedStorage.h"
+#include "DeviceQueues.h"
+#include "DirectoryReader.h"
+#include "DirectoryScheduler.h"
+#include "DirectorySnapshot.h"
+#include "DuplicateFilter.h"
+#include "HeaderPrefetcher.h"
 #include "IndexerDatabase.h"
+#include "InodeCache.h"
+#include "MemoryBudget.h"
+#include "RangeCoalescer.h"
+#include "ReadCache.h"
+#include "SeriesPrefetcher.h"
+#include "SlowLog.h"
 #include "StorageArea.h"
+#include "StorageCommitmentScp.h"
+#include "StoragePlacement.h"
+#include "ThreadPriority.h"
+#include "UploadBatch.h"
 
 #include <Logging.h>
 #include <OrthancException.h>
 #include <SystemToolbox.h>
 #include <Toolbox.h>
 
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/thread/thread.hpp>
+#include <algorithm>
+
+#if defined(__linux__)
+#  include <sys/resource.h>
+#  include <sys/syscall.h>
+#  include <unistd.h>
+#endif
+
 
 TEST(StorageArea, Basic)
 {
@@ -82,6 +113,66 @@ TEST(StorageArea, Basic)
 }
 
 
+TEST(StorageArea, DirectReads)
+{
+  const std::string uuid = Orthanc::Toolbox::GenerateUuid();
+
+  // Spans more than one bounce buffer of O_DIRECT, and ends in the
+  // middle of a block
+  std::string content;
+  content.resize(4 * 1024 * 1024 + 5000);
+  for (size_t i = 0; i < content.size(); i++)
+  {
+    content[i] = static_cast<char>(i % 251);
+  }
+
+  StorageArea area("StorageAreaTests");
+  area.Create(uuid, content.c_str(), content.size());
+
+  // The direct reads are used if the threshold is 1 byte, otherwise
+  // the file is memory-mapped. Whether the filesystem accepts O_DIRECT
+  // or not, the direct reads go through the same aligned buffer.
+  for (unsigned int threshold = 0; threshold <= 1; threshold++)
+  {
+    StorageArea::ConfigureDirectReads(threshold, std::list<std::string>());
+
+    static const size_t RANGES[][2] = {
+      { 0, 1 },
+      { 1, 4095 },
+      { 4095, 2 },
+      { 4096, 4096 },
+      { 5000, 7000 },
+      { 4 * 1024 * 1024 - 100, 300 },
+      { 100, 4 * 1024 * 1024 + 100 },
+      { 4 * 1024 * 1024 + 4990, 10 },
+      { 4 * 1024 * 1024 + 4999, 1 }
+    };
+
+    for (size_t i = 0; i < sizeof(RANGES) / sizeof(RANGES[0]); i++)
+    {
+      std::string target;
+      target.resize(RANGES[i][1]);
+
+      OrthancPluginMemoryBuffer64 buffer;
+      buffer.data = &target[0];
+      buffer.size = target.size();
+
+      area.ReadRange(&buffer, uuid, RANGES[i][0]);
+      ASSERT_TRUE(target == content.substr(RANGES[i][0], RANGES[i][1]));
+    }
+
+    char data[10];
+    OrthancPluginMemoryBuffer64 buffer;
+    buffer.data = data;
+    buffer.size = 10;
+    ASSERT_THROW(area.ReadRange(&buffer, uuid, content.size() - 5), Orthanc::OrthancException);
+  }
+
+  StorageArea::ConfigureDirectReads(0, std::list<std::string>());
+  area.RemoveAttachment(uuid);
+}
+
+
 
 class Visitor : public IndexerDatabase::IFileVisitor
 {
@@ -356,6 +447,1848 @@ TEST(IndexerDatabase, RemoveFromFilesystem)
 }
 
 
+TEST(IndexerDatabase, ModifiedInPlace)
+{
+  IndexerDatabase db;
+  db.OpenInMemory();
+
+  db.AddDicomInstance("sample.dcm", 42 /* time */, 5 /* size */, "instance1");
+  ASSERT_TRUE(db.AddAttachment("uuid1", "instance1"));
+
+  std::string path;
+  ASSERT_TRUE(db.LookupAttachment(path, "uuid1"));
+  ASSERT_EQ("sample.dcm", path);
+
+  // The file is modified, but keeps its DICOM identifiers: While the
+  // old instance is deleted from Orthanc, its attachment must not
+  // resolve to the modified file, which would be removed from disk
+  ASSERT_TRUE(db.RemoveFile("sample.dcm"));
+  ASSERT_FALSE(db.LookupAttachment(path, "uuid1"));
+  db.RemoveAttachment("uuid1");
+
+  db.AddDicomInstance("sample.dcm", 43 /* time */, 6 /* size */, "instance1");
+  ASSERT_FALSE(db.LookupAttachment(path, "uuid1"));
+  ASSERT_EQ(1u, db.GetFilesCount());
+  ASSERT_EQ(0u, db.GetAttachmentsCount());
+}
+
+
+TEST(IndexerDatabase, Directories)
+{
+  IndexerDatabase db;
+  db.OpenInMemory();
+
+  std::time_t lastVisit, nextVisit;
+  unsigned int interval;
+  ASSERT_FALSE(db.LookupDirectory(lastVisit, interval, nextVisit, "root"));
+
+  db.StoreDirectoryVisit("root", "", 100 /* visit */, true /* changed */, 10 /* interval */, 110 /* next */);
+  db.StoreDirectoryVisit("root/a", "root", 100, false, 20, 120);
+  db.StoreDirectoryVisit("root/a/b", "root/a", 100, false, 40, 140);
+  db.StoreDirectoryVisit("root/c", "root", 100, false, 10, 110);
+  ASSERT_EQ(4u, db.GetDirectoriesCount());
+
+  ASSERT_TRUE(db.LookupDirectory(lastVisit, interval, nextVisit, "root/a"));
+  ASSERT_EQ(100, lastVisit);
+  ASSERT_EQ(20u, interval);
+  ASSERT_EQ(120, nextVisit);
+
+  db.StoreDirectoryVisit("root/a", "root", 130, false, 40, 170);
+  ASSERT_TRUE(db.LookupDirectory(lastVisit, interval, nextVisit, "root/a"));
+  ASSERT_EQ(130, lastVisit);
+  ASSERT_EQ(40u, interval);
+  ASSERT_EQ(170, nextVisit);
+  ASSERT_EQ(4u, db.GetDirectoriesCount());
+
+  std::list<std::string> children;
+  db.ListChildDirectories(children, "root");
+  ASSERT_EQ(2u, children.size());
+  db.ListChildDirectories(children, "root/c");
+  ASSERT_TRUE(children.empty());
+
+  db.ForgetDirectory("root/a");
+  ASSERT_EQ(2u, db.GetDirectoriesCount());
+  ASSERT_FALSE(db.LookupDirectory(lastVisit, interval, nextVisit, "root/a/b"));
+  db.ListChildDirectories(children, "root");
+  ASSERT_EQ(1u, children.size());
+  ASSERT_EQ("root/c", children.front());
+
+  db.ScheduleDirectoryVisit("root/c");
+  db.ScheduleDirectoryVisit("root/nope");  // Never visited, ignored
+  ASSERT_TRUE(db.LookupDirectory(lastVisit, interval, nextVisit, "root/c"));
+  ASSERT_EQ(100, lastVisit);
+  ASSERT_EQ(10u, interval);
+  ASSERT_EQ(0, nextVisit);
+  ASSERT_EQ(2u, db.GetDirectoriesCount());
+}
+
+
+TEST(DirectoryScheduler, Intervals)
+{
+  ASSERT_THROW(DirectoryScheduler(0, 100, 0.2f), Orthanc::OrthancException);
+  ASSERT_THROW(DirectoryScheduler(10, 5, 0.2f), Orthanc::OrthancException);
+  ASSERT_THROW(DirectoryScheduler(10, 100, 1.0f), Orthanc::OrthancException);
+
+  DirectoryScheduler scheduler(10, 100, 0.2f);
+  ASSERT_EQ(10u, scheduler.ComputeInterval(0, false));
+  ASSERT_EQ(10u, scheduler.ComputeInterval(0, true));
+  ASSERT_EQ(20u, scheduler.ComputeInterval(10, false));
+  ASSERT_EQ(40u, scheduler.ComputeInterval(20, false));
+  ASSERT_EQ(80u, scheduler.ComputeInterval(40, false));
+  ASSERT_EQ(100u, scheduler.ComputeInterval(80, false));
+  ASSERT_EQ(100u, scheduler.ComputeInterval(100, false));
+  ASSERT_EQ(10u, scheduler.ComputeInterval(100, true));
+
+  for (unsigned int i = 0; i < 100; i++)
+  {
+    std::time_t next = scheduler.ComputeNextVisit(1000, 100);
+    ASSERT_GE(next, 1080);
+    ASSERT_LE(next, 1120);
+  }
+}
+
+
+TEST(InodeCache, Basic)
+{
+  IndexerDatabase db;
+  db.OpenInMemory();
+
+  bool isDicom;
+  std::string instanceId;
+
+  {
+    InodeCache cache(db, false /* not persistent */, 2);
+    ASSERT_FALSE(cache.Lookup(isDicom, instanceId, 1 /* device */, 10 /* inode */, 42 /* time */, 5 /* size */));
+
+    cache.Store(1, 10, 42, 5, true, "instance1");
+    cache.Store(1, 11, 42, 5, false, "");
+    ASSERT_EQ(2u, cache.GetSize());
+
+    ASSERT_TRUE(cache.Lookup(isDicom, instanceId, 1, 10, 42, 5));
+    ASSERT_TRUE(isDicom);
+    ASSERT_EQ("instance1", instanceId);
+    ASSERT_TRUE(cache.Lookup(isDicom, instanceId, 1, 11, 42, 5));
+    ASSERT_FALSE(isDicom);
+
+    ASSERT_FALSE(cache.Lookup(isDicom, instanceId, 2, 10, 42, 5));  // Other device
+    ASSERT_FALSE(cache.Lookup(isDicom, instanceId, 1, 10, 43, 5));  // Modified
+    ASSERT_FALSE(cache.Lookup(isDicom, instanceId, 1, 10, 42, 6));  // Modified
+
+    cache.Store(1, 12, 42, 5, false, "");  // Exceeds the maximum size
+    ASSERT_EQ(1u, cache.GetSize());
+    ASSERT_FALSE(cache.Lookup(isDicom, instanceId, 1, 10, 42, 5));
+
+    cache.Clear();
+    ASSERT_EQ(0u, cache.GetSize());
+  }
+
+  {
+    InodeCache cache(db, true /* persistent */, 10);
+    cache.Store(1, 10, 42, 5, true, "instance1");
+    cache.Store(1, 11, 42, 5, false, "");
+  }
+
+  {
+    InodeCache cache(db, true /* persistent */, 10);
+
+    // The DICOM instance is not indexed anymore, so it cannot be reused
+    ASSERT_FALSE(cache.Lookup(isDicom, instanceId, 1, 10, 42, 5));
+    ASSERT_TRUE(cache.Lookup(isDicom, instanceId, 1, 11, 42, 5));
+    ASSERT_FALSE(isDicom);
+
+    db.AddDicomInstance("copy1.dcm", 42, 5, "instance1");
+    ASSERT_TRUE(cache.Lookup(isDicom, instanceId, 1, 10, 42, 5));
+    ASSERT_TRUE(isDicom);
+    ASSERT_EQ("instance1", instanceId);
+    ASSERT_FALSE(cache.Lookup(isDicom, instanceId, 1, 10, 43, 5));
+  }
+}
+
+
+TEST(IndexerDatabase, ApplyRange)
+{
+  IndexerDatabase db;
+  db.OpenInMemory();
+
+  db.AddDicomInstance("/a/1.dcm", 42, 5, "instance1");
+  db.AddDicomInstance("/a/2.dcm", 42, 5, "instance2");
+  db.AddNonDicomFile("/a/b/3.txt", 42, 5);
+  db.AddDicomInstance("/a0/4.dcm", 42, 5, "instance4");
+  db.AddDicomInstance("/ab/5.dcm", 42, 5, "instance5");
+
+  Visitor v;
+  ASSERT_EQ(3u, db.Apply(v, "/a", "", 10));
+  ASSERT_EQ(3u, v.GetSize());
+  ASSERT_EQ("/a/1.dcm", v.GetPath(0));
+  ASSERT_EQ("/a/2.dcm", v.GetPath(1));
+  ASSERT_EQ("/a/b/3.txt", v.GetPath(2));
+  ASSERT_FALSE(v.IsDicom(2));
+
+  v.Clear();
+  ASSERT_EQ(3u, db.Apply(v, "/a/", "", 10));
+
+  v.Clear();
+  ASSERT_EQ(2u, db.Apply(v, "/a", "", 2));
+  ASSERT_EQ(1u, db.Apply(v, "/a", v.GetPath(1), 2));
+  ASSERT_EQ(0u, db.Apply(v, "/a", v.GetPath(2), 2));
+  ASSERT_EQ(3u, v.GetSize());
+  ASSERT_EQ("/a/b/3.txt", v.GetPath(2));
+
+  v.Clear();
+  ASSERT_EQ(1u, db.Apply(v, "/a/b", "", 10));
+  ASSERT_EQ(0u, db.Apply(v, "/nope", "", 10));
+}
+
+
+TEST(CrawlerWatchdog, Basic)
+{
+  std::list<std::string> roots;
+  roots.push_back("/a");
+  roots.push_back("/b");
+
+  ASSERT_THROW(CrawlerWatchdog(roots, 0, 10, 100), Orthanc::OrthancException);
+  ASSERT_THROW(CrawlerWatchdog(roots, 60, 10, 5), Orthanc::OrthancException);
+
+  CrawlerWatchdog watchdog(roots, 60 /* stall timeout */, 10 /* minimum backoff */, 35 /* maximum backoff */);
+  ASSERT_EQ(2u, watchdog.GetRootsCount());
+  ASSERT_EQ("/b", watchdog.GetRootPath(1));
+  ASSERT_THROW(watchdog.GetRootPath(2), Orthanc::OrthancException);
+
+  const boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+
+  {
+    CrawlerWatchdog::Operation operation(watchdog, 0, "stat", "/a/file");
+    watchdog.CheckStalls(now + boost::posix_time::seconds(30));
+    ASSERT_TRUE(watchdog.IsHealthy(0));
+    ASSERT_FALSE(watchdog.IsBlocked(0));
+
+    watchdog.CheckStalls(now + boost::posix_time::seconds(120));
+    ASSERT_FALSE(watchdog.IsHealthy(0));
+    ASSERT_TRUE(watchdog.IsBlocked(0));
+    ASSERT_TRUE(watchdog.IsHealthy(1));
+    ASSERT_EQ(1u, watchdog.GetUnhealthyCount());
+    ASSERT_EQ(1u, watchdog.GetFailuresCount(0));
+  }
+
+  ASSERT_FALSE(watchdog.IsBlocked(0));
+
+  {
+    // Concurrent operations on the same root: The oldest one stalls
+    CrawlerWatchdog::Operation operation1(watchdog, 1, "identify", "/b/file1");
+    std::unique_ptr<CrawlerWatchdog::Operation> operation2(
+      new CrawlerWatchdog::Operation(watchdog, 1, "identify", "/b/file2"));
+
+    Json::Value status;
+    watchdog.Format(status);
+    ASSERT_EQ("identify /b/file1", status[1]["CurrentOperation"].asString());
+    ASSERT_EQ(2u, status[1]["CurrentOperationsCount"].asUInt());
+
+    operation2.reset(NULL);
+    watchdog.Format(status);
+    ASSERT_EQ(1u, status[1]["CurrentOperationsCount"].asUInt());
+  }
+
+  // First retry after the minimum backoff
+  ASSERT_FALSE(watchdog.IsScanAllowed(0, now + boost::posix_time::seconds(125)));
+  ASSERT_TRUE(watchdog.IsScanAllowed(0, now + boost::posix_time::seconds(131)));
+  ASSERT_TRUE(watchdog.IsScanAllowed(1, now));
+
+  // Exponential backoff, up to the maximum backoff
+  watchdog.ReportFailure(0, "Cannot read the folder", now);
+  ASSERT_FALSE(watchdog.IsScanAllowed(0, now + boost::posix_time::seconds(19)));
+  ASSERT_TRUE(watchdog.IsScanAllowed(0, now + boost::posix_time::seconds(21)));
+  watchdog.ReportFailure(0, "Cannot read the folder", now);
+  ASSERT_FALSE(watchdog.IsScanAllowed(0, now + boost::posix_time::seconds(34)));
+  ASSERT_TRUE(watchdog.IsScanAllowed(0, now + boost::posix_time::seconds(36)));
+  ASSERT_EQ(3u, watchdog.GetFailuresCount(0));
+
+  Json::Value status;
+  watchdog.Format(status);
+  ASSERT_EQ(2u, status.size());
+  ASSERT_FALSE(status[0]["Healthy"].asBool());
+  ASSERT_EQ("Cannot read the folder", status[0]["LastFailure"].asString());
+  ASSERT_TRUE(status[1]["Healthy"].asBool());
+
+  watchdog.ReportScanCompleted(0);
+  ASSERT_TRUE(watchdog.IsHealthy(0));
+  ASSERT_EQ(0u, watchdog.GetUnhealthyCount());
+  ASSERT_EQ(0u, watchdog.GetFailuresCount(0));
+
+  {
+    // A hung operation is only reported once
+    CrawlerWatchdog::Operation operation(watchdog, 1, "stat", "/b/file");
+    watchdog.CheckStalls(now + boost::posix_time::seconds(120));
+    ASSERT_EQ(1u, watchdog.GetFailuresCount(1));
+    watchdog.CheckStalls(now + boost::posix_time::seconds(240));
+    ASSERT_EQ(1u, watchdog.GetFailuresCount(1));
+  }
+
+  {
+    // A retry that stalls again is escalated
+    CrawlerWatchdog::Operation operation(watchdog, 1, "readdir", "/b");
+    watchdog.CheckStalls(now + boost::posix_time::seconds(240));
+    ASSERT_EQ(2u, watchdog.GetFailuresCount(1));
+    ASSERT_TRUE(watchdog.IsBlocked(1));
+    ASSERT_FALSE(watchdog.IsScanAllowed(1, now + boost::posix_time::seconds(259)));
+    ASSERT_TRUE(watchdog.IsScanAllowed(1, now + boost::posix_time::seconds(261)));
+  }
+}
+
+
+TEST(ReadCache, Basic)
+{
+  ReadCache cache(10 /* budget */, 5 /* maximum file size */, 1 /* shard */);
+  ASSERT_TRUE(cache.IsCacheable(5));
+  ASSERT_FALSE(cache.IsCacheable(6));
+
+  ReadCache::Content content;
+  ASSERT_FALSE(cache.Lookup(content, "a", 42, 5));
+
+  cache.Store("a", 42, "Hello", 5);
+  cache.Store("b", 42, "World", 5);
+  cache.Store("c", 42, "Too large", 9);  // Above the maximum file size
+
+  uint64_t size, hits, misses;
+  size_t count;
+  cache.GetStatistics(size, count, hits, misses);
+  ASSERT_EQ(10u, size);
+  ASSERT_EQ(2u, count);
+
+  ASSERT_TRUE(cache.Lookup(content, "a", 42, 5));
+  ASSERT_EQ("Hello", *content);
+  ASSERT_FALSE(cache.Lookup(content, "c", 42, 9));
+
+  // "b" is the least recently used entry
+  cache.Store("d", 42, "Orth", 4);
+  ASSERT_TRUE(cache.Lookup(content, "a", 42, 5));
+  ASSERT_FALSE(cache.Lookup(content, "b", 42, 5));
+  ASSERT_TRUE(cache.Lookup(content, "d", 42, 4));
+  ASSERT_EQ("Orth", *content);
+
+  // Modified files are invalidated
+  ASSERT_FALSE(cache.Lookup(content, "a", 43, 5));
+  ASSERT_FALSE(cache.Lookup(content, "a", 42, 5));
+  ASSERT_EQ("Orth", *content);  // Still valid after eviction
+
+  cache.Invalidate("d");
+  ASSERT_FALSE(cache.Lookup(content, "d", 42, 4));
+
+  cache.GetStatistics(size, count, hits, misses);
+  ASSERT_EQ(0u, size);
+  ASSERT_EQ(0u, count);
+  ASSERT_EQ(3u, hits);
+  ASSERT_EQ(5u, misses);  // Files that are too large are not accounted
+}
+
+
+TEST(IndexerDatabase, Instances)
+{
+  IndexerDatabase db;
+  db.OpenInMemory();
+
+  db.AddDicomInstance("a/1.dcm", 42, 5, "instance1");
+  db.AddDicomInstance("a/2.dcm", 42, 5, "instance2");
+  db.AddDicomInstance("b/2.dcm", 42, 5, "instance2");  // Copy of the same instance
+  db.AddDicomInstance("c/3.dcm", 42, 5, "instance3");
+  db.AddNonDicomFile("c/4.txt", 42, 5);
+
+  // Instances indexed by older versions
+  std::map<std::string, std::string> instances;
+  db.ListInstancesWithoutSeries(instances, "", 10);
+  ASSERT_EQ(3u, instances.size());
+  ASSERT_EQ("a/1.dcm", instances["instance1"]);
+  ASSERT_EQ("a/2.dcm", instances["instance2"]);
+  ASSERT_EQ("c/3.dcm", instances["instance3"]);
+
+  db.ListInstancesWithoutSeries(instances, "instance1", 1);
+  ASSERT_EQ(1u, instances.size());
+  ASSERT_EQ("a/2.dcm", instances["instance2"]);
+
+  db.StoreInstance("instance1", "series1", "sop1");
+  db.StoreInstance("instance2", "series1", "sop2");
+  db.ListInstancesWithoutSeries(instances, "", 10);
+  ASSERT_EQ(1u, instances.size());
+  ASSERT_EQ("c/3.dcm", instances["instance3"]);
+
+  db.StoreInstance("instance3", "series2", "sop3");
+  db.ListInstancesWithoutSeries(instances, "", 10);
+  ASSERT_TRUE(instances.empty());
+
+  std::string series;
+  ASSERT_TRUE(db.LookupSeries(series, "a/2.dcm"));
+  ASSERT_EQ("series1", series);
+  ASSERT_TRUE(db.LookupSeries(series, "c/3.dcm"));
+  ASSERT_EQ("series2", series);
+  ASSERT_FALSE(db.LookupSeries(series, "nope.dcm"));
+
+  std::list<std::string> files;
+  db.ListSeriesFiles(files, "series1", 10);
+  ASSERT_EQ(2u, files.size());
+  ASSERT_EQ("a/1.dcm", files.front());
+  ASSERT_EQ("a/2.dcm", files.back());
+
+  db.ListSeriesFiles(files, "series1", 1);
+  ASSERT_EQ(1u, files.size());
+
+  // The identifiers are forgotten together with the last copy
+  ASSERT_FALSE(db.RemoveFile("a/2.dcm"));
+  ASSERT_TRUE(db.LookupSeries(series, "b/2.dcm"));
+  ASSERT_TRUE(db.RemoveFile("b/2.dcm"));
+  db.AddDicomInstance("b/2.dcm", 42, 5, "instance2");
+  ASSERT_FALSE(db.LookupSeries(series, "b/2.dcm"));
+
+  db.ListSeriesFiles(files, "series1", 10);
+  ASSERT_EQ(1u, files.size());
+  ASSERT_EQ("a/1.dcm", files.front());
+}
+
+
+TEST(SeriesPrefetcher, Basic)
+{
+  const std::string folder = "SeriesPrefetcherTests";
+  Orthanc::SystemToolbox::MakeDirectory(folder);
+
+  IndexerDatabase db;
+  db.OpenInMemory();
+
+  std::vector<std::string> paths;
+  for (unsigned int i = 0; i < 4; i++)
+  {
+    const std::string s = boost::lexical_cast<std::string>(i);
+    paths.push_back(folder + "/" + s + ".dcm");
+    Orthanc::SystemToolbox::WriteFile("Hello" + s, paths.back());
+    db.AddDicomInstance(paths.back(), 42, 6, "instance" + s);
+    db.StoreInstance("instance" + s, (i < 3 ? "series1" : "series2"), "sop" + s);
+  }
+
+  ReadCache cache(1024, 1024, 1);
+  SeriesPrefetcher prefetcher(db, &cache, 10 /* queue size */, 60 /* timeout */);
+
+  size_t queueSize;
+  uint64_t prefetched, cancelled;
+
+  prefetcher.NotifyRead(paths[0]);
+  ASSERT_TRUE(prefetcher.Step());  // Expands the read
+  prefetcher.GetStatistics(queueSize, prefetched, cancelled);
+  ASSERT_EQ(2u, queueSize);
+
+  // Reading another instance of the same series doesn't queue it again
+  prefetcher.NotifyRead(paths[1]);
+  ASSERT_TRUE(prefetcher.Step());
+  prefetcher.GetStatistics(queueSize, prefetched, cancelled);
+  ASSERT_EQ(2u, queueSize);
+
+  // Files that are unknown to the index are ignored
+  prefetcher.NotifyRead(folder + "/nope.dcm");
+  ASSERT_TRUE(prefetcher.Step());
+
+  ASSERT_TRUE(prefetcher.Step());
+  ASSERT_TRUE(prefetcher.Step());
+  ASSERT_FALSE(prefetcher.Step());
+
+  prefetcher.GetStatistics(queueSize, prefetched, cancelled);
+  ASSERT_EQ(0u, queueSize);
+  ASSERT_EQ(2u, prefetched);
+  ASSERT_EQ(0u, cancelled);
+
+  uint64_t size, hits, misses;
+  size_t count;
+  cache.GetStatistics(size, count, hits, misses);
+  ASSERT_EQ(2u, count);
+  ASSERT_EQ(0u, hits);
+  ASSERT_EQ(0u, misses);
+
+  const std::time_t time = boost::filesystem::last_write_time(paths[2]);
+  ReadCache::Content content;
+  ASSERT_TRUE(cache.Lookup(content, paths[2], time, 6));
+  ASSERT_EQ("Hello2", *content);
+  ASSERT_FALSE(cache.Contains(paths[0], time, 6));  // The file that was read is not prefetched
+
+  for (size_t i = 0; i < paths.size(); i++)
+  {
+    Orthanc::SystemToolbox::RemoveFile(paths[i]);
+  }
+}
+
+
+TEST(UploadBatch, Basic)
+{
+  ASSERT_THROW(UploadBatch(100, 0), Orthanc::OrthancException);
+  ASSERT_THROW(UploadBatch(100, 101), Orthanc::OrthancException);
+
+  UploadBatch batch(250 /* maximum size */, 100 /* maximum file size */);
+  ASSERT_TRUE(batch.IsEmpty());
+  ASSERT_TRUE(batch.IsBatchable(100));
+  ASSERT_FALSE(batch.IsBatchable(101));
+  ASSERT_TRUE(batch.HasRoom(100));
+  ASSERT_FALSE(batch.HasRoom(101));
+
+  ASSERT_TRUE(batch.Add("a.dcm", "instance1", "Hello", 5));
+  ASSERT_TRUE(batch.HasRoom(51));  // 113 bytes, plus 86 bytes of headers and name
+  ASSERT_FALSE(batch.HasRoom(52));
+  ASSERT_TRUE(batch.Add("b.dcm", "instance2", "World!", 6));
+  ASSERT_FALSE(batch.HasRoom(1));
+  ASSERT_FALSE(batch.Add("c.dcm", "instance3", std::string(90, 'x').c_str(), 90));  // Full
+  ASSERT_THROW(batch.Add("d.dcm", "instance4", std::string(101, 'x').c_str(), 101), Orthanc::OrthancException);
+  ASSERT_EQ(2u, batch.GetCount());
+
+  ASSERT_EQ("b.dcm", batch.GetEntry(1).path_);
+  ASSERT_EQ("instance2", batch.GetEntry(1).instanceId_);
+  ASSERT_EQ(6u, batch.GetEntry(1).size_);
+  ASSERT_EQ("World!", std::string(reinterpret_cast<const char*>(batch.GetContent(1)), 6));
+  ASSERT_THROW(batch.GetEntry(2), Orthanc::OrthancException);
+
+  std::string archive;
+  batch.FormatArchive(archive);
+
+  // 2 local headers (30 bytes), 2 central headers (46 bytes), names
+  // of 5 bytes, content, and end of central directory (22 bytes)
+  ASSERT_EQ(2u * 30u + 2u * 46u + 4u * 5u + 11u + 22u, archive.size());
+  ASSERT_EQ(std::string("PK\x03\x04", 4), archive.substr(0, 4));
+  ASSERT_EQ(std::string("PK\x05\x06", 4), archive.substr(archive.size() - 22, 4));
+  ASSERT_EQ(2, archive[archive.size() - 12]);  // Total number of entries
+  ASSERT_EQ("0.dcmHello", archive.substr(30, 10));
+
+  batch.Clear();
+  ASSERT_TRUE(batch.IsEmpty());
+
+  // A single file can always be added to an empty batch
+  UploadBatch small(100, 100);
+  ASSERT_TRUE(small.Add("c.dcm", "instance3", std::string(100, 'x').c_str(), 100));
+}
+
+
+TEST(IndexerDatabase, ListDirectory)
+{
+  IndexerDatabase db;
+  db.OpenInMemory();
+
+  db.AddDicomInstance("/r/a.dcm", 1, 10, "instance1");
+  db.AddNonDicomFile("/r/b.txt", 2, 3);
+  db.AddDicomInstance("/r/s/c.dcm", 5, 20, "instance2");
+  db.AddDicomInstance("/r/s/d/e.dcm", 7, 30, "instance3");
+  db.AddNonDicomFile("/r/s/f.txt", 1, 4);
+  db.AddNonDicomFile("/r0/g.txt", 1, 1);
+  db.AddNonDicomFile("/rr", 1, 1);
+  db.StoreInstance("instance1", "series1", "sop1");
+  db.StoreDirectoryVisit("/r/empty", "/r", 42, false, 10, 52);
+
+  std::list<IndexerDatabase::DirectoryChild> children;
+  db.ListDirectory(children, "/r");
+  ASSERT_EQ(4u, children.size());
+
+  std::list<IndexerDatabase::DirectoryChild>::const_iterator it = children.begin();
+  ASSERT_EQ("a.dcm", it->name_);
+  ASSERT_FALSE(it->isDirectory_);
+  ASSERT_EQ(1u, it->dicomFiles_);
+  ASSERT_EQ(10u, it->size_);
+  ASSERT_EQ("series1", it->seriesInstanceUid_);
+
+  ++it;
+  ASSERT_EQ("b.txt", it->name_);
+  ASSERT_FALSE(it->isDirectory_);
+  ASSERT_EQ(0u, it->dicomFiles_);
+  ASSERT_EQ(1u, it->otherFiles_);
+  ASSERT_TRUE(it->seriesInstanceUid_.empty());
+
+  ++it;
+  ASSERT_EQ("empty", it->name_);
+  ASSERT_TRUE(it->isDirectory_);
+  ASSERT_EQ(0u, it->dicomFiles_ + it->otherFiles_);
+
+  ++it;
+  ASSERT_EQ("s", it->name_);
+  ASSERT_TRUE(it->isDirectory_);
+  ASSERT_EQ(2u, it->dicomFiles_);
+  ASSERT_EQ(1u, it->otherFiles_);
+  ASSERT_EQ(54u, it->size_);
+  ASSERT_EQ(7, it->time_);
+
+  db.ListDirectory(children, "/r/s/d");
+  ASSERT_EQ(1u, children.size());
+  ASSERT_EQ("e.dcm", children.front().name_);
+
+  // Names sorting around the content of "/r/s/", which is skipped
+  db.AddNonDicomFile("/r/s-1.txt", 1, 1);
+  db.AddNonDicomFile("/r/s0.txt", 1, 1);
+  db.ListDirectory(children, "/r");
+  ASSERT_EQ(6u, children.size());
+  ASSERT_EQ("s0.txt", children.back().name_);
+  children.pop_back();
+  ASSERT_EQ("s-1.txt", children.back().name_);
+  children.pop_back();
+  ASSERT_EQ("s", children.back().name_);
+  ASSERT_EQ(54u, children.back().size_);
+
+  db.ListDirectory(children, "/r/s");
+  ASSERT_EQ(3u, children.size());
+  ASSERT_EQ("c.dcm", children.front().name_);
+  ASSERT_EQ("f.txt", children.back().name_);
+
+  db.ListDirectory(children, "/nope");
+  ASSERT_TRUE(children.empty());
+}
+
+
+TEST(DirectorySnapshot, Basic)
+{
+  IndexerDatabase db;
+  db.OpenInMemory();
+
+  db.AddDicomInstance("/r/a-b.dcm", 1, 10, "instance1");
+  db.AddNonDicomFile("/r/a.txt", 2, 3);
+  db.AddDicomInstance("/r/a/c.dcm", 5, 20, "instance2");
+  db.AddDicomInstance("/r/a/d/e.dcm", 7, 30, "instance3");
+  db.AddNonDicomFile("/r/a0", 1, 4);
+  db.AddNonDicomFile("/r/s/f.txt", 1, 4);
+  db.AddNonDicomFile("/r/z", 1, 5);
+  db.AddNonDicomFile("/r0/g.txt", 1, 1);
+
+  std::vector<IndexerDatabase::KnownFile> files;
+  std::vector<std::string> subdirectories;
+  db.ListDirectoryContent(files, subdirectories, "/r/");
+  ASSERT_EQ(4u, files.size());
+  ASSERT_EQ("a-b.dcm", files[0].name_);
+  ASSERT_TRUE(files[0].isDicom_);
+  ASSERT_EQ("instance1", files[0].instanceId_);
+  ASSERT_EQ(10u, files[0].size_);
+  ASSERT_EQ("a.txt", files[1].name_);
+  ASSERT_FALSE(files[1].isDicom_);
+  ASSERT_EQ(2, files[1].time_);
+  ASSERT_EQ("a0", files[2].name_);
+  ASSERT_EQ("z", files[3].name_);
+  ASSERT_EQ(2u, subdirectories.size());
+  ASSERT_EQ("a", subdirectories[0]);
+  ASSERT_EQ("s", subdirectories[1]);
+
+  DirectorySnapshot snapshot(db, "/r", NULL);
+  ASSERT_EQ(4u, snapshot.GetFilesCount());
+
+  std::vector<std::string> names;
+  names.push_back("z");
+  names.push_back("a-b.dcm");
+  names.push_back("new");
+  names.push_back("a");
+
+  std::vector<size_t> matches;
+  ASSERT_THROW(snapshot.Merge(matches, names), Orthanc::OrthancException);  // Not sorted
+
+  std::sort(names.begin(), names.end());
+  snapshot.Merge(matches, names);
+  ASSERT_EQ(4u, matches.size());
+  ASSERT_EQ(4u, matches[0]);  // "a" is a directory
+  ASSERT_EQ(0u, matches[1]);  // "a-b.dcm"
+  ASSERT_EQ(4u, matches[2]);  // "new"
+  ASSERT_EQ(3u, matches[3]);  // "z"
+
+  snapshot.MarkSeen(matches[1]);
+  snapshot.MarkSeen(matches[3]);
+
+  std::vector<size_t> vanishedFiles;
+  snapshot.ListVanishedFiles(vanishedFiles);
+  ASSERT_EQ(2u, vanishedFiles.size());
+  ASSERT_EQ("a.txt", snapshot.GetFile(vanishedFiles[0]).name_);
+  ASSERT_EQ("a0", snapshot.GetFile(vanishedFiles[1]).name_);
+
+  std::set<std::string> found;
+  found.insert("a");
+  std::vector<std::string> vanishedSubdirectories;
+  snapshot.ListVanishedSubdirectories(vanishedSubdirectories, found);
+  ASSERT_EQ(1u, vanishedSubdirectories.size());
+  ASSERT_EQ("s", vanishedSubdirectories[0]);
+
+  DirectorySnapshot empty(db, "/nope", NULL);
+  ASSERT_EQ(0u, empty.GetFilesCount());
+  ASSERT_THROW(empty.MarkSeen(0), Orthanc::OrthancException);
+}
+
+
+TEST(DirectorySnapshot, Chunks)
+{
+  IndexerDatabase db;
+  db.OpenInMemory();
+
+  for (char c = 'a'; c <= 'z'; c++)
+  {
+    db.AddNonDicomFile("/r/" + std::string(1, c), 1, 1);
+  }
+
+  DirectorySnapshot::Accounting accounting;
+
+  {
+    DirectorySnapshot snapshot(db, "/r", &accounting);
+    ASSERT_EQ(26u, snapshot.GetFilesCount());
+    ASSERT_LT(0u, snapshot.GetMemoryUsage());
+    ASSERT_EQ(snapshot.GetMemoryUsage(), accounting.GetMemoryUsage());
+
+    // Each chunk is sorted, but the chunks are not sorted between them,
+    // as the batches of "getdents64()" come in the hash order
+    std::vector<std::string> chunk;
+    chunk.push_back("m");
+    chunk.push_back("new");
+    chunk.push_back("z");
+
+    std::vector<size_t> matches;
+    snapshot.Merge(matches, chunk);
+    ASSERT_EQ(3u, matches.size());
+    ASSERT_EQ(12u, matches[0]);
+    ASSERT_EQ(26u, matches[1]);
+    ASSERT_EQ(25u, matches[2]);
+
+    chunk.clear();
+    chunk.push_back("0");
+    chunk.push_back("a");
+    chunk.push_back("c");
+    snapshot.Merge(matches, chunk);
+    ASSERT_EQ(3u, matches.size());
+    ASSERT_EQ(26u, matches[0]);
+    ASSERT_EQ(0u, matches[1]);
+    ASSERT_EQ(2u, matches[2]);
+
+    chunk.clear();
+    chunk.push_back("b");
+    chunk.push_back("y");
+    chunk.push_back("zz");
+    snapshot.Merge(matches, chunk);
+    ASSERT_EQ(3u, matches.size());
+    ASSERT_EQ(1u, matches[0]);
+    ASSERT_EQ(24u, matches[1]);
+    ASSERT_EQ(26u, matches[2]);
+
+    chunk.clear();
+    snapshot.Merge(matches, chunk);
+    ASSERT_TRUE(matches.empty());
+  }
+
+  ASSERT_EQ(0u, accounting.GetMemoryUsage());
+}
+
+
+TEST(IndexerDatabase, Statistics)
+{
+  IndexerDatabase db;
+  db.OpenInMemory();
+
+  IndexerDatabase::Statistics statistics;
+  ASSERT_FALSE(db.LookupStatistics(statistics, "/r"));
+
+  db.AddDicomInstance("/r/a.dcm", 1, 10, "instance1");
+  db.AddNonDicomFile("/r/b.txt", 2, 3);
+  db.AddDicomInstance("/r/s/c.dcm", 5, 20, "instance2");
+  db.AddNonDicomFile("/r0/d.txt", 1, 1);
+
+  ASSERT_TRUE(db.LookupStatistics(statistics, "/r"));
+  ASSERT_EQ(3u, statistics.files_);
+  ASSERT_EQ(2u, statistics.dicomFiles_);
+  ASSERT_EQ(33u, statistics.size_);
+  ASSERT_EQ(5, statistics.lastChange_);
+
+  ASSERT_TRUE(db.LookupStatistics(statistics, "/r/"));  // Trailing separator
+  ASSERT_EQ(3u, statistics.files_);
+
+  ASSERT_TRUE(db.LookupStatistics(statistics, "/r/s"));
+  ASSERT_EQ(1u, statistics.files_);
+  ASSERT_EQ(20u, statistics.size_);
+
+  ASSERT_TRUE(db.LookupStatistics(statistics, "/"));
+  ASSERT_EQ(4u, statistics.files_);
+  ASSERT_EQ(34u, statistics.size_);
+
+  ASSERT_TRUE(db.RemoveFile("/r/s/c.dcm"));
+  ASSERT_FALSE(db.LookupStatistics(statistics, "/r/s"));  // Empty directories are forgotten
+  ASSERT_TRUE(db.LookupStatistics(statistics, "/r"));
+  ASSERT_EQ(2u, statistics.files_);
+  ASSERT_EQ(1u, statistics.dicomFiles_);
+  ASSERT_EQ(13u, statistics.size_);
+  ASSERT_EQ(5, statistics.lastChange_);  // Not lowered by the removals
+
+  // A file whose content is modified is removed, then indexed again
+  ASSERT_FALSE(db.RemoveFile("/r/b.txt"));
+  db.AddNonDicomFile("/r/b.txt", 3, 30);
+  ASSERT_TRUE(db.LookupStatistics(statistics, "/r"));
+  ASSERT_EQ(2u, statistics.files_);
+  ASSERT_EQ(40u, statistics.size_);
+}
+
+
+TEST(StoragePlacement, Policies)
+{
+  ASSERT_EQ(StoragePlacement::Policy_RoundRobin, StoragePlacement::ParsePolicy("RoundRobin"));
+  ASSERT_EQ(StoragePlacement::Policy_MostFreeSpace, StoragePlacement::ParsePolicy("MostFreeSpace"));
+  ASSERT_EQ(StoragePlacement::Policy_SeriesHash, StoragePlacement::ParsePolicy("SeriesHash"));
+  ASSERT_THROW(StoragePlacement::ParsePolicy("Nope"), Orthanc::OrthancException);
+
+  std::list<std::string> roots;
+  ASSERT_THROW(StoragePlacement(roots, StoragePlacement::Policy_RoundRobin), Orthanc::OrthancException);
+
+  roots.push_back("/nonexistent/storage");
+  roots.push_back(".");
+  roots.push_back("/nonexistent/storage2");
+
+  {
+    StoragePlacement placement(roots, StoragePlacement::Policy_RoundRobin);
+    ASSERT_EQ(3u, placement.GetRootsCount());
+    ASSERT_EQ(".", placement.GetRoot(1));
+    ASSERT_THROW(placement.GetRoot(3), Orthanc::OrthancException);
+    ASSERT_EQ(0u, placement.ChooseRoot("series", 10));
+    ASSERT_EQ(1u, placement.ChooseRoot("series", 10));
+    ASSERT_EQ(2u, placement.ChooseRoot("series", 10));
+    ASSERT_EQ(0u, placement.ChooseRoot("series", 10));
+  }
+
+  {
+    // The only existing directory has the most free space
+    StoragePlacement placement(roots, StoragePlacement::Policy_MostFreeSpace);
+
+    uintmax_t available;
+    ASSERT_FALSE(placement.LookupFreeSpace(available, 1));  // Not measured yet
+
+    placement.RefreshFreeSpace();
+    ASSERT_FALSE(placement.LookupFreeSpace(available, 0));
+    ASSERT_TRUE(placement.LookupFreeSpace(available, 1));
+    ASSERT_THROW(placement.LookupFreeSpace(available, 3), Orthanc::OrthancException);
+
+    ASSERT_EQ(1u, placement.ChooseRoot("series", 10));
+    ASSERT_EQ(1u, placement.ChooseRoot("series", 10));
+  }
+
+  {
+    StoragePlacement placement(roots, StoragePlacement::Policy_SeriesHash);
+    std::set<size_t> chosen;
+    for (unsigned int i = 0; i < 100; i++)
+    {
+      const std::string series = "1.2.3." + boost::lexical_cast<std::string>(i);
+      const size_t root = placement.ChooseRoot(series, 10);
+      ASSERT_EQ(root, placement.ChooseRoot(series, 20));
+      chosen.insert(root);
+    }
+
+    ASSERT_EQ(3u, chosen.size());
+  }
+}
+
+
+TEST(IndexerDatabase, ReceivedFiles)
+{
+  IndexerDatabase db;
+  db.OpenInMemory();
+
+  db.AddDicomInstance("/disk1/a.dcm", 42, 5, "instance1");
+  db.StoreReceivedFile("/disk1/a.dcm", "/disk1");
+
+  std::string root;
+  ASSERT_TRUE(db.LookupReceivedFile(root, "/disk1/a.dcm"));
+  ASSERT_EQ("/disk1", root);
+  ASSERT_FALSE(db.LookupReceivedFile(root, "/disk2/a.dcm"));
+
+  ASSERT_TRUE(db.RemoveFile("/disk1/a.dcm"));
+  ASSERT_FALSE(db.LookupReceivedFile(root, "/disk1/a.dcm"));
+}
+
+
+#if defined(__linux__)
+static void LowerPriority(bool* success,
+                          int* nice)
+{
+  *success = ThreadPriority::ApplyToCurrentThread(ThreadPriority::Level_Low);
+  *nice = getpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)));
+}
+
+
+static void EnterFilesystemSection(bool* success,
+                                   int* inside,
+                                   int* after)
+{
+  // "IOPRIO_WHO_PROCESS" is 1, and the class is above bit 13
+  *success = ThreadPriority::ApplyToCurrentThread(ThreadPriority::Level_Idle);
+
+  {
+    ThreadPriority::FilesystemSection section(ThreadPriority::Level_Idle);
+    *inside = static_cast<int>(syscall(SYS_ioprio_get, 1, 0)) >> 13;
+  }
+
+  *after = static_cast<int>(syscall(SYS_ioprio_get, 1, 0)) >> 13;
+}
+#endif
+
+
+TEST(ThreadPriority, Basic)
+{
+  ASSERT_EQ(ThreadPriority::Level_Normal, ThreadPriority::Parse("Normal"));
+  ASSERT_EQ(ThreadPriority::Level_Low, ThreadPriority::Parse("Low"));
+  ASSERT_EQ(ThreadPriority::Level_Idle, ThreadPriority::Parse("Idle"));
+  ASSERT_THROW(ThreadPriority::Parse("High"), Orthanc::OrthancException);
+  ASSERT_EQ("Idle", std::string(ThreadPriority::Format(ThreadPriority::Level_Idle)));
+
+  ASSERT_TRUE(ThreadPriority::ApplyToCurrentThread(ThreadPriority::Level_Normal));
+
+#if defined(__linux__)
+  // Only the calling thread is affected
+  const int before = getpriority(PRIO_PROCESS, 0);
+
+  bool success = false;
+  int nice = 0;
+  boost::thread thread(LowerPriority, &success, &nice);
+  thread.join();
+
+  if (success)
+  {
+    ASSERT_EQ(10, nice);
+  }
+
+  ASSERT_EQ(before, getpriority(PRIO_PROCESS, 0));
+
+  // The idle I/O class is left at the end of the filesystem section
+  int inside = 0;
+  int after = 0;
+  boost::thread idle(EnterFilesystemSection, &success, &inside, &after);
+  idle.join();
+
+  if (success)
+  {
+    ASSERT_EQ(3, inside);  // IOPRIO_CLASS_IDLE
+    ASSERT_EQ(2, after);   // IOPRIO_CLASS_BE
+  }
+#endif
+}
+
+
+namespace
+{
+  class FakeConsumer : public MemoryBudget::IConsumer
+  {
+  private:
+    uint64_t  usage_;
+
+  public:
+    explicit FakeConsumer(uint64_t usage) :
+      usage_(usage)
+    {
+    }
+
+    void SetUsage(uint64_t usage)
+    {
+      usage_ = usage;
+    }
+
+    virtual uint64_t GetMemoryUsage() ORTHANC_OVERRIDE
+    {
+      return usage_;
+    }
+
+    virtual void ShrinkMemory(uint64_t target) ORTHANC_OVERRIDE
+    {
+      usage_ = std::min(usage_, target);
+    }
+  };
+}
+
+
+TEST(MemoryBudget, Basic)
+{
+  ASSERT_THROW(MemoryBudget(0, 0.9f), Orthanc::OrthancException);
+  ASSERT_THROW(MemoryBudget(100, 0.0f), Orthanc::OrthancException);
+  ASSERT_THROW(MemoryBudget(100, 1.5f), Orthanc::OrthancException);
+
+  MemoryBudget budget(1000, 0.9f);
+
+  FakeConsumer a(0), b(0);
+  budget.Register("a", a, 3);
+  budget.Register("b", b, 1);
+  ASSERT_THROW(budget.Register("a", b, 1), Orthanc::OrthancException);
+  ASSERT_THROW(budget.Register("c", a, 1), Orthanc::OrthancException);
+
+  // Below the ceiling, a component can exceed its share
+  a.SetUsage(900);
+  b.SetUsage(50);
+  ASSERT_EQ(950u, budget.Enforce(false));
+  ASSERT_EQ(900u, a.GetMemoryUsage());
+
+  // Above the ceiling, only the components above their share shrink
+  b.SetUsage(200);
+  ASSERT_EQ(950u, budget.Enforce(false));
+  ASSERT_EQ(750u, a.GetMemoryUsage());
+  ASSERT_EQ(200u, b.GetMemoryUsage());
+
+  // The ceiling is halved under memory pressure
+  ASSERT_EQ(500u, budget.Enforce(true));
+  ASSERT_EQ(375u, a.GetMemoryUsage());
+  ASSERT_EQ(125u, b.GetMemoryUsage());
+
+  ASSERT_FALSE(budget.IsUnderPressure(89, 100));
+  ASSERT_TRUE(budget.IsUnderPressure(90, 100));
+  ASSERT_FALSE(budget.IsUnderPressure(90, 0));
+
+  Json::Value json;
+  budget.Format(json);
+  ASSERT_EQ(1000u, json["Ceiling"].asUInt64());
+  ASSERT_TRUE(json["UnderPressure"].asBool());
+  ASSERT_EQ(500u, json["Usage"].asUInt64());
+  ASSERT_EQ(2u, json["Components"].size());
+  ASSERT_EQ("a", json["Components"][0]["Name"].asString());
+  ASSERT_EQ(375u, json["Components"][0]["Share"].asUInt64());  // Halved under pressure
+  ASSERT_EQ(2u, json["Components"][0]["Shrinks"].asUInt());
+
+  budget.Unregister(a);
+  b.SetUsage(2000);
+  ASSERT_EQ(1000u, budget.Enforce(false));  // "b" gets the whole ceiling
+
+  std::string unified, memory;
+  MemoryBudget::ParseCgroups(unified, memory, "0::/system.slice/orthanc.service\n");
+  ASSERT_EQ("/system.slice/orthanc.service", unified);
+  ASSERT_TRUE(memory.empty());
+
+  MemoryBudget::ParseCgroups(unified, memory, "12:cpu,cpuacct:/a\n4:memory:/docker/42\n1:name=systemd:/b\n0::/");
+  ASSERT_EQ("/", unified);
+  ASSERT_EQ("/docker/42", memory);
+
+  MemoryBudget::ParseCgroups(unified, memory, "");
+  ASSERT_TRUE(unified.empty());
+  ASSERT_TRUE(memory.empty());
+}
+
+
+TEST(ReadCache, ShrinkMemory)
+{
+  ReadCache cache(100, 10, 1);
+  cache.Store("a", 42, "Hello", 5);
+  cache.Store("b", 42, "World", 5);
+  cache.Store("c", 42, "Orth", 4);
+  ASSERT_EQ(14u, cache.GetMemoryUsage());
+
+  cache.ShrinkMemory(9);
+  ASSERT_EQ(9u, cache.GetMemoryUsage());
+
+  ReadCache::Content content;
+  ASSERT_FALSE(cache.Lookup(content, "a", 42, 5));  // Least recently used
+  ASSERT_TRUE(cache.Lookup(content, "c", 42, 4));
+}
+
+
+TEST(CacheArea, Basic)
+{
+  IndexerDatabase db;
+  db.OpenInMemory();
+
+  ASSERT_THROW(CacheArea(db, 0), Orthanc::OrthancException);
+
+  uint64_t size;
+  size_t count;
+  IndexerDatabase::CacheAttachment victim;
+
+  {
+    CacheArea area(db, 25);
+    area.Add("uuid1", "instance1", 3, 10);
+    area.Add("uuid2", "instance2", 3, 10);
+    ASSERT_FALSE(area.SelectVictim(victim));
+
+    area.Add("uuid3", "instance3", 3, 10);
+    area.GetStatistics(size, count);
+    ASSERT_EQ(30u, size);
+    ASSERT_EQ(3u, count);
+
+    ASSERT_TRUE(area.SelectVictim(victim));
+    ASSERT_EQ("uuid1", victim.uuid_);
+    ASSERT_EQ("instance1", victim.instanceId_);
+    ASSERT_EQ(3, victim.type_);
+    ASSERT_EQ(10u, victim.size_);
+
+    area.Touch("uuid1");
+    area.Touch("nope");
+    ASSERT_TRUE(area.SelectVictim(victim));
+    ASSERT_EQ("uuid2", victim.uuid_);
+
+    area.Remove("uuid2");
+    area.Remove("uuid2");
+    ASSERT_FALSE(area.SelectVictim(victim));
+    area.GetStatistics(size, count);
+    ASSERT_EQ(20u, size);
+    ASSERT_EQ(2u, count);
+  }
+
+  {
+    // Reloaded from the database, in the order of insertion
+    CacheArea area(db, 15);
+    area.GetStatistics(size, count);
+    ASSERT_EQ(20u, size);
+    ASSERT_EQ(2u, count);
+
+    ASSERT_TRUE(area.SelectVictim(victim));
+    ASSERT_EQ("uuid1", victim.uuid_);
+  }
+}
+
+
+namespace
+{
+  class StorageCommitmentScpWithoutOrthanc : public StorageCommitmentScp
+  {
+  protected:
+    virtual bool LookupInOrthanc(const std::string& sopInstanceUid) ORTHANC_OVERRIDE
+    {
+      return (sopInstanceUid == "sopOrthanc");
+    }
+
+  public:
+    StorageCommitmentScpWithoutOrthanc(IndexerDatabase& database,
+                                       const char* const* sopInstanceUids,
+                                       uint32_t countInstances) :
+      StorageCommitmentScp(database, sopInstanceUids, countInstances)
+    {
+    }
+  };
+}
+
+
+TEST(StorageCommitmentScp, Basic)
+{
+  const std::string folder = "StorageCommitmentTests";
+  Orthanc::SystemToolbox::MakeDirectory(folder);
+
+  IndexerDatabase db;
+  db.OpenInMemory();
+
+  // "sop1" has two copies, only the second of which is on the disk
+  Orthanc::SystemToolbox::WriteFile("Hello", folder + "/b.dcm");
+  db.AddDicomInstance(folder + "/a.dcm", 42, 5, "instance1");
+  db.AddDicomInstance(folder + "/b.dcm", 42, 5, "instance1");
+  db.StoreInstance("instance1", "series", "sop1");
+  db.AddAttachment("uuid1", "instance1");
+
+  // "sop2" is indexed and stored by Orthanc, but its file is missing
+  db.AddDicomInstance(folder + "/c.dcm", 42, 5, "instance2");
+  db.StoreInstance("instance2", "series", "sop2");
+  db.AddAttachment("uuid2", "instance2");
+
+  // "sop3" is indexed, but not stored by Orthanc
+  Orthanc::SystemToolbox::WriteFile("Hello", folder + "/d.dcm");
+  db.AddDicomInstance(folder + "/d.dcm", 42, 5, "instance3");
+  db.StoreInstance("instance3", "series", "sop3");
+
+  const char* const uids[] = { "sop1", "sop2", "sop3", "sopOrthanc", "sopNope" };
+  StorageCommitmentScpWithoutOrthanc scp(db, uids, 5);
+
+  ASSERT_EQ(OrthancPluginStorageCommitmentFailureReason_Success, scp.Lookup("class", "sop1"));
+  ASSERT_EQ(OrthancPluginStorageCommitmentFailureReason_NoSuchObjectInstance, scp.Lookup("class", "sop2"));
+  ASSERT_EQ(OrthancPluginStorageCommitmentFailureReason_NoSuchObjectInstance, scp.Lookup("class", "sop3"));
+  ASSERT_EQ(OrthancPluginStorageCommitmentFailureReason_Success, scp.Lookup("class", "sopOrthanc"));
+  ASSERT_EQ(OrthancPluginStorageCommitmentFailureReason_NoSuchObjectInstance, scp.Lookup("class", "sopNope"));
+
+  Orthanc::SystemToolbox::RemoveFile(folder + "/b.dcm");
+  Orthanc::SystemToolbox::RemoveFile(folder + "/d.dcm");
+}
+
+
+static void AppendMetaElement(std::string& target,
+                              uint16_t element,
+                              const std::string& vr,
+                              const std::string& value)
+{
+  target.push_back(0x02);
+  target.push_back(0x00);
+  target.push_back(static_cast<char>(element & 0xff));
+  target.push_back(static_cast<char>(element >> 8));
+  target += vr;
+
+  if (vr == "OB")
+  {
+    target.push_back(0x00);
+    target.push_back(0x00);
+
+    for (unsigned int i = 0; i < 4; i++)
+    {
+      target.push_back(static_cast<char>((value.size() >> (8 * i)) & 0xff));
+    }
+  }
+  else
+  {
+    target.push_back(static_cast<char>(value.size() & 0xff));
+    target.push_back(static_cast<char>(value.size() >> 8));
+  }
+
+  target += value;
+}
+
+
+static std::string CreateMetaHeader(const std::string& sopInstanceUid,
+                                    const std::string& transferSyntax = "1.2.840.10008.1.2.1")
+{
+  std::string header(128, '\0');
+  header += "DICM";
+  AppendMetaElement(header, 0x0001, "OB", std::string("\0\1", 2));
+  AppendMetaElement(header, 0x0002, "UI", std::string("1.2.840.10008.5.1.4.1.1.7\0", 26));
+  AppendMetaElement(header, 0x0003, "UI", (sopInstanceUid.size() % 2 == 1 ? sopInstanceUid + '\0' : sopInstanceUid));
+  AppendMetaElement(header, 0x0010, "UI", (transferSyntax.size() % 2 == 1 ? transferSyntax + '\0' : transferSyntax));
+  return header;
+}
+
+
+TEST(DuplicateFilter, Basic)
+{
+  ASSERT_EQ(DuplicateFilter::Policy_Store, DuplicateFilter::ParsePolicy("Store"));
+  ASSERT_EQ(DuplicateFilter::Policy_Acknowledge, DuplicateFilter::ParsePolicy("Acknowledge"));
+  ASSERT_EQ(DuplicateFilter::Policy_Reject, DuplicateFilter::ParsePolicy("Reject"));
+  ASSERT_THROW(DuplicateFilter::ParsePolicy("Nope"), Orthanc::OrthancException);
+
+  std::string uid;
+  const std::string odd = CreateMetaHeader("1.2.3");
+  ASSERT_TRUE(DuplicateFilter::ReadSopInstanceUid(uid, odd.c_str(), odd.size()));
+  ASSERT_EQ("1.2.3", uid);
+
+  const std::string even = CreateMetaHeader("1.2.34");
+  ASSERT_TRUE(DuplicateFilter::ReadSopInstanceUid(uid, even.c_str(), even.size()));
+  ASSERT_EQ("1.2.34", uid);
+  ASSERT_FALSE(DuplicateFilter::ReadSopInstanceUid(uid, even.c_str(), even.size() - 1));  // Truncated
+  ASSERT_FALSE(DuplicateFilter::ReadSopInstanceUid(uid, even.c_str(), 100));
+  ASSERT_FALSE(DuplicateFilter::ReadSopInstanceUid(uid, "Hello", 5));
+
+  IndexerDatabase db;
+  db.OpenInMemory();
+  db.AddDicomInstance("/a.dcm", 42, 5, "instance1");
+  db.StoreInstance("instance1", "series", "1.2.34");
+  db.AddDicomInstance("/b.dcm", 42, 5, "instance2");
+  db.StoreInstance("instance2", "series", "1.2.3");
+
+  DuplicateFilter store(db, DuplicateFilter::Policy_Store);
+  DuplicateFilter acknowledge(db, DuplicateFilter::Policy_Acknowledge);
+  DuplicateFilter reject(db, DuplicateFilter::Policy_Reject);
+
+  // Indexed, but not stored by Orthanc yet
+  ASSERT_EQ(DuplicateFilter::Decision_Store, acknowledge.Apply(even.c_str(), even.size()));
+
+  db.AddAttachment("uuid1", "instance1");
+  ASSERT_EQ(DuplicateFilter::Decision_Store, store.Apply(even.c_str(), even.size()));
+  ASSERT_EQ(DuplicateFilter::Decision_Discard, acknowledge.Apply(even.c_str(), even.size()));
+  ASSERT_EQ(DuplicateFilter::Decision_Reject, reject.Apply(even.c_str(), even.size()));
+  ASSERT_EQ(DuplicateFilter::Decision_Store, acknowledge.Apply(odd.c_str(), odd.size()));
+
+  ASSERT_EQ(0u, store.GetDuplicatesCount());
+  ASSERT_EQ(1u, acknowledge.GetDuplicatesCount());
+  ASSERT_EQ(1u, reject.GetDuplicatesCount());
+}
+
+
+namespace
+{
+  class FakeDerivedStorage : public DerivedStorage
+  {
+  protected:
+    virtual void Transcode(std::string& target,
+                           const std::string& source) ORTHANC_OVERRIDE
+    {
+      target = "Transcoded " + boost::lexical_cast<std::string>(source.size());
+    }
+
+  public:
+    FakeDerivedStorage(IndexerDatabase& database,
+                       const std::string& root,
+                       uint64_t maximumSize) :
+      DerivedStorage(database, root, "1.2.840.10008.1.2.4.80", maximumSize)
+    {
+    }
+  };
+}
+
+
+TEST(DerivedStorage, Basic)
+{
+  ASSERT_TRUE(DerivedStorage::IsJpeg2000("1.2.840.10008.1.2.4.90"));
+  ASSERT_TRUE(DerivedStorage::IsJpeg2000("1.2.840.10008.1.2.4.91"));
+  ASSERT_FALSE(DerivedStorage::IsJpeg2000("1.2.840.10008.1.2.4.50"));
+  ASSERT_TRUE(DerivedStorage::IsLossless("1.2.840.10008.1.2.4.80"));
+  ASSERT_FALSE(DerivedStorage::IsLossless("1.2.840.10008.1.2.4.50"));
+  ASSERT_FALSE(DerivedStorage::IsLossless("1.2.840.10008.1.2.4.81"));
+  ASSERT_FALSE(DerivedStorage::IsLossless("1.2.840.10008.1.2.4.203"));
+
+  const std::string folder = "DerivedStorageTests";
+  Orthanc::SystemToolbox::MakeDirectory(folder);
+
+  IndexerDatabase db;
+  db.OpenInMemory();
+
+  ASSERT_THROW(DerivedStorage(db, folder + "/derived", "1.2.840.10008.1.2.4.90", 0), Orthanc::OrthancException);
+  ASSERT_THROW(DerivedStorage(db, folder + "/derived", "1.2.840.10008.1.2.4.50", 0), Orthanc::OrthancException);
+
+  const std::string a = folder + "/a.dcm";
+  const std::string b = folder + "/b.dcm";
+  Orthanc::SystemToolbox::WriteFile(CreateMetaHeader("1.2.3", "1.2.840.10008.1.2.4.90"), a);
+  Orthanc::SystemToolbox::WriteFile(CreateMetaHeader("1.2.4"), b);
+
+  db.AddDicomInstance(a, boost::filesystem::last_write_time(a), boost::filesystem::file_size(a), "instance1");
+  db.AddDicomInstance(b, boost::filesystem::last_write_time(b), boost::filesystem::file_size(b), "instance2");
+
+  FakeDerivedStorage storage(db, folder + "/derived", 0);
+  ASSERT_FALSE(storage.Step());  // Not stored by Orthanc yet
+
+  db.AddAttachment("uuid1", "instance1");
+  db.AddAttachment("uuid2", "instance2");
+
+  ASSERT_TRUE(storage.Step());   // Transcodes "a"
+  ASSERT_TRUE(storage.Step());   // "b" is not JPEG 2000
+  ASSERT_TRUE(storage.Step());   // Back to the beginning of the index
+  ASSERT_FALSE(storage.Step());
+
+  std::string derived, content;
+  ASSERT_TRUE(storage.LookupCopy(derived, a));
+  Orthanc::SystemToolbox::ReadFile(content, derived);
+  ASSERT_EQ("Transcoded " + boost::lexical_cast<std::string>(boost::filesystem::file_size(a)), content);
+  ASSERT_FALSE(storage.LookupCopy(derived, b));
+  ASSERT_FALSE(storage.LookupCopy(derived, folder + "/nope.dcm"));
+
+  uint64_t transcoded, failures, skipped;
+  storage.GetStatistics(transcoded, failures, skipped);
+  ASSERT_EQ(1u, transcoded);
+  ASSERT_EQ(0u, failures);
+  ASSERT_EQ(0u, skipped);
+
+  {
+    // The files that are too large for the memory are skipped
+    IndexerDatabase db2;
+    db2.OpenInMemory();
+    db2.AddDicomInstance(a, boost::filesystem::last_write_time(a), boost::filesystem::file_size(a), "instance1");
+    db2.AddAttachment("uuid1", "instance1");
+
+    FakeDerivedStorage small(db2, folder + "/derived2", boost::filesystem::file_size(a) - 1);
+    ASSERT_TRUE(small.Step());
+    ASSERT_FALSE(small.LookupCopy(derived, a));
+
+    small.GetStatistics(transcoded, failures, skipped);
+    ASSERT_EQ(0u, transcoded);
+    ASSERT_EQ(0u, failures);
+    ASSERT_EQ(1u, skipped);
+  }
+
+  // The copy is deleted together with its original
+  ASSERT_TRUE(storage.LookupCopy(derived, a));
+  db.RemoveFile(a);
+  ASSERT_TRUE(boost::filesystem::exists(derived));
+  ASSERT_TRUE(storage.Step());
+  ASSERT_FALSE(boost::filesystem::exists(derived));
+  ASSERT_FALSE(storage.LookupCopy(derived, a));
+
+  Orthanc::SystemToolbox::RemoveFile(a);
+  Orthanc::SystemToolbox::RemoveFile(b);
+}
+
+
+TEST(DeviceQueues, Basic)
+{
+  ASSERT_THROW(DeviceQueues(0, 16, 4, 60), Orthanc::OrthancException);
+  ASSERT_THROW(DeviceQueues(2, 16, 4, 0), Orthanc::OrthancException);
+
+  // Fake sysfs with a solid-state disk "sda", whose partition "sda1"
+  // has no request queue of its own
+  const boost::filesystem::path sysfs = "DeviceQueuesTests";
+  boost::filesystem::remove_all(sysfs);
+  boost::filesystem::create_directories(sysfs / "devices" / "sda" / "queue");
+  boost::filesystem::create_directories(sysfs / "devices" / "sda" / "sda1");
+  boost::filesystem::create_directories(sysfs / "dev" / "block");
+  boost::filesystem::create_symlink("../../devices/sda", sysfs / "dev" / "block" / "8:0");
+  boost::filesystem::create_symlink("../../devices/sda/sda1", sysfs / "dev" / "block" / "8:1");
+  Orthanc::SystemToolbox::WriteFile(std::string("0\n"), (sysfs / "devices" / "sda" / "queue" / "rotational").string());
+  Orthanc::SystemToolbox::WriteFile(std::string("8\n"), (sysfs / "devices" / "sda" / "queue" / "nr_requests").string());
+
+  DeviceQueues::DeviceInfo info;
+  ASSERT_TRUE(DeviceQueues::ProbeDevice(info, 8, 0, sysfs.string()));
+  ASSERT_EQ("sda", info.name_);
+  ASSERT_EQ(DeviceQueues::DeviceType_SolidState, info.type_);
+  ASSERT_EQ(8u, info.queueDepth_);
+
+  ASSERT_TRUE(DeviceQueues::ProbeDevice(info, 8, 1, sysfs.string()));
+  ASSERT_EQ("sda1", info.name_);
+  ASSERT_EQ(DeviceQueues::DeviceType_SolidState, info.type_);
+
+  ASSERT_FALSE(DeviceQueues::ProbeDevice(info, 8, 2, sysfs.string()));
+
+  Orthanc::SystemToolbox::WriteFile(std::string("1\n"), (sysfs / "devices" / "sda" / "queue" / "rotational").string());
+  ASSERT_TRUE(DeviceQueues::ProbeDevice(info, 8, 1, sysfs.string()));
+  ASSERT_EQ(DeviceQueues::DeviceType_Rotational, info.type_);
+
+  // Inaccessible roots get their own queue, as unknown devices
+  DeviceQueues queues(2, 16, 3, 1 /* wait timeout */, sysfs.string());
+  const size_t a = queues.Register("/nonexistent/a");
+  const size_t b = queues.Register("/nonexistent/b");
+  ASSERT_NE(a, b);
+  ASSERT_EQ(3u, queues.GetLimit(a, DeviceQueues::Operation_Read));
+  ASSERT_EQ(12u, queues.GetLimit(a, DeviceQueues::Operation_Stat));
+
+  // Two folders of the same filesystem share their queue
+  const size_t c = queues.Register(sysfs.string());
+  ASSERT_EQ(c, queues.Register((sysfs / "devices").string()));
+
+  {
+    DeviceQueues::Slot slot1(queues, a, DeviceQueues::Operation_Read);
+    DeviceQueues::Slot slot2(queues, a, DeviceQueues::Operation_Stat);
+
+    Json::Value json;
+    queues.Format(json);
+    ASSERT_EQ(3u, json.size());
+    ASSERT_EQ("/nonexistent/a", json[0]["Name"].asString());
+    ASSERT_EQ("Unknown", json[0]["Type"].asString());
+    ASSERT_EQ(1u, json[0]["ActiveReads"].asUInt());
+    ASSERT_EQ(1u, json[0]["ActiveStats"].asUInt());
+    ASSERT_EQ(0u, json[1]["ActiveReads"].asUInt());
+  }
+
+  Json::Value json;
+  queues.Format(json);
+  ASSERT_EQ(0u, json[0]["ActiveReads"].asUInt());
+  ASSERT_EQ(0u, json[0]["ActiveStats"].asUInt());
+
+  {
+    // The slots of stalled operations are overcommitted after the wait timeout
+    DeviceQueues::Slot slot1(queues, a, DeviceQueues::Operation_Read);
+    DeviceQueues::Slot slot2(queues, a, DeviceQueues::Operation_Read);
+    DeviceQueues::Slot slot3(queues, a, DeviceQueues::Operation_Read);
+    ASSERT_EQ(0u, queues.GetOvercommitsCount());
+
+    {
+      DeviceQueues::Slot slot4(queues, a, DeviceQueues::Operation_Read);
+      ASSERT_EQ(1u, queues.GetOvercommitsCount());
+
+      queues.Format(json);
+      ASSERT_EQ(4u, json[0]["ActiveReads"].asUInt());
+    }
+
+    // No more limit once stopped
+    queues.Stop();
+    DeviceQueues::Slot slot4(queues, a, DeviceQueues::Operation_Read);
+    ASSERT_EQ(1u, queues.GetOvercommitsCount());
+  }
+
+  queues.Format(json);
+  ASSERT_EQ(0u, json[0]["ActiveReads"].asUInt());
+
+  boost::filesystem::remove_all(sysfs);
+}
+
+
+namespace
+{
+  class SummingHandler : public ChunkWorkers::IHandler
+  {
+  private:
+    boost::mutex  mutex_;
+    size_t        count_;
+    size_t        abortAfter_;
+
+  public:
+    explicit SummingHandler(size_t abortAfter) :
+      count_(0),
+      abortAfter_(abortAfter)
+    {
+    }
+
+    virtual bool Process(size_t /* worker */,
+                         const ChunkWorkers::Chunk& chunk) ORTHANC_OVERRIDE
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      count_ += chunk.size();
+      return count_ < abortAfter_;
+    }
+
+    size_t GetCount()
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      return count_;
+    }
+  };
+}
+
+
+TEST(DirectoryReader, Basic)
+{
+  ASSERT_THROW(DirectoryReader("nope", 64 * 1024), Orthanc::OrthancException);
+
+  const boost::filesystem::path folder = "DirectoryReaderTests";
+  boost::filesystem::remove_all(folder);
+  boost::filesystem::create_directories(folder / "subdirectory");
+
+  for (unsigned int i = 0; i < 500; i++)
+  {
+    Orthanc::SystemToolbox::WriteFile(std::string("x"), (folder / ("file-" + boost::lexical_cast<std::string>(i))).string());
+  }
+
+  DirectoryReader reader(folder.string(), 1024);  // Forces many small batches
+
+  std::set<std::string> names;
+  std::vector<std::string> batch;
+  unsigned int batches = 0;
+
+  while (reader.ReadBatch(batch))
+  {
+    ASSERT_LE(batch.size(), 1024u / 24u);
+    names.insert(batch.begin(), batch.end());
+    batches++;
+  }
+
+  ASSERT_GT(batches, 1u);
+  ASSERT_EQ(501u, names.size());
+  ASSERT_TRUE(names.find("subdirectory") != names.end());
+  ASSERT_TRUE(names.find("file-499") != names.end());
+  ASSERT_TRUE(names.find(".") == names.end());
+  ASSERT_TRUE(names.find("..") == names.end());
+  ASSERT_FALSE(reader.ReadBatch(batch));
+
+  boost::filesystem::remove_all(folder);
+}
+
+
+TEST(ChunkWorkers, Basic)
+{
+  {
+    SummingHandler handler(1000000);
+    ASSERT_THROW(ChunkWorkers(handler, 0, 4, ThreadPriority::Level_Normal), Orthanc::OrthancException);
+
+    ChunkWorkers workers(handler, 4, 2, ThreadPriority::Level_Normal);
+
+    for (unsigned int i = 0; i < 100; i++)
+    {
+      ChunkWorkers::Chunk chunk(10, "a");
+      ASSERT_TRUE(workers.Push(chunk));
+      ASSERT_TRUE(chunk.empty());
+    }
+
+    ASSERT_TRUE(workers.Join());
+    ASSERT_EQ(1000u, handler.GetCount());
+
+    ChunkWorkers::Chunk chunk(10, "a");
+    ASSERT_THROW(workers.Push(chunk), Orthanc::OrthancException);
+  }
+
+  {
+    // The handler abandons the directory after 50 entries
+    SummingHandler handler(50);
+    ChunkWorkers workers(handler, 2, 1, ThreadPriority::Level_Normal);
+
+    bool success = true;
+    for (unsigned int i = 0; i < 100 && success; i++)
+    {
+      ChunkWorkers::Chunk chunk(10, "a");
+      success = workers.Push(chunk);
+    }
+
+    ASSERT_FALSE(workers.Join());
+    ASSERT_LT(handler.GetCount(), 1000u);
+  }
+}
+
+namespace
+{
+  class SlowReader : public RangeCoalescer::IReader
+  {
+  private:
+    std::string   content_;
+    boost::mutex  mutex_;
+    unsigned int  reads_;
+
+  public:
+    explicit SlowReader(const std::string& content) :
+      content_(content),
+      reads_(0)
+    {
+    }
+
+    virtual void Read(void* target,
+                      const std::string& path,
+                      uint64_t start,
+                      uint64_t length) ORTHANC_OVERRIDE
+    {
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+        reads_++;
+      }
+
+      boost::this_thread::sleep(boost::posix_time::milliseconds(200));
+
+      if (start + length > content_.size())
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_CorruptedFile);
+      }
+      else
+      {
+        memcpy(target, content_.c_str() + start, length);
+      }
+    }
+
+    unsigned int GetReadsCount()
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      return reads_;
+    }
+  };
+
+
+  static void ReadRange(std::string* result,
+                        RangeCoalescer* coalescer,
+                        uint64_t start,
+                        uint64_t length)
+  {
+    try
+    {
+      std::string s(length, '\0');
+      coalescer->Read(&s[0], "file", start, length);
+      *result = s;
+    }
+    catch (Orthanc::OrthancException&)
+    {
+      *result = "error";
+    }
+  }
+}
+
+
+TEST(RangeCoalescer, Basic)
+{
+  const std::string content = "abcdefghijklmnopqrstuvwxyz0123";
+
+  {
+    SlowReader reader(content);
+    RangeCoalescer coalescer(reader, 20);
+
+    std::string a, b, c, d, e, f;
+    boost::thread ta(ReadRange, &a, &coalescer, 0, 10);
+    boost::this_thread::sleep(boost::posix_time::milliseconds(50));
+
+    boost::thread tb(ReadRange, &b, &coalescer, 0, 10);   // Identical to a running read
+    boost::thread te(ReadRange, &e, &coalescer, 5, 3);    // Included in a running read
+    boost::thread tc(ReadRange, &c, &coalescer, 8, 7);    // Overlapping a running read
+    boost::this_thread::sleep(boost::posix_time::milliseconds(50));
+    boost::thread td(ReadRange, &d, &coalescer, 13, 5);   // Merged into the pending read
+    boost::thread tf(ReadRange, &f, &coalescer, 0, 25);   // Too large to be coalesced
+
+    ta.join();
+    tb.join();
+    tc.join();
+    td.join();
+    te.join();
+    tf.join();
+
+    ASSERT_EQ("abcdefghij", a);
+    ASSERT_EQ("abcdefghij", b);
+    ASSERT_EQ("ijklmno", c);
+    ASSERT_EQ("nopqr", d);
+    ASSERT_EQ("fgh", e);
+    ASSERT_EQ(content.substr(0, 25), f);
+
+    uint64_t requests, reads, merged;
+    coalescer.GetStatistics(requests, reads, merged);
+    ASSERT_EQ(6u, requests);
+    ASSERT_EQ(3u, reads);
+    ASSERT_EQ(3u, merged);
+    ASSERT_EQ(3u, reader.GetReadsCount());
+  }
+
+  {
+    SlowReader reader(content);
+    RangeCoalescer coalescer(reader, 20);
+
+    std::string a, b, c;
+    boost::thread ta(ReadRange, &a, &coalescer, 0, 10);
+    boost::this_thread::sleep(boost::posix_time::milliseconds(50));
+
+    boost::thread tb(ReadRange, &b, &coalescer, 5, 10);
+    boost::this_thread::sleep(boost::posix_time::milliseconds(50));
+    boost::thread tc(ReadRange, &c, &coalescer, 14, 20);  // Beyond the end of the file
+
+    ta.join();
+    tb.join();
+    tc.join();
+
+    ASSERT_EQ("abcdefghij", a);
+    ASSERT_EQ("fghijklmno", b);
+    ASSERT_EQ("error", c);
+
+    // "b" and "c" were not merged, as the merged range would be too large
+    ASSERT_EQ(3u, reader.GetReadsCount());
+  }
+
+  {
+    // Adjacent ranges don't wait for each other
+    SlowReader reader(content);
+    RangeCoalescer coalescer(reader, 20);
+
+    const boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+
+    std::string a, b;
+    boost::thread ta(ReadRange, &a, &coalescer, 0, 10);
+    boost::this_thread::sleep(boost::posix_time::milliseconds(50));
+    boost::thread tb(ReadRange, &b, &coalescer, 10, 10);
+
+    ta.join();
+    tb.join();
+
+    ASSERT_EQ("abcdefghij", a);
+    ASSERT_EQ("klmnopqrst", b);
+    ASSERT_LT((boost::posix_time::microsec_clock::universal_time() - start).total_milliseconds(), 400);
+
+    uint64_t requests, reads, merged;
+    coalescer.GetStatistics(requests, reads, merged);
+    ASSERT_EQ(2u, reads);
+    ASSERT_EQ(0u, merged);
+  }
+
+  {
+    // A merged read that fails is retried for each request
+    SlowReader reader(content);
+    RangeCoalescer coalescer(reader, 30);
+
+    std::string a, b, c;
+    boost::thread ta(ReadRange, &a, &coalescer, 0, 10);
+    boost::this_thread::sleep(boost::posix_time::milliseconds(50));
+
+    boost::thread tb(ReadRange, &b, &coalescer, 5, 10);
+    boost::this_thread::sleep(boost::posix_time::milliseconds(50));
+    boost::thread tc(ReadRange, &c, &coalescer, 14, 20);  // Beyond the end of the file
+
+    ta.join();
+    tb.join();
+    tc.join();
+
+    ASSERT_EQ("abcdefghij", a);
+    ASSERT_EQ("fghijklmno", b);
+    ASSERT_EQ("error", c);
+
+    // One read for "a", one failed merged read, then one retry for each of "b" and "c"
+    ASSERT_EQ(4u, reader.GetReadsCount());
+  }
+}
+
+
+TEST(SlowLog, Basic)
+{
+  ASSERT_THROW(SlowLog(0, 10), Orthanc::OrthancException);
+  ASSERT_THROW(SlowLog(10, 0), Orthanc::OrthancException);
+
+  SlowLog log(50 /* ms */, 2);
+
+  {
+    // Disabled operation
+    SlowLog::Operation operation(NULL, "disabled", "");
+    SlowLog::Stage stage("sleep");
+    boost::this_thread::sleep(boost::posix_time::milliseconds(60));
+  }
+
+  {
+    // Fast operation
+    SlowLog::Operation operation(&log, "fast", "");
+    SlowLog::Stage stage("nothing");
+  }
+
+  ASSERT_EQ(0u, log.GetSlowCount());
+
+  {
+    SlowLog::Operation operation(&log, "slow", "hello");
+
+    {
+      SlowLog::Stage stage("lock");
+      boost::this_thread::sleep(boost::posix_time::milliseconds(40));
+      stage.Rename("query");
+
+      {
+        SlowLog::Stage inner("io");
+        boost::this_thread::sleep(boost::posix_time::milliseconds(40));
+      }
+    }
+
+    SlowLog::Stage stage("io");
+    boost::this_thread::sleep(boost::posix_time::milliseconds(40));
+  }
+
+  {
+    // Stages outside of an operation are ignored
+    SlowLog::Stage stage("io");
+  }
+
+  ASSERT_EQ(1u, log.GetSlowCount());
+
+  Json::Value json;
+  log.Format(json);
+  ASSERT_EQ(1u, json.size());
+  ASSERT_EQ("slow", json[0]["Operation"].asString());
+  ASSERT_EQ("hello", json[0]["Detail"].asString());
+  ASSERT_GE(json[0]["Duration"].asDouble(), 120.0);
+  ASSERT_GE(json[0]["Stages"]["lock"].asDouble(), 40.0);
+  ASSERT_LT(json[0]["Stages"]["lock"].asDouble(), 80.0);
+  ASSERT_GE(json[0]["Stages"]["io"].asDouble(), 80.0);
+  ASSERT_FALSE(json[0]["Stages"].isMember("nothing"));
+
+  for (unsigned int i = 0; i < 3; i++)
+  {
+    SlowLog::Operation operation(&log, (i == 2 ? "last" : "other"), "");
+    boost::this_thread::sleep(boost::posix_time::milliseconds(60));
+  }
+
+  // Only the most recent operations are kept
+  ASSERT_EQ(4u, log.GetSlowCount());
+  log.Format(json);
+  ASSERT_EQ(2u, json.size());
+  ASSERT_EQ("last", json[0]["Operation"].asString());
+  ASSERT_EQ("other", json[1]["Operation"].asString());
+  ASSERT_GE(json[0]["Stages"]["other"].asDouble(), 60.0);
+}
+
+
+TEST(HeaderPrefetcher, Basic)
+{
+  ASSERT_THROW(HeaderPrefetcher(0, 8), Orthanc::OrthancException);
+  ASSERT_THROW(HeaderPrefetcher(1024, 0), Orthanc::OrthancException);
+
+  const boost::filesystem::path folder = "HeaderPrefetcherTests";
+  boost::filesystem::remove_all(folder);
+  boost::filesystem::create_directories(folder / "subdirectory");
+
+  std::vector<std::string> paths;
+  paths.push_back((folder / "subdirectory").string());
+  paths.push_back((folder / "nope").string());
+
+  for (unsigned int i = 0; i < 40; i++)
+  {
+    paths.push_back((folder / ("file-" + boost::lexical_cast<std::string>(i))).string());
+    Orthanc::SystemToolbox::WriteFile(std::string(10000, 'x'), paths.back());
+  }
+
+  bool isResident;
+  ASSERT_FALSE(HeaderPrefetcher::IsResident(isResident, paths[0], 4096));
+  ASSERT_FALSE(HeaderPrefetcher::IsResident(isResident, paths[1], 4096));
+
+#if defined(__linux__)
+  // The files that were just written are in the page cache
+  ASSERT_TRUE(HeaderPrefetcher::IsResident(isResident, paths[2], 4096));
+  ASSERT_TRUE(isResident);
+#endif
+
+  HeaderPrefetcher prefetcher(4096, 8);
+  ASSERT_EQ(4u, prefetcher.GetLookahead());
+
+  {
+    HeaderPrefetcher::Window window(prefetcher, paths);
+
+    for (size_t i = 0; i < paths.size(); i++)
+    {
+      window.Enter(i);
+    }
+
+    ASSERT_THROW(window.Enter(paths.size()), Orthanc::OrthancException);
+  }
+
+  unsigned int lookahead;
+  uint64_t prefetched, misses;
+  prefetcher.GetStatistics(lookahead, prefetched, misses);
+
+#if defined(__linux__)
+  // The headers of the 40 files were all resident when their turn
+  // came. One out of four is probed, which shrinks the lookahead twice.
+  ASSERT_EQ(40u, prefetched);
+  ASSERT_EQ(0u, misses);
+  ASSERT_EQ(2u, lookahead);
+#endif
+
+  boost::filesystem::remove_all(folder);
+}
+
+
+
 int main(int argc, char **argv)
 {
   Orthanc::Logging::Initialize();
@@ -0,0 +1,204 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "UploadBatch.h"
+
+#include <OrthancException.h>
+
+#include <boost/crc.hpp>
+#include <boost/lexical_cast.hpp>
+
+
+static const size_t    LOCAL_HEADER_SIZE = 30;
+static const size_t    CENTRAL_HEADER_SIZE = 46;
+static const size_t    END_OF_DIRECTORY_SIZE = 22;
+static const size_t    MAXIMUM_ENTRIES = 0xffff;  // No support for ZIP64
+static const uint16_t  VERSION = 10;  // Version 1.0 of the ZIP format (stored entries)
+static const uint16_t  DOS_DATE = (1 << 5) | 1;  // January 1st, 1980
+
+
+static void WriteUInt16(std::string& target,
+                        uint16_t value)
+{
+  target.push_back(static_cast<char>(value & 0xff));
+  target.push_back(static_cast<char>(value >> 8));
+}
+
+
+static void WriteUInt32(std::string& target,
+                        uint32_t value)
+{
+  WriteUInt16(target, static_cast<uint16_t>(value & 0xffff));
+  WriteUInt16(target, static_cast<uint16_t>(value >> 16));
+}
+
+
+UploadBatch::UploadBatch(size_t maximumSize,
+                         size_t maximumFileSize) :
+  maximumSize_(maximumSize),
+  maximumFileSize_(maximumFileSize)
+{
+  if (maximumFileSize == 0 ||
+      maximumSize < maximumFileSize ||
+      static_cast<uint64_t>(maximumSize) >= 0xffffffffu)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+  }
+}
+
+
+const UploadBatch::Entry& UploadBatch::GetEntry(size_t index) const
+{
+  if (index >= entries_.size())
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+  }
+  else
+  {
+    return entries_[index];
+  }
+}
+
+
+const void* UploadBatch::GetContent(size_t index) const
+{
+  const Entry& entry = GetEntry(index);
+  return (entry.size_ == 0 ? NULL : files_.c_str() + entry.offset_);
+}
+
+
+static std::string GetEntryName(size_t index)
+{
+  // The names of the entries are not meaningful, as the results are
+  // mapped back to the files using the Orthanc identifiers
+  return boost::lexical_cast<std::string>(index) + ".dcm";
+}
+
+
+bool UploadBatch::HasRoom(size_t size) const
+{
+  if (!IsBatchable(size))
+  {
+    return false;
+  }
+  else if (entries_.empty())
+  {
+    return true;
+  }
+  else
+  {
+    const size_t added = LOCAL_HEADER_SIZE + CENTRAL_HEADER_SIZE + 2 * GetEntryName(entries_.size()).size() + size;
+
+    return (entries_.size() < MAXIMUM_ENTRIES &&
+            files_.size() + directory_.size() + END_OF_DIRECTORY_SIZE + added <= maximumSize_);
+  }
+}
+
+
+bool UploadBatch::Add(const std::string& path,
+                      const std::string& instanceId,
+                      const void* data,
+                      size_t size)
+{
+  if (!IsBatchable(size))
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+  }
+
+  if (!HasRoom(size))
+  {
+    return false;
+  }
+
+  const std::string name = GetEntryName(entries_.size());
+
+  boost::crc_32_type crc;
+  crc.process_bytes(data, size);
+
+  const uint32_t offset = static_cast<uint32_t>(files_.size());
+
+  WriteUInt32(files_, 0x04034b50);  // Signature of local file header
+  WriteUInt16(files_, VERSION);
+  WriteUInt16(files_, 0);  // Flags
+  WriteUInt16(files_, 0);  // Compression method: Stored
+  WriteUInt16(files_, 0);  // Modification time
+  WriteUInt16(files_, DOS_DATE);
+  WriteUInt32(files_, crc.checksum());
+  WriteUInt32(files_, static_cast<uint32_t>(size));  // Compressed size
+  WriteUInt32(files_, static_cast<uint32_t>(size));  // Uncompressed size
+  WriteUInt16(files_, static_cast<uint16_t>(name.size()));
+  WriteUInt16(files_, 0);  // Length of the extra field
+  files_.append(name);
+
+  Entry entry;
+  entry.path_ = path;
+  entry.instanceId_ = instanceId;
+  entry.offset_ = files_.size();
+  entry.size_ = size;
+  entries_.push_back(entry);
+
+  files_.append(reinterpret_cast<const char*>(data), size);
+
+  WriteUInt32(directory_, 0x02014b50);  // Signature of central directory header
+  WriteUInt16(directory_, VERSION);  // Version made by
+  WriteUInt16(directory_, VERSION);  // Version needed to extract
+  WriteUInt16(directory_, 0);  // Flags
+  WriteUInt16(directory_, 0);  // Compression method: Stored
+  WriteUInt16(directory_, 0);  // Modification time
+  WriteUInt16(directory_, DOS_DATE);
+  WriteUInt32(directory_, crc.checksum());
+  WriteUInt32(directory_, static_cast<uint32_t>(size));  // Compressed size
+  WriteUInt32(directory_, static_cast<uint32_t>(size));  // Uncompressed size
+  WriteUInt16(directory_, static_cast<uint16_t>(name.size()));
+  WriteUInt16(directory_, 0);  // Length of the extra field
+  WriteUInt16(directory_, 0);  // Length of the comment
+  WriteUInt16(directory_, 0);  // Disk number
+  WriteUInt16(directory_, 0);  // Internal attributes
+  WriteUInt32(directory_, 0);  // External attributes
+  WriteUInt32(directory_, offset);
+  directory_.append(name);
+
+  return true;
+}
+
+
+void UploadBatch::FormatArchive(std::string& target) const
+{
+  target.clear();
+  target.reserve(files_.size() + directory_.size() + END_OF_DIRECTORY_SIZE);
+  target.append(files_);
+  target.append(directory_);
+
+  WriteUInt32(target, 0x06054b50);  // Signature of end of central directory
+  WriteUInt16(target, 0);  // Number of this disk
+  WriteUInt16(target, 0);  // Disk where the central directory starts
+  WriteUInt16(target, static_cast<uint16_t>(entries_.size()));  // Entries on this disk
+  WriteUInt16(target, static_cast<uint16_t>(entries_.size()));  // Total number of entries
+  WriteUInt32(target, static_cast<uint32_t>(directory_.size()));
+  WriteUInt32(target, static_cast<uint32_t>(files_.size()));  // Offset of the central directory
+  WriteUInt16(target, 0);  // Length of the comment
+}
+
+
+void UploadBatch::Clear()
+{
+  files_.clear();
+  directory_.clear();
+  entries_.clear();
+}
@@ -0,0 +1,88 @@
+/**
+ * Indexer plugin for Orthanc
+ * Copyright (C) 2021 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+
+/**
+ * Batch of small DICOM instances to be uploaded to Orthanc in a
+ * single call to "POST /instances", packed as an in-memory ZIP
+ * archive whose entries are stored without compression. The content
+ * of each entry remains available, to upload it individually if the
+ * upload of the archive fails.
+ **/
+class UploadBatch : public boost::noncopyable
+{
+public:
+  struct Entry
+  {
+    std::string  path_;
+    std::string  instanceId_;
+    size_t       offset_;  // Offset of the content in the archive
+    size_t       size_;
+  };
+
+private:
+  size_t              maximumSize_;
+  size_t              maximumFileSize_;
+  std::string         files_;      // Local headers, followed by the content of the files
+  std::string         directory_;  // Central directory
+  std::vector<Entry>  entries_;
+
+public:
+  UploadBatch(size_t maximumSize,
+              size_t maximumFileSize);
+
+  bool IsBatchable(size_t size) const
+  {
+    return size <= maximumFileSize_;
+  }
+
+  bool IsEmpty() const
+  {
+    return entries_.empty();
+  }
+
+  size_t GetCount() const
+  {
+    return entries_.size();
+  }
+
+  const Entry& GetEntry(size_t index) const;
+
+  const void* GetContent(size_t index) const;
+
+  // Returns "false" iff. a file of this size would not fit in the batch
+  bool HasRoom(size_t size) const;
+
+  // Returns "false" iff. the batch is full, and must be flushed first
+  bool Add(const std::string& path,
+           const std::string& instanceId,
+           const void* data,
+           size_t size);
+
+  void FormatArchive(std::string& target) const;
+
+  void Clear();
+};
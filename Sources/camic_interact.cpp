@@ -6,6 +6,7 @@
 
 camic_notifier camicroscope;
 std::string camic_notifier::origin;
+std::string camic_notifier::unix_socket;
 
 // Change to 1 for debugging
 #ifndef CURL_VERBOSE
@@ -51,6 +52,40 @@ static size_t response_handler(char *contents, size_t size, size_t nmemb, void *
 
 bool camic_notifier::ready = false;
 
+// Plain HTTP through the Unix domain socket of a caracal running on the same host,
+// which saves the TCP and TLS handshakes of each notification.
+// The host only fills the "Host" header, as the socket decides where the request goes.
+bool camic_notifier::probe_unix_socket(const char *caracal_socket, const char *caracal_host)
+{
+#if LIBCURL_VERSION_NUM >= 0x072800 // CURLOPT_UNIX_SOCKET_PATH appeared in curl 7.40
+    std::string host = (caracal_host && caracal_host[0] != 0) ? caracal_host : "localhost";
+    std::string url = "http://" + host + "/loader/test";
+
+    CURL *curl = curl_easy_init();
+    curl_easy_setopt(curl, CURLOPT_VERBOSE, CURL_VERBOSE);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, NULL);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, response_handler);
+    curl_easy_setopt(curl, CURLOPT_UNIX_SOCKET_PATH, caracal_socket);
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    CURLcode res = curl_easy_perform(curl);
+    curl_easy_cleanup(curl);
+    if (res == CURLE_OK)
+    {
+        origin = "http://" + host;
+        unix_socket = caracal_socket;
+        return true;
+    }
+    fprintf(stderr, "caMicroscope dicomsrv could not connect to caracal through the socket %s: %s\n"
+                    "Falling back to CARACAL_BACK_HOST_PORT.\n",
+            caracal_socket, curl_easy_strerror(res));
+#else
+    (void)caracal_host;
+    fprintf(stderr, "Curl 7.40 or newer is required to use CARACAL_BACK_UNIX_SOCKET=%s, "
+                    "falling back to CARACAL_BACK_HOST_PORT.\n", caracal_socket);
+#endif
+    return false;
+}
+
 void camic_notifier::initialize()
 {
     curl_global_init(CURL_GLOBAL_ALL);
@@ -59,8 +94,19 @@ void camic_notifier::initialize()
         fprintf(stderr, "Curl minimum 7.85 recommended\n");
     }
 
-    // Try HTTPS, then HTTP
+    // A co-located caracal can be reached through its Unix domain socket, e.g.
+    // CARACAL_BACK_UNIX_SOCKET=/run/caracal/caracal.sock
+    // The HTTPS and HTTP probes below are then skipped.
     const char *caracal_host = getenv("CARACAL_BACK_HOST_PORT");
+    const char *caracal_socket = getenv("CARACAL_BACK_UNIX_SOCKET");
+    if (caracal_socket && caracal_socket[0] != 0 &&
+        probe_unix_socket(caracal_socket, caracal_host))
+    {
+        ready = true;
+        return;
+    }
+
+    // Try HTTPS, then HTTP
     if (!caracal_host || caracal_host[0] == 0)
     {
         fprintf(stderr, "ENV var CARACAL_BACK_HOST_PORT is not set, Dicom server won't work well. Set CARACAL_BACK_HOST_PORT=ca-back:1441\n");
@@ -130,6 +176,12 @@ void camic_notifier::notify(std::string url)
     curl_easy_setopt(curl, CURLOPT_VERBOSE, CURL_VERBOSE);
     url = origin + url;
     curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+#if LIBCURL_VERSION_NUM >= 0x072800
+    if (!unix_socket.empty())
+    {
+        curl_easy_setopt(curl, CURLOPT_UNIX_SOCKET_PATH, unix_socket.c_str());
+    }
+#endif
 #ifdef CURL_VERBOSE
     fprintf(stderr, "--URL GET: %s\n", url.c_str());
 #endif
@@ -25,4 +25,7 @@ public:
 private:
     static bool ready;
     static std::string origin; // https://caracal etc.
+    static std::string unix_socket; // Empty unless caracal is reached through a local socket
+
+    static bool probe_unix_socket(const char *caracal_socket, const char *caracal_host);
 };